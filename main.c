@@ -30,13 +30,62 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <math.h>
 
 #define MAX_ROWS 20
 #define MAX_COLS 20
+#define MAX_NEIGHBOURS 6 // hex layout; the square grid has 4
 
-// For overall what is in a tile
-enum Terrain {LHO_EMPTY = -1, LHO_RIVER = 0, LHO_LANDSCAPE = 1};
+/*
+  Build options. Each of these parts of the solver can be left out with
+  -DLHO_<NAME>=0, for a smaller, leaner binary or to measure what it buys.
+  What is left out is compiled away, not switched off at run time, so it
+  costs nothing in the default search's inner loop. --bench prints which
+  are built in.
+
+  LHO_BOUNDS         the default search's cut-offs by value and tile bounds
+  LHO_SYMMETRY       the default search only starts rivers in one quarter
+                     (one eighth if square) of a grid that is symmetric
+  LHO_TRANSPOSITION  the default search remembers positions it has finished
+                     so it doesn't search them again when it reaches them
+                     by placing the same tiles in another order
+  LHO_INSTRUMENT     the prefix profiler (--profile-prefix)
+*/
+#ifndef LHO_BOUNDS
+#define LHO_BOUNDS 1
+#endif
+#ifndef LHO_SYMMETRY
+#define LHO_SYMMETRY 1
+#endif
+#ifndef LHO_TRANSPOSITION
+#define LHO_TRANSPOSITION 1
+#endif
+#ifndef LHO_INSTRUMENT
+#define LHO_INSTRUMENT 1
+#endif
+#if defined(LHO_CHECK_BOUND) && !LHO_BOUNDS
+#error "LHO_CHECK_BOUND needs LHO_BOUNDS"
+#endif
+
+// For overall what is in a tile. Blocked tiles (road, other cards) can't be
+// built on and don't count as a neighbour of anything.
+enum Terrain {LHO_EMPTY = -1, LHO_RIVER = 0, LHO_LANDSCAPE = 1,
+              LHO_BLOCKED = 2};
 
 // For what specific landscape tile we're using
 enum Landscape {LHO_MEADOW = 0, LHO_THICKET = 1, LHO_MOUNTAIN = 2,
@@ -60,6 +109,9 @@ struct Tile {
   enum Terrain type; // -1 is empty, 0 is river, 1 is landscape
   int numAdjRivers;
   int numAdjLands;
+  int numAdjOpen; // neighbours that aren't blocked
+  int val; // what this tile adds to grid->val
+  int bound; // most this tile could ever add, see tile_bound
 };
 
 struct Grid {
@@ -68,17 +120,67 @@ struct Grid {
   int numFilledTiles;
   int maxTiles;
   bool full;
-  int val;
+  int val; // kept up to date by add_land/add_river/remove_terrain
+  int bound; // sum of tile bounds, never below the value of any completion
 };
 
-static int numRows;
-static int numCols;
+// The grid being solved. Every thread has its own copy so that several grids
+// can be solved at once; threads helping with one grid call load_instance
+// with their parent's settings first.
+static _Thread_local int numRows;
+static _Thread_local int numCols;
+
+static _Thread_local enum Landscape landChoice;
+static _Thread_local int landValue; // value for a single landscape tile
+static _Thread_local int maxTileVal;
+
+static _Thread_local int bestVal = -1;
+
+// Tiles a river may start on by linear index, or NULL for the edge of the
+// grid (see on_border). Reset by load_instance.
+static _Thread_local const bool *riverStarts = NULL;
 
-static enum Landscape landChoice;
-static int landValue; // value for a single landscape tile
-static int maxTileVal;
+// Tiles the river has to cover by linear index, or NULL for none. Only
+// --engine=bidir and --engine=brute keep to them, so the other engines hand
+// such grids over to bidir. Reset by load_instance.
+static _Thread_local const bool *riverFixed = NULL;
+
+// With --induced, searches that grow the river a tile at a time never let it
+// touch itself: a new river tile can only border the head it grew from.
+static bool inducedRivers = false;
+
+// Value of a single landscape tile indexed by [numAdjRivers][numAdjLands],
+// filled in by init_landscape
+static _Thread_local int tileVals[MAX_NEIGHBOURS + 1][MAX_NEIGHBOURS + 1];
+
+// Best value a landscape tile could reach indexed by [numAdjRivers]
+// [numAdjLands][number of empty neighbours], also filled by init_landscape
+static _Thread_local int tileBounds[MAX_NEIGHBOURS + 1][MAX_NEIGHBOURS + 1]
+                                   [MAX_NEIGHBOURS + 1];
+
+int tile_value(int numRivers, int numLands);
+
+// Set by whoever started the current solve: a flag the engines poll to stop
+// early, and a function told about every better layout they find
+static _Thread_local atomic_bool *cancelFlag = NULL;
+static _Thread_local void (*incumbentHook)(int value) = NULL;
+static _Thread_local int lastIncumbent = -1;
+
+// true once the current solve has been asked to stop
+static inline bool solve_cancelled(void)
+{
+  return cancelFlag != NULL &&
+         atomic_load_explicit(cancelFlag, memory_order_relaxed);
+}
 
-static int bestVal = -1;
+// called by the engines whenever they find a layout worth value
+static inline void report_incumbent(int value)
+{
+  if (incumbentHook != NULL && value > lastIncumbent) {
+    lastIncumbent = value;
+    incumbentHook(value);
+  }
+}
 
 // Function to set static land properties:
 void init_landscape(int choice)
@@ -105,6 +207,176 @@ void init_landscape(int choice)
       maxTileVal = 3*LHO_SUBURBVAL;
       break;
   }
+
+  int r,l,e,a,b;
+  for (r = 0; r <= MAX_NEIGHBOURS; r++) {
+    for (l = 0; l <= MAX_NEIGHBOURS; l++) {
+      tileVals[r][l] = tile_value(r, l);
+    }
+  }
+
+  // each empty neighbour may still become a river, landscape, or nothing
+  for (r = 0; r <= MAX_NEIGHBOURS; r++) {
+    for (l = 0; r + l <= MAX_NEIGHBOURS; l++) {
+      for (e = 0; r + l + e <= MAX_NEIGHBOURS; e++) {
+        int best = 0;
+        for (a = 0; a <= e; a++) {
+          for (b = 0; a + b <= e; b++) {
+            if (tileVals[r + a][l + b] > best) {
+              best = tileVals[r + a][l + b];
+            }
+          }
+        }
+        tileBounds[r][l][e] = best;
+      }
+    }
+  }
+}
+
+// Value of one landscape tile with the given neighbour counts, using the same
+// rules as the val_calc_* functions below
+int tile_value(int numRivers, int numLands)
+{
+  switch (landChoice) {
+    case LHO_MEADOW:
+    case LHO_THICKET:
+      if (numRivers == 0) {
+        return landValue;
+      }
+      return (landValue * 2) * numRivers;
+    case LHO_SUBURB:
+      if (numLands == 4) {
+        return 2*landValue;
+      } else if (numRivers != 0) {
+        return (landValue * 2) * numRivers;
+      }
+      return landValue;
+    case LHO_MOUNTAIN:
+      return numLands * landValue * (1 + numRivers);
+  }
+
+  return 0;
+}
+
+/*
+  Cell adjacency
+
+  Cells are numbered by linear index over the rows x cols box whatever the
+  layout. On the square layout a cell's neighbours are worked out from its
+  row and column, which is what the hot paths (add_land, add_river,
+  remove_terrain, score_children) are written for. Any other layout is built
+  by adjacency_setup into compressed sparse rows: the neighbours of cell c
+  are adjList[adjStart[c]] up to adjList[adjStart[c + 1]], with their rows
+  and columns alongside so the grid can be updated without dividing, and
+  adjBorder[c] marks the cells that are missing a neighbour, which is where
+  a river may start unless told otherwise. Masks and irregular areas are
+  blocked tiles as before, on any layout.
+
+  --layout=hex shifts odd rows half a tile right, so each tile touches two
+  in the rows above and below as well as the two beside it.
+  --layout=generic is the square grid through the lists, to measure what the
+  generic path costs. Engines that depend on the square grid (rds, lines and
+  the precomputed table) are only used when adjSquare is set.
+*/
+
+enum Layout {LHO_LAYOUT_SQUARE, LHO_LAYOUT_HEX, LHO_LAYOUT_GENERIC};
+
+static enum Layout gridLayout = LHO_LAYOUT_SQUARE; // set by --layout
+
+static const char *const layoutNames[] = {"square", "hex", "generic"};
+
+static _Thread_local bool adjGeneric; // neighbours come from the lists
+static _Thread_local bool adjSquare; // neighbours are those of the square grid
+static _Thread_local int adjDegree; // neighbours of a tile away from the edge
+static _Thread_local int adjStart[MAX_ROWS * MAX_COLS + 1];
+static _Thread_local int adjList[MAX_ROWS * MAX_COLS * MAX_NEIGHBOURS];
+static _Thread_local unsigned char adjRow[MAX_ROWS * MAX_COLS * MAX_NEIGHBOURS];
+static _Thread_local unsigned char adjCol[MAX_ROWS * MAX_COLS * MAX_NEIGHBOURS];
+static _Thread_local bool adjBorder[MAX_ROWS * MAX_COLS];
+
+// Neighbours of (i,j) on layout, square ones first in the order
+// get_neighbours has always given them
+static int layout_neighbours(enum Layout layout, int i, int j,
+                             int nbrs[MAX_NEIGHBOURS])
+{
+  int n = 0;
+
+  if (i > 0) {
+    nbrs[n++] = (i-1) * numCols + j;
+  }
+  if (i < numRows - 1) {
+    nbrs[n++] = (i+1) * numCols + j;
+  }
+  if (j > 0) {
+    nbrs[n++] = i * numCols + j - 1;
+  }
+  if (j < numCols - 1) {
+    nbrs[n++] = i * numCols + j + 1;
+  }
+
+  if (layout == LHO_LAYOUT_HEX) {
+    int side = (i % 2) ? j + 1 : j - 1; // odd rows lean right
+    if (side >= 0 && side < numCols && i > 0) {
+      nbrs[n++] = (i-1) * numCols + side;
+    }
+    if (side >= 0 && side < numCols && i < numRows - 1) {
+      nbrs[n++] = (i+1) * numCols + side;
+    }
+  }
+
+  return n;
+}
+
+// Builds the neighbour lists for the current grid size and gridLayout
+static void adjacency_setup(void)
+{
+  int c, k, n = 0;
+
+  adjGeneric = (gridLayout != LHO_LAYOUT_SQUARE);
+  adjSquare = (gridLayout != LHO_LAYOUT_HEX);
+  adjDegree = (gridLayout == LHO_LAYOUT_HEX) ? 6 : 4;
+  if (!adjGeneric) {
+    return;
+  }
+
+  for (c = 0; c < numRows * numCols; c++) {
+    int deg = layout_neighbours(gridLayout, c / numCols, c % numCols,
+                                adjList + n);
+    adjStart[c] = n;
+    adjBorder[c] = (deg < adjDegree);
+    for (k = n; k < n + deg; k++) {
+      adjRow[k] = adjList[k] / numCols;
+      adjCol[k] = adjList[k] % numCols;
+    }
+    n += deg;
+  }
+  adjStart[c] = n;
+}
+
+static void prior_setup(void);
+
+// Sets up this thread to solve a rows x cols grid of the given landscape
+void load_instance(int rows, int cols, int land)
+{
+  int r,l;
+
+  numRows = rows;
+  numCols = cols;
+  riverStarts = NULL;
+  riverFixed = NULL;
+  init_landscape(land);
+  adjacency_setup();
+  prior_setup();
+
+  // a tile with more than four neighbours can be worth more than
+  // init_landscape allowed for
+  for (r = 0; r <= adjDegree; r++) {
+    for (l = 0; r + l <= adjDegree && adjDegree > 4; l++) {
+      if (tileVals[r][l] > maxTileVal) {
+        maxTileVal = tileVals[r][l];
+      }
+    }
+  }
 }
 
 // function to return row for a given linear index
@@ -130,625 +402,8425 @@ void get_idx(int linIndex, int idx[2]) // always of length 2
   return;
 }
 
-// Function to allocate a grid, defaults to empty cells:
-void allocate_grid(struct Grid *grid)
+// number of cells bordering a given linear index
+int num_neighbours(int linIndex)
 {
-  int i,j;
-  grid->grid = malloc(numRows * sizeof(grid->grid));
-  for (i = 0; i < numRows; i++) {
-    grid->grid[i] = malloc(numCols * sizeof(struct Tile));
-    for (j = 0; j < numCols; j ++) {
-      grid->grid[i][j].type = LHO_EMPTY;
-      grid->grid[i][j].numAdjRivers = 0;
-      grid->grid[i][j].numAdjLands = 0;
-    }
+  if (adjGeneric) {
+    return adjStart[linIndex + 1] - adjStart[linIndex];
   }
 
-  grid->river.newRiver = true;
-  grid->river.headLoc = -1;
-  grid->river.oldHeadLoc = -1;
-  grid->full = false;
-  grid->numFilledTiles = 0;
-  grid->maxTiles = numRows * numCols;
-  grid->val = -1;
+  int i = get_row_idx(linIndex), j = get_col_idx(linIndex);
+  int n = 0;
 
+  if (i > 0) {
+    n++;
+  }
+  if (i < numRows - 1) {
+    n++;
+  }
+  if (j > 0) {
+    n++;
+  }
+  if (j < numCols - 1) {
+    n++;
+  }
 
-  return;
+  return n;
 }
 
-// de-allocate our array
-void free_grid(struct Grid *grid)
+// fills nbrs with the linear indices of the cells bordering linIndex and
+// returns how many there are
+int get_neighbours(int linIndex, int nbrs[MAX_NEIGHBOURS])
 {
-  int i;
-  for (i = 0; i < numRows; i++) {
-    free(grid->grid[i]);
+  if (adjGeneric) {
+    int n = adjStart[linIndex + 1] - adjStart[linIndex];
+    memcpy(nbrs, adjList + adjStart[linIndex], n * sizeof(int));
+    return n;
   }
-  free(grid->grid);
-  return;
-}
-
-// Performs deep copy of grid from one pointer to another
-// copies from inGrid to dupGrid, both need to be freed separately.
-void copy_grid(struct Grid *dupGrid, struct Grid *inGrid)
-{
-  dupGrid->numFilledTiles = inGrid->numFilledTiles;
-  dupGrid->maxTiles = inGrid->maxTiles;
-  dupGrid->full = inGrid->full;
-  dupGrid->val = inGrid->val;
-  dupGrid->river = inGrid->river;
 
-  int i,j;
+  int i = get_row_idx(linIndex), j = get_col_idx(linIndex);
+  int n = 0;
 
-  for (i = 0; i < numRows; i++) {
-    for (j = 0; j < numCols; j++) {
-      dupGrid->grid[i][j] = inGrid->grid[i][j];
-    }
+  if (i > 0) {
+    nbrs[n++] = linIndex - numCols;
+  }
+  if (i < numRows - 1) {
+    nbrs[n++] = linIndex + numCols;
+  }
+  if (j > 0) {
+    nbrs[n++] = linIndex - 1;
+  }
+  if (j < numCols - 1) {
+    nbrs[n++] = linIndex + 1;
   }
+
+  return n;
 }
 
-// Function to check if a location is already occupied
-// returns false if occupied, true if unoccupied
-bool chk_loc(int linIndex, struct Grid grid)
+// true if a linear index lies on the outside edge of the grid
+bool on_border(int linIndex)
 {
-  if (linIndex < 0 || linIndex > numRows * numCols - 1) {
-    //printf("Outside Array\n");
-    return false; // we can't write outside our array...
+  if (adjGeneric) {
+    return adjBorder[linIndex];
   }
 
-  int idx[2] = {0};
-  get_idx(linIndex, idx);
-  if ( grid.grid[idx[0]][idx[1]].type > LHO_EMPTY ) {
-    // Location in use
-    //printf("Bad Location\n");
-    return false;
-  }
-    //printf("Good Location\n");
-  return true;
-}
+  int i = get_row_idx(linIndex), j = get_col_idx(linIndex);
 
+  return (i == 0 || j == 0 || i == numRows - 1 || j == numCols - 1);
+}
 
-// Function to add a landscape tile at a given linear index
-// if index is < 0, we want a random location for the first tile
-// designed to be used like: add_land(index, &grid); to update in place
-// returns true when land was added, false if not
-bool add_land(int linIndex, struct Grid *grid)
+// true if two linear indices border each other
+bool adjacent(int a, int b)
 {
-
-  //struct Grid g = *grid;
-  bool validLoc = chk_loc(linIndex, *grid);
-
-  if (validLoc) {
-    int idx[2] = {0};
-    get_idx(linIndex, idx);
-    grid->grid[idx[0]][idx[1]].type = LHO_LANDSCAPE;
-    grid->numFilledTiles++;
-    if (grid->numFilledTiles == grid->maxTiles) {
-      grid->full = true;
+  if (adjGeneric) {
+    int k;
+    for (k = adjStart[a]; k < adjStart[a + 1]; k++) {
+      if (adjList[k] == b) {
+        return true;
+      }
     }
+    return false;
+  }
 
-    // Increase nearby land counts::
-    int i = idx[0], j = idx[1];
-    // Increment river adjacency counts:
-    if (i > 0) {
-      grid->grid[i-1][j].numAdjLands++;
-    }
+  return abs(get_row_idx(a) - get_row_idx(b)) +
+         abs(get_col_idx(a) - get_col_idx(b)) == 1;
+}
 
-    if (i < numRows - 1) {
-      grid->grid[i+1][j].numAdjLands++;
-    }
-    if (j > 0) {
-      grid->grid[i][j-1].numAdjLands++;
-    }
+// whether a river may start on linIndex
+bool river_start(int linIndex)
+{
+  return riverStarts ? riverStarts[linIndex] : on_border(linIndex);
+}
 
-    if (j < numCols - 1) {
-      grid->grid[i][j+1].numAdjLands++;
-    }
+// Walks the river of grid from a tile it may start on through all its
+// tiles, into path. Returns whether it got through them all.
+static bool river_follow(const struct Grid *grid, bool *seen, int *path,
+                         int len, int total)
+{
+  int nbrs[MAX_NEIGHBOURS];
+  int numNbrs = get_neighbours(path[len - 1], nbrs), k;
+
+  if (len == total) {
     return true;
   }
+  for (k = 0; k < numNbrs; k++) {
+    int n = nbrs[k];
+    if (!seen[n] &&
+        grid->grid[get_row_idx(n)][get_col_idx(n)].type == LHO_RIVER) {
+      seen[n] = true;
+      path[len] = n;
+      if (river_follow(grid, seen, path, len + 1, total)) {
+        return true;
+      }
+      seen[n] = false;
+    }
+  }
 
   return false;
 }
 
-// designed to be used like: add_river(index, &grid); to update in place
-// returns true on successful add, false on failure
-bool add_river(int linIndex, struct Grid *grid)
+// Puts the river of grid in path in order, from the end it starts on.
+// Returns its length.
+static int river_order(const struct Grid *grid, int *path)
 {
-  int curLoc;
-  int idx[2] = {0};
-  get_idx(linIndex, idx);
+  bool seen[MAX_ROWS * MAX_COLS] = {false};
+  int total = 0, i;
 
-  if (grid->river.newRiver) {
-    // Note that we have to start on a border
-    if (idx[0] == 0 || idx[1] == 0 ||
-        idx[0] == numRows - 1 || idx[1] == numCols - 1) {
-      grid->river.newRiver = false;
-    } else {
-      //printf("Not starting on edge!\n");
-      return false;
-    }
+  for (i = 0; i < numRows * numCols; i++) {
+    total += grid->grid[get_row_idx(i)][get_col_idx(i)].type == LHO_RIVER;
   }
-
-  //struct Grid g = *grid;
-  bool validLoc = chk_loc(linIndex, *grid);
-
-  curLoc = grid->river.headLoc;
-//printf("curLoc: %d\n", curLoc);
-  int curIdx[2];
-  get_idx(curLoc, curIdx);
-//printf("idx[0]: %d, idx[1]: %d\ncurIdx[0]: %d, curIdx[1]: %d\n", idx[0], idx[1], curIdx[0], curIdx[1]);
-  if (
-    !(
-      ( (abs(idx[0] - curIdx[0]) == 1) && (abs(idx[1] - curIdx[1]) == 0) ) ||
-      ( (abs(idx[0] - curIdx[0]) == 0) && (abs(idx[1] - curIdx[1]) == 1) )
-    ) && curLoc > -1)
-  {
-    //printf("Not near previous river head!\n");
-    return false; // River has to connect to previous segments of river
+  for (i = 0; i < numRows * numCols && total > 0; i++) {
+    if (grid->grid[get_row_idx(i)][get_col_idx(i)].type == LHO_RIVER &&
+        river_start(i)) {
+      seen[i] = true;
+      path[0] = i;
+      if (river_follow(grid, seen, path, 1, total)) {
+        return total;
+      }
+      seen[i] = false;
+    }
   }
 
-  if (validLoc) {
-    grid->river.oldHeadLoc = grid->river.headLoc;
-    grid->river.headLoc = linIndex;
+  return 0;
+}
 
-    grid->grid[idx[0]][idx[1]].type = LHO_RIVER;
-    grid->numFilledTiles++;
-    if (grid->numFilledTiles == grid->maxTiles) {
-      grid->full = true;
-    }
+/*
+  Move priors
 
-    int i = idx[0], j = idx[1];
-    // Increment river adjacency counts:
-    if (i > 0) {
-      grid->grid[i-1][j].numAdjRivers++;
-    }
+  Optimal rivers of grids that are alike look alike, mostly serpentines with
+  the same spacing, so the steps they're made of are worth remembering. A
+  step is described by whether it goes straight on or turns left or right,
+  what the step before it did, and how far from the edge of the grid it
+  lands (up to PRIOR_DISTS - 1). With --learn-priors, the steps of every
+  optimal layout that an exact engine finds on a square grid are counted.
+  The counts are kept apart by --induced, landscape and size of grid. At
+  exit they are added to the file named by --priors.
 
-    if (i < numRows - 1) {
-      grid->grid[i+1][j].numAdjRivers++;
-    }
-    if (j > 0) {
-      grid->grid[i][j-1].numAdjRivers++;
-    }
+  --priors=FILE maps the file into memory at startup. Nothing is parsed, so
+  this takes microseconds however many solves went into it. The default
+  search then tries the river's next steps first, most common first. The
+  tempering engine proposes steps in proportion to the counts. Grids bigger
+  than any that were solved exactly are searched with the counts of the
+  biggest that were, but always learn into their own size.
+  A missing file changes nothing. The river search doesn't use the counts:
+  it finds the optimum early anyway and spends its time proving it, so
+  sorting at every node only slowed it down.
+*/
 
-    if (j < numCols - 1) {
-      grid->grid[i][j+1].numAdjRivers++;
-    }
+#define PRIOR_SIZES 5 // up to 16, 36, 64 and 144 tiles, and bigger
+#define PRIOR_DISTS 4
+#define PRIOR_VERSION 1
 
+enum Turn {LHO_TURN_STRAIGHT, LHO_TURN_LEFT, LHO_TURN_RIGHT, LHO_NUM_TURNS};
 
-    return true;
-  }
+// The file as it is mapped. The step before a river's second one is
+// counted as LHO_NUM_TURNS. The counts are atomic (and read and bumped
+// relaxed) as pool threads search with counts that others are learning into.
+struct PriorFile {
+  char magic[8]; // "LHOPRIOR"
+  uint32_t version;
+  uint32_t reserved;
+  _Atomic uint32_t counts[2][4][PRIOR_SIZES][LHO_NUM_TURNS + 1][LHO_NUM_TURNS]
+                 [PRIOR_DISTS]; // [induced][landscape][size]...
+};
 
-  return false; // Shouldn't get here, but just in case
-}
+static const char *priorPath = NULL; // set by --priors
+static bool priorLearn = false; // set by --learn-priors
+static struct PriorFile *priors = NULL; // mapped copy-on-write, or NULL
 
+// the counts this thread's grid is searched with, set by load_instance
+// (NULL for none), the counts of its own size that it learns into (NULL
+// off square grids), and how far each tile is from the edge
+static _Thread_local _Atomic uint32_t
+  (*priorCounts)[LHO_NUM_TURNS][PRIOR_DISTS];
+static _Thread_local _Atomic uint32_t
+  (*priorTarget)[LHO_NUM_TURNS][PRIOR_DISTS];
+static _Thread_local unsigned char priorDist[MAX_ROWS * MAX_COLS];
 
-// function to remove terrain at a given location, sets to empty
-void remove_terrain(int linIndex, struct Grid *grid)
+static void prior_setup(void)
 {
-  int idx[2];
-  int headLoc = grid->river.headLoc;
-  enum Terrain oldType;
+  int cells = numRows * numCols;
+  int size = cells <= 16 ? 0 : cells <= 36 ? 1 : cells <= 64 ? 2 :
+             cells <= 144 ? 3 : 4;
+  int c;
 
-  get_idx(linIndex, idx);
-  oldType = grid->grid[idx[0]][idx[1]].type;
-  grid->grid[idx[0]][idx[1]].type = LHO_EMPTY;
-  if (oldType > LHO_EMPTY) {
-    grid->numFilledTiles--; // decrement counter of filled tiles
-  }
+  priorTarget = (priors != NULL && adjSquare) ?
+                priors->counts[inducedRivers][landChoice][size] : NULL;
 
-  // If we move the head of the river, we need to update to reflect that
-  // potentially also allwoing a new river to start if we removed all of it.
-  if (headLoc == linIndex) {
-    grid->river.headLoc = grid->river.oldHeadLoc;
-    if (grid->river.headLoc == -1) {
-      grid->river.newRiver = true;
+  // grids bigger than any solved exactly borrow the biggest that were
+  priorCounts = NULL;
+  for (; priors != NULL && adjSquare && size >= 0; size--) {
+    _Atomic uint32_t *counts = &priors->counts[inducedRivers][landChoice]
+                                              [size][0][0][0];
+    for (c = 0; c < (LHO_NUM_TURNS + 1) * LHO_NUM_TURNS * PRIOR_DISTS &&
+                atomic_load_explicit(&counts[c], memory_order_relaxed) == 0;
+         c++);
+    if (c < (LHO_NUM_TURNS + 1) * LHO_NUM_TURNS * PRIOR_DISTS) {
+      priorCounts = priors->counts[inducedRivers][landChoice][size];
+      break;
     }
   }
-
-  // if we removed a river, decrement river counts:
-  if (oldType == LHO_RIVER) {
-    int i = idx[0], j = idx[1];
-    if (i > 0) {
-      grid->grid[i-1][j].numAdjRivers--;
-    }
-
-    if (i < numRows - 1) {
-      grid->grid[i+1][j].numAdjRivers--;
-    }
-    if (j > 0) {
-      grid->grid[i][j-1].numAdjRivers--;
+  for (c = 0; priorTarget != NULL && c < cells; c++) {
+    int i = c / numCols, j = c % numCols;
+    int d = i < j ? i : j;
+    if (numRows - 1 - i < d) {
+      d = numRows - 1 - i;
     }
-
-    if (j < numCols - 1) {
-      grid->grid[i][j+1].numAdjRivers--;
-    }
-  } else if (oldType == LHO_LANDSCAPE) {
-    // Increase nearby land counts:
-    int i = idx[0], j = idx[1];
-    if (i > 0) {
-      grid->grid[i-1][j].numAdjLands--;
+    if (numCols - 1 - j < d) {
+      d = numCols - 1 - j;
     }
+    priorDist[c] = d < PRIOR_DISTS - 1 ? d : PRIOR_DISTS - 1;
+  }
+}
 
-    if (i < numRows - 1) {
-      grid->grid[i+1][j].numAdjLands--;
-    }
-    if (j > 0) {
-      grid->grid[i][j-1].numAdjLands--;
-    }
+// the turn from the step a to b into the step b to c, worked out from the
+// steps as differences of linear index, as this is on every node's path
+static enum Turn prior_turn(int a, int b, int c)
+{
+  int d = b - a, e = c - b;
 
-    if (j < numCols - 1) {
-      grid->grid[i][j+1].numAdjLands--;
-    }
+  if (d == e) {
+    return LHO_TURN_STRAIGHT;
   }
-
-  return;
+  int dr = d == numCols ? 1 : d == -numCols ? -1 : 0, dc = dr ? 0 : d;
+  int er = e == numCols ? 1 : e == -numCols ? -1 : 0, ec = er ? 0 : e;
+  return dr * ec - dc * er > 0 ? LHO_TURN_LEFT : LHO_TURN_RIGHT;
 }
 
-// for meadows and thickets:
-int val_calc_meadow_thicket(struct Grid grid)
+// How often optimal rivers that came to b from a went on to c. z is the tile
+// before a, or -1 if a is where the river started, or -2 if not known.
+static unsigned prior_weight(int z, int a, int b, int c)
 {
-  int i,j;
-  int val = 0;
-  int numRivers;
+  int t, turn = prior_turn(a, b, c), dist = priorDist[c];
+  unsigned weight = 0;
 
-  for (i = 0; i < numRows; i++) {
-    for (j = 0; j < numCols; j++) {
-      if (grid.grid[i][j].type == LHO_LANDSCAPE) {
-        numRivers = grid.grid[i][j].numAdjRivers;
-        if (numRivers == 0) {
-          val += landValue;
-        } else {
-          val += (landValue * 2) * numRivers; // might be a more clever way to do this besides if/else
-        }
-      }
+  if (z >= 0) {
+    return atomic_load_explicit(&priorCounts[prior_turn(z, a, b)][turn][dist],
+                                memory_order_relaxed);
+  }
+  if (z == -1) {
+    return atomic_load_explicit(&priorCounts[LHO_NUM_TURNS][turn][dist],
+                                memory_order_relaxed);
+  }
+  for (t = 0; t <= LHO_NUM_TURNS; t++) {
+    weight += atomic_load_explicit(&priorCounts[t][turn][dist],
+                                   memory_order_relaxed);
+  }
+  return weight;
+}
+
+// Sorts the n tiles in cells, which the river might go on to from b (having
+// come from a, see prior_weight for z), most common first
+static void prior_sort(int *cells, int n, int z, int a, int b)
+{
+  unsigned weight[MAX_NEIGHBOURS];
+  int i, k;
+
+  for (i = 0; i < n; i++) {
+    int c = cells[i];
+    unsigned w = prior_weight(z, a, b, c);
+    for (k = i; k > 0 && weight[k - 1] < w; k--) {
+      cells[k] = cells[k - 1];
+      weight[k] = weight[k - 1];
     }
+    cells[k] = c;
+    weight[k] = w;
   }
+}
 
-  return val;
+// Counts the steps of the river of grid, an optimal layout, with
+// --learn-priors
+static void prior_learn(const struct Grid *grid)
+{
+  int path[MAX_ROWS * MAX_COLS];
+  int len, i;
+
+  if (!priorLearn || priorTarget == NULL) {
+    return;
+  }
+  len = river_order(grid, path);
+  for (i = 2; i < len; i++) {
+    int before = i > 2 ? prior_turn(path[i - 3], path[i - 2], path[i - 1]) :
+                 LHO_NUM_TURNS;
+    atomic_fetch_add_explicit(&priorTarget[before][prior_turn(path[i - 2],
+                              path[i - 1], path[i])][priorDist[path[i]]], 1,
+                              memory_order_relaxed);
+  }
 }
 
-// Function for calculating value of a suburb
-int val_calc_suburb(struct Grid grid)
+// Maps --priors. With --learn-priors a missing file starts out empty.
+// Returns false if the file can't be used.
+static bool prior_load(void)
 {
-  int i,j;
-  int val = 0;
-  int numRivers, numSuburbs;
+  struct stat st;
+  int fd = open(priorPath, O_RDONLY);
+
+  if (fd < 0 && errno == ENOENT) {
+    if (priorLearn) {
+      priors = calloc(1, sizeof(struct PriorFile));
+      memcpy(priors->magic, "LHOPRIOR", 8);
+      priors->version = PRIOR_VERSION;
+    }
+    return true;
+  }
+  if (fd < 0) {
+    fprintf(stderr, "Can't open %s: %s\n", priorPath, strerror(errno));
+    return false;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size != sizeof(struct PriorFile)) {
+    fprintf(stderr, "%s isn't a priors file\n", priorPath);
+    close(fd);
+    return false;
+  }
+  // private, so learning can add to it in memory without touching the file
+  void *map = mmap(NULL, sizeof(struct PriorFile), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Can't map %s: %s\n", priorPath, strerror(errno));
+    return false;
+  }
+  priors = map;
+  if (memcmp(priors->magic, "LHOPRIOR", 8) != 0 ||
+      priors->version != PRIOR_VERSION) {
+    fprintf(stderr, "%s isn't a priors file\n", priorPath);
+    munmap(map, sizeof(struct PriorFile));
+    priors = NULL;
+    return false;
+  }
+  return true;
+}
+
+// Writes the priors, with what was learned, back over --priors
+static void prior_save(void)
+{
+  char tmpPath[4096];
+
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", priorPath);
+  FILE *out = fopen(tmpPath, "wb");
+  if (out == NULL ||
+      fwrite(priors, sizeof(struct PriorFile), 1, out) != 1 ||
+      fflush(out) != 0 || fsync(fileno(out)) != 0) {
+    fprintf(stderr, "Can't write %s: %s\n", tmpPath, strerror(errno));
+    if (out != NULL) {
+      fclose(out);
+    }
+    return;
+  }
+  fclose(out);
+  if (rename(tmpPath, priorPath) != 0) {
+    fprintf(stderr, "Can't replace %s: %s\n", priorPath, strerror(errno));
+  }
+}
+
+/*
+  Memory accounting
+
+  The solver allocates through mem_alloc and friends, which keep the bytes in
+  use and the peak for each part of it, and --mem-stats prints them at exit.
+  With --mem-limit=MB the total may not go over the limit: mem_try_alloc
+  first drops rds tables nobody is using (oldest first) and, if that doesn't
+  make room, returns NULL. Everything that asks with mem_try_alloc can do
+  without, by falling back to a leaner engine. mem_alloc is for the few
+  things every engine needs (grids mostly) and is counted but never refused;
+  the plain recursion checks up front that its grids will fit instead.
+*/
+
+enum MemKind {LHO_MEM_GRIDS, LHO_MEM_SEARCH, LHO_MEM_TABLES, LHO_MEM_PROFILE,
+              LHO_NUM_MEM};
+
+static const char *const memKindNames[LHO_NUM_MEM] = {
+  "grids", "search", "tables", "profile"
+};
+
+// set by --mem-limit, 0 for none
+static size_t memLimit = 0;
+
+static atomic_size_t memInUse[LHO_NUM_MEM], memPeak[LHO_NUM_MEM];
+static atomic_size_t memTotal, memTotalPeak;
+
+// in front of every block, padded so the block stays aligned
+union MemHeader {
+  struct {
+    size_t bytes;
+    enum MemKind kind;
+  } h;
+  max_align_t align;
+};
 
+static void rds_evict(size_t bytes);
+
+static void mem_raise_peak(atomic_size_t *peak, size_t now)
+{
+  size_t old = atomic_load(peak);
+  while (now > old && !atomic_compare_exchange_weak(peak, &old, now)) {
+  }
+}
+
+// Books bytes against the limit, unless enforce is set and they don't fit
+static bool mem_reserve(enum MemKind kind, size_t bytes, bool enforce)
+{
+  size_t total = atomic_fetch_add(&memTotal, bytes) + bytes;
+  if (enforce && memLimit && total > memLimit) {
+    atomic_fetch_sub(&memTotal, bytes);
+    return false;
+  }
+  mem_raise_peak(&memTotalPeak, total);
+  mem_raise_peak(&memPeak[kind],
+                 atomic_fetch_add(&memInUse[kind], bytes) + bytes);
+  return true;
+}
+
+static void mem_unreserve(enum MemKind kind, size_t bytes)
+{
+  atomic_fetch_sub(&memTotal, bytes);
+  atomic_fetch_sub(&memInUse[kind], bytes);
+}
+
+static void *mem_block(enum MemKind kind, size_t bytes, bool enforce)
+{
+  size_t size = sizeof(union MemHeader) + bytes;
+
+  if (!mem_reserve(kind, size, enforce)) {
+    rds_evict(size);
+    if (!mem_reserve(kind, size, enforce)) {
+      return NULL;
+    }
+  }
+  union MemHeader *header = malloc(size);
+  if (header == NULL) {
+    mem_unreserve(kind, size);
+    return NULL;
+  }
+  header->h.bytes = size;
+  header->h.kind = kind;
+
+  return header + 1;
+}
+
+// Allocates bytes for kind, going over the limit if need be
+void *mem_alloc(enum MemKind kind, size_t bytes)
+{
+  return mem_block(kind, bytes, false);
+}
+
+// Allocates bytes for kind, or returns NULL if they'd go over the limit
+void *mem_try_alloc(enum MemKind kind, size_t bytes)
+{
+  return mem_block(kind, bytes, true);
+}
+
+// mem_try_alloc, zeroed
+void *mem_try_calloc(enum MemKind kind, size_t bytes)
+{
+  void *block = mem_try_alloc(kind, bytes);
+  if (block != NULL) {
+    memset(block, 0, bytes);
+  }
+  return block;
+}
+
+void mem_free(void *block)
+{
+  if (block == NULL) {
+    return;
+  }
+  union MemHeader *header = (union MemHeader *)block - 1;
+  mem_unreserve(header->h.kind, header->h.bytes);
+  free(header);
+}
+
+// Grows or shrinks block (NULL for a new one) to bytes within the limit.
+// Returns NULL and leaves block alone if it can't.
+void *mem_try_realloc(enum MemKind kind, void *block, size_t bytes)
+{
+  if (block == NULL) {
+    return mem_try_alloc(kind, bytes);
+  }
+  union MemHeader *header = (union MemHeader *)block - 1;
+  size_t old = header->h.bytes, size = sizeof(union MemHeader) + bytes;
+
+  if (size > old && !mem_reserve(kind, size - old, true)) {
+    rds_evict(size - old);
+    if (!mem_reserve(kind, size - old, true)) {
+      return NULL;
+    }
+  }
+  union MemHeader *moved = realloc(header, size);
+  if (moved == NULL) {
+    if (size > old) {
+      mem_unreserve(kind, size - old);
+    }
+    return NULL;
+  }
+  if (size < old) {
+    mem_unreserve(kind, old - size);
+  }
+  moved->h.bytes = size;
+
+  return moved + 1;
+}
+
+// bytes that can still be allocated under the limit
+size_t mem_headroom(void)
+{
+  size_t total = atomic_load(&memTotal);
+
+  if (!memLimit) {
+    return SIZE_MAX;
+  }
+  return total < memLimit ? memLimit - total : 0;
+}
+
+// Prints what each part of the solver has allocated, now and at most
+void mem_report(void)
+{
+  int k;
+
+  printf("\n Memory (bytes):\n\n  %-8s %14s %14s\n", "", "in use", "peak");
+  for (k = 0; k < LHO_NUM_MEM; k++) {
+    printf("  %-8s %14zu %14zu\n", memKindNames[k], atomic_load(&memInUse[k]),
+           atomic_load(&memPeak[k]));
+  }
+  printf("  %-8s %14zu %14zu\n", "total", atomic_load(&memTotal),
+         atomic_load(&memTotalPeak));
+  if (memLimit) {
+    printf("  %-8s %14zu\n", "limit", memLimit);
+  }
+}
+
+// Function to allocate a grid, defaults to empty cells:
+void allocate_grid(struct Grid *grid)
+{
+  int i,j;
+  grid->grid = mem_alloc(LHO_MEM_GRIDS, numRows * sizeof(grid->grid));
+  grid->bound = 0;
   for (i = 0; i < numRows; i++) {
-    for (j = 0; j < numCols; j++) {
-      if (grid.grid[i][j].type == LHO_LANDSCAPE) {
-        numRivers = grid.grid[i][j].numAdjRivers;
-        numSuburbs = grid.grid[i][j].numAdjLands;
-        if ( numSuburbs == 4 ) {
-          val += 2*landValue;
-        } else if (numRivers != 0) {
-          val += (landValue * 2) * numRivers;
-        } else {
-          val += landValue;
-        }
-      }
+    grid->grid[i] = mem_alloc(LHO_MEM_GRIDS, numCols * sizeof(struct Tile));
+    for (j = 0; j < numCols; j ++) {
+      grid->grid[i][j].type = LHO_EMPTY;
+      grid->grid[i][j].numAdjRivers = 0;
+      grid->grid[i][j].numAdjLands = 0;
+      grid->grid[i][j].numAdjOpen = num_neighbours(i*numCols + j);
+      grid->grid[i][j].val = 0;
+      grid->grid[i][j].bound = tileBounds[0][0][grid->grid[i][j].numAdjOpen];
+      grid->bound += grid->grid[i][j].bound;
     }
   }
 
-  return val;
+  grid->river.newRiver = true;
+  grid->river.headLoc = -1;
+  grid->river.oldHeadLoc = -1;
+  grid->full = false;
+  grid->numFilledTiles = 0;
+  grid->maxTiles = numRows * numCols;
+  grid->val = 0;
+
+
+  return;
 }
 
-// Function for calculating value of a mountain
-int val_calc_mountain(struct Grid grid)
+// de-allocate our array
+void free_grid(struct Grid *grid)
+{
+  int i;
+  for (i = 0; i < numRows; i++) {
+    mem_free(grid->grid[i]);
+  }
+  mem_free(grid->grid);
+  return;
+}
+
+// Performs deep copy of grid from one pointer to another
+// copies from inGrid to dupGrid, both need to be freed separately.
+void copy_grid(struct Grid *dupGrid, struct Grid *inGrid)
 {
+  dupGrid->numFilledTiles = inGrid->numFilledTiles;
+  dupGrid->maxTiles = inGrid->maxTiles;
+  dupGrid->full = inGrid->full;
+  dupGrid->val = inGrid->val;
+  dupGrid->bound = inGrid->bound;
+  dupGrid->river = inGrid->river;
+
   int i,j;
-  int val = 0;
-  int numRivers, numMountains;
 
   for (i = 0; i < numRows; i++) {
     for (j = 0; j < numCols; j++) {
-      if (grid.grid[i][j].type == LHO_LANDSCAPE) {
-        numRivers = grid.grid[i][j].numAdjRivers;
-        numMountains = grid.grid[i][j].numAdjLands;
-        val += numMountains * landValue;
-        val += numMountains * numRivers * landValue;
-      }
+      dupGrid->grid[i][j] = inGrid->grid[i][j];
     }
   }
+}
 
-  return val;
+/*
+  Incremental score and bound
+
+  Every tile keeps what it adds to grid->val and the most it could ever add
+  to it (its bound). A tile's value and bound only depend on its own type and
+  its neighbours' types, so when a tile changes only it and its neighbours
+  need to be rescored, and grid->bound is available at every node of
+  recurse_grid without a pass over the grid.
+
+  The bound of a landscape or empty tile is the best value it could reach if
+  each of its empty neighbours became a river, landscape or nothing. Rivers and
+  blocked tiles add nothing.
+*/
+
+// recomputes the value and bound of tile (i,j), updating the grid totals
+static void rescore_tile(struct Grid *grid, int i, int j)
+{
+  struct Tile *tile = &grid->grid[i][j];
+  int r = tile->numAdjRivers, l = tile->numAdjLands;
+  int e = tile->numAdjOpen - r - l;
+
+  grid->val -= tile->val;
+  grid->bound -= tile->bound;
+
+  if (tile->type == LHO_LANDSCAPE) {
+    tile->val = tileVals[r][l];
+    tile->bound = tileBounds[r][l][e];
+  } else if (tile->type == LHO_EMPTY) {
+    tile->val = 0;
+    tile->bound = tileBounds[r][l][e];
+  } else {
+    tile->val = 0;
+    tile->bound = 0;
+  }
+
+  grid->val += tile->val;
+  grid->bound += tile->bound;
 }
 
-// Function that returns value of a given grid:
-// actually sub-delegates to one of the functions for a particular type of
-// landscape tiles
-int val_calc(struct Grid grid)
+// adds delta to tile (i,j)'s count of neighbours of the given type (for a
+// blocked neighbour, takes it off its open neighbours) and rescores it
+static inline void tally_tile(struct Grid *grid, int i, int j,
+                              enum Terrain type, int delta)
 {
-  int val;
+  struct Tile *tile = &grid->grid[i][j];
 
-  switch (landChoice) {
-    case LHO_MEADOW:
-    case LHO_THICKET:
-      val = val_calc_meadow_thicket(grid);
-      break;
-    case LHO_SUBURB:
-      val = val_calc_suburb(grid);
-      break;
-    case LHO_MOUNTAIN:
-      val = val_calc_mountain(grid);
-      break;
+  if (type == LHO_RIVER) {
+    tile->numAdjRivers += delta;
+  } else if (type == LHO_LANDSCAPE) {
+    tile->numAdjLands += delta;
+  } else if (type == LHO_BLOCKED) {
+    tile->numAdjOpen -= delta;
   }
+  rescore_tile(grid, i, j);
+}
 
-  return val;
+// Updates the neighbours of linIndex after delta tiles of the given type
+// appeared there (-1 when one went away), and rescores it and them. Called
+// with a constant type, the square case compiles down to the four updates.
+static inline void retally_around(struct Grid *grid, int linIndex,
+                                  enum Terrain type, int delta)
+{
+  int i = get_row_idx(linIndex), j = get_col_idx(linIndex);
+
+  rescore_tile(grid, i, j);
+  if (adjGeneric) {
+    int k;
+    for (k = adjStart[linIndex]; k < adjStart[linIndex + 1]; k++) {
+      tally_tile(grid, adjRow[k], adjCol[k], type, delta);
+    }
+    return;
+  }
+
+  if (i > 0) {
+    tally_tile(grid, i-1, j, type, delta);
+  }
+  if (i < numRows - 1) {
+    tally_tile(grid, i+1, j, type, delta);
+  }
+  if (j > 0) {
+    tally_tile(grid, i, j-1, type, delta);
+  }
+  if (j < numCols - 1) {
+    tally_tile(grid, i, j+1, type, delta);
+  }
 }
 
-// Function to print ASCII structure of a grid
-void print_grid(struct Grid grid)
+// Value and bound of a grid worked out from scratch, to check the running
+// totals against when built with LHO_CHECK_BOUND
+int grid_bound(struct Grid grid)
+{
+  int nbrs[MAX_NEIGHBOURS];
+  int i,k, bound = 0;
+
+  for (i = 0; i < numRows * numCols; i++) {
+    struct Tile *tile = &grid.grid[get_row_idx(i)][get_col_idx(i)];
+    if (tile->type == LHO_LANDSCAPE || tile->type == LHO_EMPTY) {
+      int numNbrs = get_neighbours(i, nbrs), e = 0;
+      for (k = 0; k < numNbrs; k++) {
+        e += (grid.grid[get_row_idx(nbrs[k])][get_col_idx(nbrs[k])].type ==
+              LHO_EMPTY);
+      }
+      bound += tileBounds[tile->numAdjRivers][tile->numAdjLands][e];
+    }
+  }
+
+  return bound;
+}
+
+// Recomputes the adjacency counts of every tile from the tile types, for
+// grids that were filled in directly rather than through add_land/add_river
+void recount_grid(struct Grid *grid)
 {
   int i,j;
-  enum Terrain type;
-  char label[4];
 
-  // Speficy landscape string to match which type of thing we optimized:
-  switch (landChoice) {
-    case LHO_MEADOW:
-    case LHO_MOUNTAIN:
-      strcpy(label, " M ");
-      break;
-    case LHO_SUBURB:
-      strcpy(label, " S ");
-      break;
-    case LHO_THICKET:
-      strcpy(label, " T ");
-      break;
+  grid->numFilledTiles = 0;
+  for (i = 0; i < numRows; i++) {
+    for (j = 0; j < numCols; j++) {
+      grid->grid[i][j].numAdjRivers = 0;
+      grid->grid[i][j].numAdjLands = 0;
+      grid->grid[i][j].numAdjOpen = num_neighbours(i*numCols + j);
+    }
+  }
+
+  for (i = 0; i < numRows * numCols; i++) {
+    enum Terrain type = grid->grid[get_row_idx(i)][get_col_idx(i)].type;
+    if (type == LHO_EMPTY) {
+      continue;
+    }
+    grid->numFilledTiles++;
+
+    int nbrs[MAX_NEIGHBOURS];
+    int k, numNbrs = get_neighbours(i, nbrs);
+    for (k = 0; k < numNbrs; k++) {
+      struct Tile *nbr = &grid->grid[get_row_idx(nbrs[k])][get_col_idx(nbrs[k])];
+      if (type == LHO_RIVER) {
+        nbr->numAdjRivers++;
+      } else if (type == LHO_LANDSCAPE) {
+        nbr->numAdjLands++;
+      } else {
+        nbr->numAdjOpen--;
+      }
+    }
+  }
+
+  grid->full = (grid->numFilledTiles == grid->maxTiles);
+
+  for (i = 0; i < numRows; i++) {
+    for (j = 0; j < numCols; j++) {
+      rescore_tile(grid, i, j);
+    }
+  }
+}
+
+// Function to check if a location is already occupied
+// returns false if occupied, true if unoccupied
+bool chk_loc(int linIndex, struct Grid grid)
+{
+  if (linIndex < 0 || linIndex > numRows * numCols - 1) {
+    //printf("Outside Array\n");
+    return false; // we can't write outside our array...
+  }
+
+  int idx[2] = {0};
+  get_idx(linIndex, idx);
+  if ( grid.grid[idx[0]][idx[1]].type > LHO_EMPTY ) {
+    // Location in use
+    //printf("Bad Location\n");
+    return false;
+  }
+    //printf("Good Location\n");
+  return true;
+}
+
+
+// Marks a tile as unusable, designed to be used on an empty grid before
+// searching. Returns false if the tile is already in use.
+bool block_cell(int linIndex, struct Grid *grid)
+{
+  if (!chk_loc(linIndex, *grid)) {
+    return false;
+  }
+
+  int idx[2] = {0};
+  get_idx(linIndex, idx);
+  grid->grid[idx[0]][idx[1]].type = LHO_BLOCKED;
+  grid->numFilledTiles++;
+  if (grid->numFilledTiles == grid->maxTiles) {
+    grid->full = true;
+  }
+
+  retally_around(grid, linIndex, LHO_BLOCKED, 1);
+
+  return true;
+}
+
+// Function to add a landscape tile at a given linear index
+// if index is < 0, we want a random location for the first tile
+// designed to be used like: add_land(index, &grid); to update in place
+// returns true when land was added, false if not
+bool add_land(int linIndex, struct Grid *grid)
+{
+
+  //struct Grid g = *grid;
+  bool validLoc = chk_loc(linIndex, *grid);
+
+  if (validLoc) {
+    int idx[2] = {0};
+    get_idx(linIndex, idx);
+    grid->grid[idx[0]][idx[1]].type = LHO_LANDSCAPE;
+    grid->numFilledTiles++;
+    if (grid->numFilledTiles == grid->maxTiles) {
+      grid->full = true;
+    }
+
+    // Increase nearby land counts:
+    retally_around(grid, linIndex, LHO_LANDSCAPE, 1);
+    return true;
+  }
+
+  return false;
+}
+
+// designed to be used like: add_river(index, &grid); to update in place
+// returns true on successful add, false on failure
+bool add_river(int linIndex, struct Grid *grid)
+{
+  int curLoc;
+  int idx[2] = {0};
+  get_idx(linIndex, idx);
+
+  if (grid->river.newRiver) {
+    // Note that we have to start on a border (see river_start)
+    if (river_start(linIndex)) {
+      grid->river.newRiver = false;
+    } else {
+      //printf("Not starting on edge!\n");
+      return false;
+    }
+  }
+
+  //struct Grid g = *grid;
+  bool validLoc = chk_loc(linIndex, *grid);
+  if (validLoc && inducedRivers &&
+      grid->grid[idx[0]][idx[1]].numAdjRivers > (grid->river.headLoc > -1)) {
+    return false; // would touch the river somewhere other than the head
+  }
+
+  curLoc = grid->river.headLoc;
+//printf("curLoc: %d\n", curLoc);
+  if (curLoc > -1 && !adjacent(linIndex, curLoc)) {
+    //printf("Not near previous river head!\n");
+    return false; // River has to connect to previous segments of river
+  }
+
+  if (validLoc) {
+    grid->river.oldHeadLoc = grid->river.headLoc;
+    grid->river.headLoc = linIndex;
+
+    grid->grid[idx[0]][idx[1]].type = LHO_RIVER;
+    grid->numFilledTiles++;
+    if (grid->numFilledTiles == grid->maxTiles) {
+      grid->full = true;
+    }
+
+    // Increment river adjacency counts:
+    retally_around(grid, linIndex, LHO_RIVER, 1);
+
+    return true;
+  }
+
+  return false; // Shouldn't get here, but just in case
+}
+
+
+// function to remove terrain at a given location, sets to empty
+void remove_terrain(int linIndex, struct Grid *grid)
+{
+  int idx[2];
+  int headLoc = grid->river.headLoc;
+  enum Terrain oldType;
+
+  get_idx(linIndex, idx);
+  oldType = grid->grid[idx[0]][idx[1]].type;
+  grid->grid[idx[0]][idx[1]].type = LHO_EMPTY;
+  if (oldType > LHO_EMPTY) {
+    grid->numFilledTiles--; // decrement counter of filled tiles
+  }
+
+  // If we move the head of the river, we need to update to reflect that
+  // potentially also allwoing a new river to start if we removed all of it.
+  if (headLoc == linIndex) {
+    grid->river.headLoc = grid->river.oldHeadLoc;
+    if (grid->river.headLoc == -1) {
+      grid->river.newRiver = true;
+    }
+  }
+
+  // take the old tile off its neighbours' counts (unblocking makes it a
+  // neighbour again)
+  retally_around(grid, linIndex, oldType, -1);
+
+  return;
+}
+
+// for meadows and thickets:
+int val_calc_meadow_thicket(struct Grid grid)
+{
+  int i,j;
+  int val = 0;
+  int numRivers;
+
+  for (i = 0; i < numRows; i++) {
+    for (j = 0; j < numCols; j++) {
+      if (grid.grid[i][j].type == LHO_LANDSCAPE) {
+        numRivers = grid.grid[i][j].numAdjRivers;
+        if (numRivers == 0) {
+          val += landValue;
+        } else {
+          val += (landValue * 2) * numRivers; // might be a more clever way to do this besides if/else
+        }
+      }
+    }
+  }
+
+  return val;
+}
+
+// Function for calculating value of a suburb
+int val_calc_suburb(struct Grid grid)
+{
+  int i,j;
+  int val = 0;
+  int numRivers, numSuburbs;
+
+  for (i = 0; i < numRows; i++) {
+    for (j = 0; j < numCols; j++) {
+      if (grid.grid[i][j].type == LHO_LANDSCAPE) {
+        numRivers = grid.grid[i][j].numAdjRivers;
+        numSuburbs = grid.grid[i][j].numAdjLands;
+        if ( numSuburbs == 4 ) {
+          val += 2*landValue;
+        } else if (numRivers != 0) {
+          val += (landValue * 2) * numRivers;
+        } else {
+          val += landValue;
+        }
+      }
+    }
+  }
+
+  return val;
+}
+
+// Function for calculating value of a mountain
+int val_calc_mountain(struct Grid grid)
+{
+  int i,j;
+  int val = 0;
+  int numRivers, numMountains;
+
+  for (i = 0; i < numRows; i++) {
+    for (j = 0; j < numCols; j++) {
+      if (grid.grid[i][j].type == LHO_LANDSCAPE) {
+        numRivers = grid.grid[i][j].numAdjRivers;
+        numMountains = grid.grid[i][j].numAdjLands;
+        val += numMountains * landValue;
+        val += numMountains * numRivers * landValue;
+      }
+    }
+  }
+
+  return val;
+}
+
+// Function that returns value of a given grid:
+// actually sub-delegates to one of the functions for a particular type of
+// landscape tiles
+int val_calc(struct Grid grid)
+{
+  int val;
+
+  switch (landChoice) {
+    case LHO_MEADOW:
+    case LHO_THICKET:
+      val = val_calc_meadow_thicket(grid);
+      break;
+    case LHO_SUBURB:
+      val = val_calc_suburb(grid);
+      break;
+    case LHO_MOUNTAIN:
+      val = val_calc_mountain(grid);
+      break;
+  }
+
+  return val;
+}
+
+// Function to print ASCII structure of a grid
+void print_grid(struct Grid grid)
+{
+  int i,j;
+  enum Terrain type;
+  char label[4];
+
+  // Speficy landscape string to match which type of thing we optimized:
+  switch (landChoice) {
+    case LHO_MEADOW:
+    case LHO_MOUNTAIN:
+      strcpy(label, " M ");
+      break;
+    case LHO_SUBURB:
+      strcpy(label, " S ");
+      break;
+    case LHO_THICKET:
+      strcpy(label, " T ");
+      break;
+  }
+
+  printf("\n  ");
+  for (i = 0; i < numCols; i++) {
+    printf("----");
+  }
+  printf("-\n");
+  for (i = 0; i < numRows; i++) {
+    // on the hex layout, odd rows sit half a tile to the right
+    const char *indent = (gridLayout == LHO_LAYOUT_HEX && i % 2) ? "    " : "  ";
+    printf("%s", indent);
+    for (j = 0; j < numCols; j++) {
+      printf("|");
+      type = grid.grid[i][j].type;
+      switch (type) {
+        case LHO_EMPTY:
+          printf("   ");
+          break;
+        case LHO_RIVER:
+          printf(" R ");
+          break;
+        case LHO_LANDSCAPE:
+          printf("%s", label);
+          break;
+        case LHO_BLOCKED:
+          printf(" # ");
+          break;
+      } // switch
+    } // iForLoop
+    printf("|");
+    printf("\n%s", indent);
+    for (j = 0; j < numCols; j++) {
+      printf("----");
+    }
+    printf("-\n");
+  } //jForLoop
+  printf("\n");
+}
+
+/*
+  Search profiling by move prefix
+
+  With --profile-prefix=K the searches count their nodes and time against
+  the first K moves that led to them (for the river search, the river's
+  start tile and its first K-1 extensions). Each thread keeps its own
+  table, so counting a node is one increment and moves below depth K cost a
+  depth check; the tables are only merged for the report at the end.
+
+  A move is packed as (row << 8 | col) << 1 | isLandscape so it means the same
+  thing whatever grid it came from.
+*/
+
+#define PROF_MAX_DEPTH 8
+
+struct PrefixStat {
+  bool used;
+  int len;
+  int moves[PROF_MAX_DEPTH];
+  long long nodes; // nodes at this prefix, or below it if len == profLimit
+  long long ns; // time spent at or below this prefix
+};
+
+struct PrefixTable {
+  struct PrefixStat *slots;
+  int size;
+  int count;
+  struct PrefixTable *next;
+};
+
+#if LHO_INSTRUMENT
+static int profLimit = 0; // K, 0 when not profiling
+#else
+#define profLimit 0
+#endif
+
+// every thread's table, for the report
+static struct PrefixTable *profTables = NULL;
+static pthread_mutex_t profTablesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local struct PrefixTable *profTable = NULL;
+static _Thread_local int profDepth;
+static _Thread_local int profMoves[PROF_MAX_DEPTH];
+static _Thread_local int profSlot; // slot of the current prefix
+static _Thread_local struct timespec profStart[PROF_MAX_DEPTH + 1];
+
+static unsigned int prefix_hash(const int *moves, int len)
+{
+  unsigned int h = 2166136261u + len;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned int)moves[i]) * 16777619u;
+  }
+
+  return h;
+}
+
+// Finds the slot for a prefix in table, or -1 if it isn't there
+static int prefix_find(struct PrefixTable *table, const int *moves, int len)
+{
+  if (table->size == 0) {
+    return -1;
+  }
+
+  int slot = prefix_hash(moves, len) & (table->size - 1);
+  while (table->slots[slot].used) {
+    struct PrefixStat *stat = &table->slots[slot];
+    if (stat->len == len && memcmp(stat->moves, moves, len * sizeof(int)) == 0) {
+      return slot;
+    }
+    slot = (slot + 1) & (table->size - 1);
+  }
+
+  return -1;
+}
+
+// Finds the slot for a prefix in table, adding it if it isn't there
+static int prefix_slot(struct PrefixTable *table, const int *moves, int len)
+{
+  int i;
+
+  if (2 * (table->count + 1) > table->size) {
+    struct PrefixStat *old = table->slots;
+    int oldSize = table->size;
+    table->size = oldSize ? 2 * oldSize : 1024;
+    table->slots = mem_alloc(LHO_MEM_PROFILE,
+                             table->size * sizeof(struct PrefixStat));
+    memset(table->slots, 0, table->size * sizeof(struct PrefixStat));
+    table->count = 0;
+    for (i = 0; i < oldSize; i++) {
+      if (old[i].used) {
+        int slot = prefix_slot(table, old[i].moves, old[i].len);
+        table->slots[slot].nodes = old[i].nodes;
+        table->slots[slot].ns = old[i].ns;
+      }
+    }
+    mem_free(old);
+  }
+
+  int slot = prefix_hash(moves, len) & (table->size - 1);
+  for (;;) {
+    struct PrefixStat *stat = &table->slots[slot];
+    if (!stat->used) {
+      stat->used = true;
+      stat->len = len;
+      memcpy(stat->moves, moves, len * sizeof(int));
+      table->count++;
+      return slot;
+    }
+    if (stat->len == len && memcmp(stat->moves, moves, len * sizeof(int)) == 0) {
+      return slot;
+    }
+    slot = (slot + 1) & (table->size - 1);
+  }
+}
+
+static long long elapsed_ns(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000LL +
+         (now.tv_nsec - start->tv_nsec);
+}
+
+static inline int prof_move(int linIndex, bool land)
+{
+  return ((get_row_idx(linIndex) << 8 | get_col_idx(linIndex)) << 1) | land;
+}
+
+// start of a solve on this thread
+static void prof_begin(void)
+{
+  if (!profLimit) {
+    return;
+  }
+  if (profTable == NULL) {
+    profTable = mem_alloc(LHO_MEM_PROFILE, sizeof(struct PrefixTable));
+    memset(profTable, 0, sizeof(struct PrefixTable));
+    pthread_mutex_lock(&profTablesLock);
+    profTable->next = profTables;
+    profTables = profTable;
+    pthread_mutex_unlock(&profTablesLock);
+  }
+  profDepth = 0;
+  profSlot = prefix_slot(profTable, profMoves, 0);
+  clock_gettime(CLOCK_MONOTONIC, &profStart[0]);
+}
+
+static void prof_end(void)
+{
+  if (profLimit) {
+    profTable->slots[prefix_find(profTable, profMoves, 0)].ns +=
+      elapsed_ns(&profStart[0]);
+  }
+}
+
+static void prof_push_slow(int move)
+{
+  profDepth++;
+  if (profDepth <= profLimit) {
+    profMoves[profDepth - 1] = move;
+    profSlot = prefix_slot(profTable, profMoves, profDepth);
+    clock_gettime(CLOCK_MONOTONIC, &profStart[profDepth]);
+  }
+}
+
+static void prof_pop_slow(void)
+{
+  if (profDepth <= profLimit) {
+    // slots move when the table grows, so look the prefixes up again
+    profTable->slots[prefix_find(profTable, profMoves, profDepth)].ns +=
+      elapsed_ns(&profStart[profDepth]);
+    profSlot = prefix_find(profTable, profMoves, profDepth - 1);
+  }
+  profDepth--;
+}
+
+// one node of search under the current prefix
+static inline void prof_node(void)
+{
+  if (profLimit) {
+    profTable->slots[profSlot].nodes++;
+  }
+}
+
+// taking a move / coming back from it
+static inline void prof_push(int move)
+{
+  if (profLimit) {
+    prof_push_slow(move);
+  }
+}
+
+static inline void prof_pop(void)
+{
+  if (profLimit) {
+    prof_pop_slow();
+  }
+}
+
+static void print_prefix(FILE *out, const struct PrefixStat *stat)
+{
+  int i;
+
+  fprintf(out, "root");
+  for (i = 0; i < stat->len; i++) {
+    int move = stat->moves[i];
+    fprintf(out, ";%s@%d,%d", (move & 1) ? "land" : "river", move >> 9,
+            (move >> 1) & 0xff);
+  }
+}
+
+struct PrefixReport {
+  struct PrefixStat *stat;
+  long long inclusive; // nodes at or below the prefix
+};
+
+static int compare_inclusive(const void *a, const void *b)
+{
+  const struct PrefixReport *x = a, *y = b;
+
+  return (x->inclusive < y->inclusive) - (x->inclusive > y->inclusive);
+}
+
+// Merges every thread's table, writes the folded stacks (one line per prefix
+// with the nodes counted at it, ready for flamegraph.pl) to foldedPath and
+// prints the prefixes that took the most nodes
+void prof_report(const char *foldedPath)
+{
+  struct PrefixTable merged = {NULL, 0, 0, NULL};
+  struct PrefixTable *table;
+  int i, k;
+
+  if (!profLimit) {
+    return;
+  }
+
+  pthread_mutex_lock(&profTablesLock);
+  for (table = profTables; table != NULL; table = table->next) {
+    for (i = 0; i < table->size; i++) {
+      struct PrefixStat *stat = &table->slots[i];
+      if (stat->used) {
+        int slot = prefix_slot(&merged, stat->moves, stat->len);
+        merged.slots[slot].nodes += stat->nodes;
+        merged.slots[slot].ns += stat->ns;
+      }
+    }
+  }
+  pthread_mutex_unlock(&profTablesLock);
+
+  FILE *out = fopen(foldedPath, "w");
+  if (out == NULL) {
+    perror(foldedPath);
+  }
+
+  struct PrefixReport *report = calloc(merged.count + 1,
+                                       sizeof(struct PrefixReport));
+  long long totalNodes = 0;
+  int numReport = 0;
+  for (i = 0; i < merged.size; i++) {
+    struct PrefixStat *stat = &merged.slots[i];
+    if (!stat->used) {
+      continue;
+    }
+    report[numReport++].stat = stat;
+    totalNodes += stat->nodes;
+    if (out != NULL && stat->nodes > 0) {
+      print_prefix(out, stat);
+      fprintf(out, " %lld\n", stat->nodes);
+    }
+  }
+  if (out != NULL) {
+    fclose(out);
+  }
+
+  // every prefix's own nodes count towards all of its ancestors too
+  long long *inclusive = calloc(merged.size, sizeof(long long));
+  for (i = 0; i < numReport; i++) {
+    struct PrefixStat *stat = report[i].stat;
+    for (k = 0; k <= stat->len; k++) {
+      int slot = prefix_find(&merged, stat->moves, k);
+      if (slot >= 0) {
+        inclusive[slot] += stat->nodes;
+      }
+    }
+  }
+  for (i = 0; i < numReport; i++) {
+    report[i].inclusive = inclusive[report[i].stat - merged.slots];
+  }
+  free(inclusive);
+  qsort(report, numReport, sizeof(struct PrefixReport), compare_inclusive);
+
+  printf("\n Search nodes by first %d moves (folded stacks in %s):\n\n",
+         profLimit, foldedPath);
+  printf("  %14s %7s %12s  prefix\n", "nodes", "", "time (ms)");
+  for (i = 0; i < numReport && i < 40; i++) {
+    printf("  %14lld %6.2f%% %12.1f  ", report[i].inclusive,
+           totalNodes ? 100.0 * report[i].inclusive / totalNodes : 0.0,
+           report[i].stat->ns / 1e6);
+    print_prefix(stdout, report[i].stat);
+    printf("\n");
+  }
+
+  free(report);
+  mem_free(merged.slots);
+}
+
+
+/*
+  Sets initial grid used in recursion using some heuristics to start at a
+  higher "current best"
+  Starts river at top left and tries to draw a zig-zag to the bottom then back
+  up, repeating if necessary. The rest is filled with landscape tiles, minus
+  one tile to enter recursion once
+*/
+
+void heuristic_grid(struct Grid *grid)
+{
+  int i,j;
+
+
+  for (i = 0; i < numRows; i++) {
+    for (j = 0; j < numCols; j++) {
+      grid->grid[i][j].type = LHO_LANDSCAPE; // Set whole grid to landscape
+    }
+  }
+
+  if (numRows == 1) {
+    // no room to zig-zag, a one tile river in the corner will do
+    grid->grid[0][0].type = LHO_RIVER;
+    return;
+  }
+
+  i = 0;
+  j = 0;
+  bool done = false;
+  bool firstLoop = true;
+  int zigx = 0, zigy = 0;
+  enum ZigZag zigLocalDir = LHO_RIGHT; // always start top left, so first move is to the right
+  enum ZigZag zigNextDir = LHO_DOWN; // start top left and overall go down to the right
+  enum ZigZag zigOverallDir = LHO_DOWN;
+
+  while (!done) {
+
+    grid->grid[i][j].type = LHO_RIVER;
+
+    if (j == numCols - 1) {
+      done = true;
+    }
+
+    switch (zigLocalDir) {
+      case LHO_RIGHT:
+        j++;
+        zigLocalDir = zigNextDir;
+        if (zigOverallDir == LHO_DOWN) {
+          zigNextDir = LHO_DOWN;
+        } else {
+          zigNextDir = LHO_UP;
+        }
+        break;
+      case LHO_LEFT:
+        j--;
+        zigLocalDir = zigNextDir;
+        if (zigOverallDir == LHO_DOWN) {
+          zigNextDir = LHO_DOWN;
+        } else {
+          zigNextDir = LHO_UP;
+        }
+        break;
+      case LHO_DOWN: // these are "backwards" as top left is (0,0)
+        i++;
+        zigLocalDir = LHO_RIGHT;
+        break;
+      case LHO_UP:
+        i--;
+        zigLocalDir = LHO_RIGHT;
+        break;
+    }
+
+    if (i == (numRows)) {
+      zigOverallDir = LHO_UP;
+      //zigLocalDir = LHO_RIGHT;
+      zigNextDir = LHO_UP;
+      i -= 2;
+      //j++;
+    }
+
+    if (i == -1 && !firstLoop) {
+      zigOverallDir = LHO_DOWN;
+      //zigLocalDir = LHO_RIGHT;
+      zigNextDir = LHO_DOWN;
+      i += 2;
+      //j++;
+    }
+
+    firstLoop = false;
+
+  }
+
+  return;
+}
+
+
+#if LHO_BOUNDS
+/*
+  Child scoring
+
+  A child of a recurse_grid node differs from it in one tile, so its value
+  and bound differ only by what that tile and its neighbours gain. Before
+  trying any children, score_children works out the value and bound of
+  every child at once: a first pass writes what each tile would gain if a
+  neighbour became a landscape tile or a river into flat arrays with a
+  border of zeroes, and a second pass adds up each tile's four neighbours
+  with plain loops over those arrays, which the compiler vectorises (other
+  layouts add up each tile's neighbour list instead). Children that can't
+  beat bestVal are then skipped without being built.
+*/
+
+#define CS_LEN ((MAX_ROWS + 2) * (MAX_COLS + 2))
+
+// what a tile gains if one of its empty neighbours becomes landscape/river,
+// and what the tile itself gains by becoming one, padded by a border of zeroes
+static _Thread_local int csLandVal[CS_LEN], csLandBound[CS_LEN];
+static _Thread_local int csRiverVal[CS_LEN], csRiverBound[CS_LEN];
+static _Thread_local int csSelfLandVal[CS_LEN], csSelfRiverBound[CS_LEN];
+
+// Fills childVal and childBound (indexed 2 * linIndex + 0 for a river, + 1
+// for a landscape tile) for every empty tile of grid
+static void score_children(const struct Grid *grid, int *childVal,
+                           int *childBound)
+{
+  int w = numCols + 2, len = (numRows + 2) * w;
+  int i, j, p;
+
+  memset(csLandVal, 0, len * sizeof(int));
+  memset(csLandBound, 0, len * sizeof(int));
+  memset(csRiverVal, 0, len * sizeof(int));
+  memset(csRiverBound, 0, len * sizeof(int));
+  memset(csSelfLandVal, 0, len * sizeof(int));
+  memset(csSelfRiverBound, 0, len * sizeof(int));
+
+  for (i = 0; i < numRows; i++) {
+    for (j = 0; j < numCols; j++) {
+      const struct Tile *tile = &grid->grid[i][j];
+      int r = tile->numAdjRivers, l = tile->numAdjLands;
+      int e = tile->numAdjOpen - r - l;
+      p = (i + 1) * w + j + 1;
+      if (tile->type == LHO_EMPTY) {
+        csSelfLandVal[p] = tileVals[r][l];
+        csSelfRiverBound[p] = -tile->bound;
+      }
+      if (e == 0 ||
+          (tile->type != LHO_LANDSCAPE && tile->type != LHO_EMPTY)) {
+        continue; // never next to a child's tile, or never changes
+      }
+      bool land = (tile->type == LHO_LANDSCAPE);
+      csLandVal[p] = land ? tileVals[r][l + 1] - tile->val : 0;
+      csLandBound[p] = tileBounds[r][l + 1][e - 1] - tile->bound;
+      csRiverVal[p] = land ? tileVals[r + 1][l] - tile->val : 0;
+      csRiverBound[p] = tileBounds[r + 1][l][e - 1] - tile->bound;
+    }
+  }
+
+  if (adjGeneric) {
+    int c, k;
+    for (c = 0; c < numRows * numCols; c++) {
+      int riverVal = 0, riverBound = 0, landVal = 0, landBound = 0;
+      for (k = adjStart[c]; k < adjStart[c + 1]; k++) {
+        int q = (adjRow[k] + 1) * w + adjCol[k] + 1;
+        riverVal += csRiverVal[q];
+        riverBound += csRiverBound[q];
+        landVal += csLandVal[q];
+        landBound += csLandBound[q];
+      }
+      p = (get_row_idx(c) + 1) * w + get_col_idx(c) + 1;
+      childVal[2 * c] = grid->val + riverVal;
+      childBound[2 * c] = grid->bound + csSelfRiverBound[p] + riverBound;
+      childVal[2 * c + 1] = grid->val + csSelfLandVal[p] + landVal;
+      childBound[2 * c + 1] = grid->bound + landBound;
+    }
+    return;
+  }
+
+  for (i = 0; i < numRows; i++) {
+    int *val = childVal + 2 * i * numCols, *bound = childBound + 2 * i * numCols;
+    p = (i + 1) * w + 1;
+    for (j = 0; j < numCols; j++, p++) {
+      val[2 * j] = grid->val + csRiverVal[p - 1] + csRiverVal[p + 1] +
+                   csRiverVal[p - w] + csRiverVal[p + w];
+      bound[2 * j] = grid->bound + csSelfRiverBound[p] + csRiverBound[p - 1] +
+                     csRiverBound[p + 1] + csRiverBound[p - w] +
+                     csRiverBound[p + w];
+      val[2 * j + 1] = grid->val + csSelfLandVal[p] + csLandVal[p - 1] +
+                       csLandVal[p + 1] + csLandVal[p - w] + csLandVal[p + w];
+      bound[2 * j + 1] = grid->bound + csLandBound[p - 1] + csLandBound[p + 1] +
+                         csLandBound[p - w] + csLandBound[p + w];
+    }
+  }
+}
+#endif
+
+
+static _Thread_local int recursion_depth = 0;
+static _Thread_local bool initial_recursion = true;
+
+#if LHO_SYMMETRY
+// Tiles the default search may start a river on, by linear index. Any river
+// can be mirrored (or on a square grid turned) to start in one quarter (or
+// eighth) of the grid without changing the value, so on an empty grid with
+// nothing to break the symmetry the others are left out.
+static _Thread_local bool symStart[MAX_ROWS * MAX_COLS];
+
+static void sym_setup(const struct Grid *grid)
+{
+  bool symmetric = adjSquare && riverStarts == NULL &&
+                   grid->numFilledTiles == 0;
+  int i;
+
+  for (i = 0; i < numRows * numCols; i++) {
+    int r = get_row_idx(i), c = get_col_idx(i);
+    symStart[i] = !symmetric ||
+                  (2 * r < numRows && 2 * c < numCols &&
+                   (numRows != numCols || r <= c));
+  }
+}
+#endif
+
+#if LHO_TRANSPOSITION
+/*
+  Positions the default search has finished, by a hash of the tile types and
+  where the river can grow from. Once a position has been searched, all its
+  completions have been seen or cut off against an incumbent no better than
+  today's, so meeting it again (the same tiles placed in another order) needs
+  no search at all. The table is lossy: a new position simply replaces
+  whatever was in its slot.
+*/
+
+#define TT_BITS 20 // 8MB a thread
+
+static _Thread_local uint64_t *ttKeys; // NULL without a table
+
+static uint64_t tt_key(const struct Grid *grid)
+{
+  uint64_t key = (uint64_t)(grid->river.headLoc + 2) << 1 |
+                 grid->river.newRiver;
+  int i, j;
+
+  for (i = 0; i < numRows; i++) {
+    for (j = 0; j < numCols; j++) {
+      key = (key ^ (uint64_t)(grid->grid[i][j].type + 1)) *
+            0x100000001b3ULL;
+    }
+  }
+  key ^= key >> 29;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 32;
+
+  return key | 1; // 0 marks an empty slot
+}
+#endif
+
+// Sets up the default search's optional parts for a solve of grid
+static void recurse_begin(const struct Grid *grid)
+{
+#if LHO_SYMMETRY
+  sym_setup(grid);
+#endif
+#if LHO_TRANSPOSITION
+  ttKeys = mem_try_calloc(LHO_MEM_SEARCH, sizeof(uint64_t) << TT_BITS);
+#endif
+  (void)grid;
+}
+
+static void recurse_end(void)
+{
+#if LHO_TRANSPOSITION
+  mem_free(ttKeys);
+  ttKeys = NULL;
+#endif
+}
+
+// Function to fill the remainder of a given grid, designed to be recursed
+struct Grid * recurse_grid(struct Grid *grid)
+{
+//printf("inside recursion, bestVal = %d\n", bestVal);
+  //print_grid(*grid);
+  // First check if we need to do anything or if grid is full
+  prof_node();
+  if (grid->full || solve_cancelled()) {
+    //printf("grid full!\n");
+    return grid;
+  }
+
+  // Then check if we can exit early due to this branch being unable to surpass
+  // this highest value already found:
+  int val;
+#ifdef LHO_CHECK_BOUND
+  assert(grid->val == val_calc(*grid));
+  assert(grid->bound == grid_bound(*grid));
+#endif
+#if LHO_BOUNDS
+  int maxRemaining;
+  val = grid->val;
+  maxRemaining = maxTileVal * (grid->maxTiles - grid->numFilledTiles);
+  if ( val + maxRemaining <= bestVal || grid->bound <= bestVal ) {
+    //printf("Branch maximum too low to gon on\n");
+    return grid;
+  }
+#endif
+#if LHO_TRANSPOSITION
+  // finished before, and the partial layout itself can't pass for a better
+  // one (see the val > currentBest checks of the caller)
+  uint64_t ttKey = 0;
+  if (ttKeys != NULL) {
+    ttKey = tt_key(grid);
+    if (ttKeys[ttKey & ((1 << TT_BITS) - 1)] == ttKey &&
+        grid->val <= bestVal) {
+      return grid;
+    }
+  }
+#endif
+
+  int currentBest = bestVal;
+  struct Grid bestGrid;
+  allocate_grid(&bestGrid);
+  copy_grid(&bestGrid, grid);
+
+  int maxLen,i,j;
+  maxLen = numRows * numCols;
+
+  struct Grid thisGrid;
+  allocate_grid(&thisGrid);
+  copy_grid(&thisGrid, grid);
+
+  struct Grid tempGrid;
+  allocate_grid(&tempGrid);
+
+#if LHO_BOUNDS
+  // value and bound of every child, so the hopeless ones are never built
+  int *childVal = mem_alloc(LHO_MEM_SEARCH, 2 * maxLen * sizeof(int));
+  int *childBound = mem_alloc(LHO_MEM_SEARCH, 2 * maxLen * sizeof(int));
+  int childRemaining = grid->maxTiles - grid->numFilledTiles - 1;
+  score_children(grid, childVal, childBound);
+#endif
+
+  if (initial_recursion) {
+    heuristic_grid(&tempGrid);
+    currentBest = val_calc(tempGrid);
+    bestVal =  currentBest;
+    report_incumbent(bestVal);
+    copy_grid(&bestGrid, &tempGrid);
+    initial_recursion = false;
+  }
+
+  // tile by tile, river before landscape, except that with priors the
+  // tiles the river is likeliest to go on to are tried first
+  int first[MAX_NEIGHBOURS], numFirst = 0, m, k;
+  if (priorCounts != NULL && thisGrid.river.oldHeadLoc >= 0 &&
+      !thisGrid.river.newRiver) {
+    numFirst = get_neighbours(thisGrid.river.headLoc, first);
+    prior_sort(first, numFirst, -2, thisGrid.river.oldHeadLoc,
+               thisGrid.river.headLoc);
+  }
+
+  for (m = -numFirst; m < 2 * maxLen; m++) {
+    if (m < 0) {
+      i = first[m + numFirst];
+      j = 0;
+    } else {
+      i = m / 2;
+      j = m % 2;
+      for (k = 0; j == 0 && k < numFirst && first[k] != i; k++);
+      if (j == 0 && k < numFirst) {
+        continue; // tried already
+      }
+    }
+
+#if LHO_BOUNDS
+    // the child would stop at its own bound check (full children are
+    // still scored, so they always go ahead). Only empty tiles, as
+    // add_river has to see the rest.
+    if (childRemaining > 0 &&
+        grid->grid[get_row_idx(i)][get_col_idx(i)].type == LHO_EMPTY &&
+        (childVal[2 * i + j] + maxTileVal * childRemaining <= bestVal ||
+         childBound[2 * i + j] <= bestVal)) {
+      continue;
+    }
+#endif
+    if (j == 0) {
+#if LHO_SYMMETRY
+      if (thisGrid.river.newRiver && !symStart[i]) {
+        continue;
+      }
+#endif
+      bool river_added = add_river(i, &thisGrid);
+      //printf("added river at i: %d\n", i);
+      if (river_added) {
+        //printf("Actually added river...\n");
+#ifdef LHO_CHECK_BOUND
+        assert(thisGrid.val == childVal[2 * i]);
+        assert(thisGrid.bound == childBound[2 * i]);
+#endif
+        copy_grid(&tempGrid, &thisGrid);
+        remove_terrain(i, &thisGrid);
+        recursion_depth++;
+        prof_push(prof_move(i, j == 1));
+        recurse_grid(&tempGrid);
+        prof_pop();
+        val = val_calc(tempGrid);
+        if (val > currentBest) {
+          currentBest = val;
+          bestVal = val;
+          report_incumbent(val);
+          copy_grid(&bestGrid, &tempGrid);
+        }
+        recursion_depth--;
+      }
+    } else {
+      bool land_added = add_land(i, &thisGrid);
+      if (land_added) {
+#ifdef LHO_CHECK_BOUND
+        assert(thisGrid.val == childVal[2 * i + 1]);
+        assert(thisGrid.bound == childBound[2 * i + 1]);
+#endif
+        copy_grid(&tempGrid, &thisGrid);
+        remove_terrain(i, &thisGrid);
+        recursion_depth++;
+        prof_push(prof_move(i, j == 1));
+        recurse_grid(&tempGrid);
+        prof_pop();
+        val = val_calc(tempGrid);
+        if (val > currentBest) {
+          currentBest = val;
+          bestVal = val;
+          report_incumbent(val);
+          copy_grid(&bestGrid, &tempGrid);
+        }
+        recursion_depth--;
+      }
+    } /* ifElse */
+  } /* childLoop */
+
+
+  copy_grid(grid, &bestGrid);
+#if LHO_TRANSPOSITION
+  if (ttKeys != NULL && !solve_cancelled()) {
+    ttKeys[ttKey & ((1 << TT_BITS) - 1)] = ttKey;
+  }
+#endif
+
+#if LHO_BOUNDS
+  mem_free(childVal);
+  mem_free(childBound);
+#endif
+  free_grid(&thisGrid);
+  free_grid(&bestGrid);
+  free_grid(&tempGrid);
+
+  return grid;
+}
+
+
+/*
+  River validity for layouts that were not built up through add_river.
+  types is indexed by linear index. The river cells have to be visitable in a
+  single walk (each step to a bordering river cell) that begins on a tile
+  river_start allows, which is exactly what add_river allows. No river at all
+  is fine.
+*/
+
+static bool river_walk(int cell, int remaining, const enum Terrain *types,
+                       bool *visited)
+{
+  if (remaining == 0) {
+    return true;
+  }
+
+  int nbrs[MAX_NEIGHBOURS];
+  int k, numNbrs = get_neighbours(cell, nbrs);
+  bool found = false;
+
+  visited[cell] = true;
+  for (k = 0; k < numNbrs && !found; k++) {
+    if (types[nbrs[k]] == LHO_RIVER && !visited[nbrs[k]]) {
+      found = river_walk(nbrs[k], remaining - 1, types, visited);
+    }
+  }
+  visited[cell] = false;
+
+  return found;
+}
+
+bool river_valid(const enum Terrain *types)
+{
+  int numCells = numRows * numCols;
+  int numRiver = 0, numEnds = 0, firstRiver = -1;
+  int nbrs[MAX_NEIGHBOURS];
+  int i,k;
+
+  for (i = 0; i < numCells; i++) {
+    if (types[i] != LHO_RIVER) {
+      continue;
+    }
+    if (firstRiver < 0) {
+      firstRiver = i;
+    }
+    numRiver++;
+    int riverNbrs = 0, numNbrs = get_neighbours(i, nbrs);
+    for (k = 0; k < numNbrs; k++) {
+      if (types[nbrs[k]] == LHO_RIVER) {
+        riverNbrs++;
+      }
+    }
+    if (riverNbrs == 1) {
+      numEnds++;
+    }
+  }
+
+  if (numRiver == 0) {
+    return true;
+  }
+  if (numRiver == 1) {
+    return river_start(firstRiver);
+  }
+  if (numEnds > 2) {
+    return false; // can't walk through more than two dead ends
+  }
+
+  bool visited[MAX_ROWS * MAX_COLS] = {false};
+  for (i = 0; i < numCells; i++) {
+    if (types[i] != LHO_RIVER || !river_start(i)) {
+      continue;
+    }
+    if (river_walk(i, numRiver - 1, types, visited)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+/*
+  Russian Doll Search
+
+  Cells are decided one at a time in a fixed order: row-major, or
+  column-major when there are more columns than rows so the window stays
+  narrow. Before the main search, the best value the last k cells can still
+  add is worked out for k = 1, 2, ..., n, for every state of the "window" of
+  width cells just before them. These suffix optima bound what is left of a
+  partial layout exactly, where recurse_grid has to use
+  maxTileVal * (remaining tiles).
+
+  The suffix problems drop the single-path requirement on the river so that
+  each one is a table lookup on the previous (shorter) one instead of a
+  search of its own; they are still upper bounds on the real problem. Empty
+  cells are never tried as a landscape tile is always worth at least as much
+  as a gap.
+
+  Window digits are base 4 with the oldest cell in the lowest digit:
+    0 = river, 1 + r = landscape with r rivers above/left of it
+
+  Blocked tiles are treated as landscape by the tables, which can only
+  overestimate, so layouts with blocked tiles are scored exactly at the end.
+*/
+
+#define RDS_MAX_ENTRIES (1 << 24)
+
+// Suffix optima for one grid size and landscape. Once built a table never
+// changes, so any number of searches can share it.
+struct RdsTable {
+  int rows, cols, land; // what the table is for
+  int width;
+  int len;
+  int profiles;
+  int cell[MAX_ROWS * MAX_COLS]; // search position -> linear index
+  int deg[MAX_ROWS * MAX_COLS]; // neighbour count by position
+  int *vals; // (len + 1) * profiles suffix optima
+  int users; // threads with this as their current table
+  unsigned long lastUsed; // rdsClock when last made current
+  struct RdsTable *next;
+};
+
+// every table built so far, less any evicted to keep under --mem-limit
+static struct RdsTable *rdsCache = NULL;
+static unsigned long rdsClock = 0;
+static pthread_mutex_t rdsCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Search state, one copy per thread so several searches can share a table
+static _Thread_local struct RdsTable *rds; // table for the current grid
+static _Thread_local enum Terrain rdsTypes[MAX_ROWS * MAX_COLS]; // by index
+static _Thread_local enum Terrain rdsBestTypes[MAX_ROWS * MAX_COLS];
+static _Thread_local int rdsBest;
+static _Thread_local bool rdsHasBlocked;
+
+// Value of a layout given as tile types by linear index
+int types_value(const enum Terrain *types)
+{
+  int numCells = numRows * numCols;
+  int nbrs[MAX_NEIGHBOURS];
+  int i,k, val = 0;
+
+  for (i = 0; i < numCells; i++) {
+    if (types[i] != LHO_LANDSCAPE) {
+      continue;
+    }
+    int r = 0, l = 0, numNbrs = get_neighbours(i, nbrs);
+    for (k = 0; k < numNbrs; k++) {
+      r += (types[nbrs[k]] == LHO_RIVER);
+      l += (types[nbrs[k]] == LHO_LANDSCAPE);
+    }
+    val += tileVals[r][l];
+  }
+
+  return val;
+}
+
+// Moves the window on by deciding position p. Returns the new window and
+// sets gain to the (now final) value of the tile leaving it.
+static int rds_step(int p, int profile, bool river, int *gain)
+{
+  int w = rds->width;
+  int col = p % w;
+  int up = profile & 3;
+  int left = (profile >> (2 * (w - 1))) & 3;
+  int state;
+
+  *gain = 0;
+  if (p >= w && up > 0) {
+    int r = up - 1 + river;
+    if (col < w - 1 && ((profile >> 2) & 3) == 0) {
+      r++; // river to the right of the tile leaving
+    }
+    *gain = tileVals[r][rds->deg[p - w] - r];
+  }
+
+  if (river) {
+    state = 0;
+  } else {
+    state = 1 + (p >= w && up == 0) + (col > 0 && left == 0);
+  }
+
+  return (profile >> 2) | (state << (2 * (w - 1)));
+}
+
+// value of the tiles still in the window once every position is decided
+static int rds_final_value(int profile)
+{
+  int i, val = 0;
+
+  for (i = 0; i < rds->width; i++) {
+    int state = (profile >> (2 * i)) & 3;
+    if (state > 0) {
+      int r = state - 1;
+      if (i < rds->width - 1 && ((profile >> (2 * (i + 1))) & 3) == 0) {
+        r++;
+      }
+      val += tileVals[r][rds->deg[rds->len - rds->width + i] - r];
+    }
+  }
+
+  return val;
+}
+
+// Frees unused tables, least recently used first, until bytes more would
+// fit under the limit. Expects rdsCacheLock to be held.
+static void rds_evict_locked(size_t bytes)
+{
+  while (memLimit && mem_headroom() < bytes) {
+    struct RdsTable **link, **oldest = NULL;
+    for (link = &rdsCache; *link != NULL; link = &(*link)->next) {
+      if ((*link)->users == 0 &&
+          (oldest == NULL || (*link)->lastUsed < (*oldest)->lastUsed)) {
+        oldest = link;
+      }
+    }
+    if (oldest == NULL) {
+      return;
+    }
+    struct RdsTable *table = *oldest;
+    *oldest = table->next;
+    mem_free(table->vals);
+    mem_free(table);
+  }
+}
+
+// Called by mem_try_alloc when it runs out of room. Does nothing if the cache
+// is busy, which includes this thread being in the middle of rds_setup.
+static void rds_evict(size_t bytes)
+{
+  if (pthread_mutex_trylock(&rdsCacheLock) == 0) {
+    rds_evict_locked(bytes);
+    pthread_mutex_unlock(&rdsCacheLock);
+  }
+}
+
+// Lets go of this thread's current table, so it can be evicted
+void rds_release(void)
+{
+  if (rds == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&rdsCacheLock);
+  rds->users--;
+  rds = NULL;
+  pthread_mutex_unlock(&rdsCacheLock);
+}
+
+// Finds or builds the suffix optima for the current grid size and landscape
+// and makes them the current table until rds_release. Returns false if it
+// would be too big, wouldn't fit under --mem-limit, or the grid isn't square
+// (see adjSquare).
+bool rds_setup(void)
+{
+  bool colMajor = numCols > numRows;
+  int width = colMajor ? numRows : numCols;
+  int len = numRows * numCols;
+  int p, profile;
+
+  rds_release();
+  if (!adjSquare || width > 12 || (long)(len + 1) * (1 << (2 * width)) > RDS_MAX_ENTRIES) {
+    return false;
+  }
+
+  pthread_mutex_lock(&rdsCacheLock);
+  for (rds = rdsCache; rds != NULL; rds = rds->next) {
+    if (rds->rows == numRows && rds->cols == numCols &&
+        rds->land == (int)landChoice) {
+      rds->users++;
+      rds->lastUsed = ++rdsClock;
+      pthread_mutex_unlock(&rdsCacheLock);
+      return true;
+    }
+  }
+
+  size_t valBytes = (size_t)(len + 1) * (1 << (2 * width)) * sizeof(int);
+  rds_evict_locked(2 * sizeof(union MemHeader) + sizeof(struct RdsTable) +
+                   valBytes);
+  rds = mem_try_alloc(LHO_MEM_TABLES, sizeof(struct RdsTable));
+  if (rds == NULL) {
+    pthread_mutex_unlock(&rdsCacheLock);
+    return false;
+  }
+  rds->rows = numRows;
+  rds->cols = numCols;
+  rds->land = landChoice;
+  rds->width = width;
+  rds->len = len;
+  rds->profiles = 1 << (2 * width);
+
+  for (p = 0; p < rds->len; p++) {
+    if (colMajor) {
+      rds->cell[p] = (p % numRows) * numCols + p / numRows;
+    } else {
+      rds->cell[p] = p;
+    }
+    rds->deg[p] = num_neighbours(rds->cell[p]);
+  }
+
+  rds->vals = mem_try_alloc(LHO_MEM_TABLES, valBytes);
+  if (rds->vals == NULL) {
+    mem_free(rds);
+    rds = NULL;
+    pthread_mutex_unlock(&rdsCacheLock);
+    return false;
+  }
+
+  // suffix of length 0, then grow it one cell at a time
+  int *last = rds->vals + (size_t)rds->len * rds->profiles;
+  for (profile = 0; profile < rds->profiles; profile++) {
+    last[profile] = rds_final_value(profile);
+  }
+
+  for (p = rds->len - 1; p >= 0; p--) {
+    int *cur = rds->vals + (size_t)p * rds->profiles;
+    int *next = cur + rds->profiles;
+    for (profile = 0; profile < rds->profiles; profile++) {
+      int gainR, gainL;
+      int nextR = rds_step(p, profile, true, &gainR);
+      int nextL = rds_step(p, profile, false, &gainL);
+      int valR = gainR + next[nextR];
+      int valL = gainL + next[nextL];
+      cur[profile] = valR > valL ? valR : valL;
+    }
+  }
+
+  rds->users = 1;
+  rds->lastUsed = ++rdsClock;
+  rds->next = rdsCache;
+  rdsCache = rds;
+  pthread_mutex_unlock(&rdsCacheLock);
+
+  return true;
+}
+
+// true if any of the window's cells is a river
+static bool rds_window_has_river(int profile)
+{
+  int i;
+
+  for (i = 0; i < rds->width; i++) {
+    if (((profile >> (2 * i)) & 3) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Main depth first search over positions. acc is the value of the tiles that
+// have already left the window, riverClosed is set once the river has been
+// cut off from the rest of the grid so no more river can be placed.
+// numEnds counts river tiles with all neighbours decided and only one river
+// beside them: these can only be the two ends of the river, and one of them
+// has to be on the edge.
+static void rds_search(int p, int profile, int acc, int numRiver,
+                       bool riverClosed, int numEnds, int numBorderEnds)
+{
+  int bound = acc + rds->vals[(size_t)p * rds->profiles + profile];
+
+  if (bound <= rdsBest || solve_cancelled()) {
+    return;
+  }
+
+  if (p == rds->len) {
+    int val = rdsHasBlocked ? types_value(rdsTypes) : bound;
+    if (val > rdsBest && river_valid(rdsTypes)) {
+      rdsBest = val;
+      report_incumbent(val);
+      memcpy(rdsBestTypes, rdsTypes, sizeof(rdsTypes));
+    }
+    return;
+  }
+
+  int *next = rds->vals + (size_t)(p + 1) * rds->profiles;
+  int gain[2], nextProfile[2], childBound[2];
+  int k;
+  bool blocked = (rdsTypes[rds->cell[p]] == LHO_BLOCKED);
+
+  // 0 = river, 1 = landscape
+  nextProfile[0] = rds_step(p, profile, true, &gain[0]);
+  nextProfile[1] = rds_step(p, profile, false, &gain[1]);
+  for (k = 0; k < 2; k++) {
+    childBound[k] = gain[k] + next[nextProfile[k]];
+  }
+
+  // most promising child first, so good layouts are found early
+  int first = (childBound[1] >= childBound[0]) ? 1 : 0;
+  for (k = 0; k < 2; k++) {
+    int child = (k == 0) ? first : 1 - first;
+    bool river = (child == 0);
+    if (river && (riverClosed || blocked)) {
+      continue;
+    }
+
+    int childRiver = numRiver + river;
+    bool closed = riverClosed ||
+                  (childRiver > 0 && !rds_window_has_river(nextProfile[child]));
+
+    if (!blocked) {
+      rdsTypes[rds->cell[p]] = river ? LHO_RIVER : LHO_LANDSCAPE;
+    }
+
+    int ends = numEnds, borderEnds = numBorderEnds;
+    bool ok = true;
+    if (p >= rds->width && rdsTypes[rds->cell[p - rds->width]] == LHO_RIVER) {
+      int cell = rds->cell[p - rds->width];
+      int nbrs[MAX_NEIGHBOURS];
+      int n, numNbrs = get_neighbours(cell, nbrs), riverNbrs = 0;
+      for (n = 0; n < numNbrs; n++) {
+        riverNbrs += (rdsTypes[nbrs[n]] == LHO_RIVER);
+      }
+      if (riverNbrs == 0) {
+        ok = (childRiver == 1); // a lone tile has to be the whole river
+        closed = true;
+      } else if (riverNbrs == 1) {
+        ends++;
+        borderEnds += river_start(cell);
+        ok = (ends < 2 || borderEnds > 0) && ends <= 2;
+      }
+    }
+
+    if (ok) {
+      rds_search(p + 1, nextProfile[child], acc + gain[child], childRiver,
+                 closed, ends, borderEnds);
+    }
+    if (!blocked) {
+      rdsTypes[rds->cell[p]] = LHO_EMPTY;
+    }
+  }
+}
+
+// Searches for a layout better than incumbent (whose types are passed in
+// types) keeping the blocked tiles of types in place. rds_setup must have
+// been called already. The best layout found is written back to types and its
+// value returned, which is just incumbent if nothing beat it.
+int rds_solve_types(enum Terrain *types, int incumbent)
+{
+  int i;
+
+  rdsHasBlocked = false;
+  for (i = 0; i < rds->len; i++) {
+    rdsBestTypes[i] = types[i];
+    if (types[i] == LHO_BLOCKED) {
+      rdsTypes[i] = LHO_BLOCKED;
+      rdsHasBlocked = true;
+    } else {
+      rdsTypes[i] = LHO_EMPTY;
+    }
+  }
+  rdsBest = incumbent;
+  rds_search(0, 0, 0, 0, false, 0, 0);
+
+  memcpy(types, rdsBestTypes, rds->len * sizeof(enum Terrain));
+
+  return rdsBest;
+}
+
+// Fills grid with an optimal layout using Russian Doll Search, leaving any
+// blocked tiles in place.
+// Returns the value of the layout, or -1 if the grid is too wide for the
+// suffix tables (the caller should fall back to recurse_grid).
+int rds_solve(struct Grid *grid)
+{
+  enum Terrain types[MAX_ROWS * MAX_COLS];
+  int i, val;
+
+  if (!rds_setup()) {
+    return -1;
+  }
+
+  // no river at all is always possible, so start from that
+  for (i = 0; i < rds->len; i++) {
+    types[i] = grid->grid[get_row_idx(i)][get_col_idx(i)].type;
+    if (types[i] != LHO_BLOCKED) {
+      types[i] = LHO_LANDSCAPE;
+    }
+  }
+  val = rds_solve_types(types, types_value(types));
+
+  for (i = 0; i < rds->len; i++) {
+    grid->grid[get_row_idx(i)][get_col_idx(i)].type = types[i];
+  }
+  recount_grid(grid);
+
+  return val;
+}
+
+
+/*
+  Regret map: how much the best layout loses when each tile in turn is
+  blocked (by the road or another card). Every variant shares the suffix
+  tables of the base solve and starts from the base layout with that tile
+  blocked as its incumbent, so it only has to look for something better. If
+  that incumbent already matches the base value the tile doesn't matter and
+  its search is skipped. The variants are spread over one thread per core.
+*/
+
+struct RegretJob {
+  int rows, cols, land;
+  enum Terrain baseTypes[MAX_ROWS * MAX_COLS];
+  int baseVal;
+  int *regret; // by linear index
+  int nextCell;
+  int numSkipped;
+  pthread_mutex_t lock;
+};
+
+static void *regret_worker(void *arg)
+{
+  struct RegretJob *job = arg;
+  enum Terrain types[MAX_ROWS * MAX_COLS];
+  int cell, i;
+
+  load_instance(job->rows, job->cols, job->land);
+  rds_setup();
+  int numCells = numRows * numCols;
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    cell = job->nextCell++;
+    pthread_mutex_unlock(&job->lock);
+    if (cell >= numCells) {
+      break;
+    }
+    if (job->baseTypes[cell] == LHO_BLOCKED) {
+      job->regret[cell] = 0;
+      continue;
+    }
+
+    // The base layout minus this tile, or minus its whole river if that
+    // breaks the river, is always still possible
+    memcpy(types, job->baseTypes, numCells * sizeof(enum Terrain));
+    types[cell] = LHO_BLOCKED;
+    if (!river_valid(types)) {
+      for (i = 0; i < numCells; i++) {
+        if (types[i] == LHO_RIVER) {
+          types[i] = LHO_LANDSCAPE;
+        }
+      }
+    }
+    int incumbent = types_value(types);
+
+    if (incumbent >= job->baseVal) {
+      job->regret[cell] = 0;
+      pthread_mutex_lock(&job->lock);
+      job->numSkipped++;
+      pthread_mutex_unlock(&job->lock);
+      continue;
+    }
+
+    job->regret[cell] = job->baseVal - rds_solve_types(types, incumbent);
+  }
+  rds_release();
+
+  return NULL;
+}
+
+// Solves grid (left holding the best layout) then fills regret with the loss
+// from blocking each tile. Returns the number of tiles that needed no search
+// of their own, or -1 if russian doll search can't handle the grid (or there
+// isn't the memory for it).
+int regret_map(struct Grid *grid, int *regret)
+{
+  struct RegretJob *job = mem_alloc(LHO_MEM_SEARCH, sizeof(*job));
+  int numCells = numRows * numCols;
+  int i;
+
+  if (job == NULL) {
+    return -1;
+  }
+  job->baseVal = rds_solve(grid);
+  if (job->baseVal < 0) {
+    mem_free(job);
+    return -1;
+  }
+  for (i = 0; i < numCells; i++) {
+    job->baseTypes[i] = grid->grid[get_row_idx(i)][get_col_idx(i)].type;
+  }
+  job->rows = numRows;
+  job->cols = numCols;
+  job->land = landChoice;
+  job->regret = regret;
+  job->nextCell = 0;
+  job->numSkipped = 0;
+  pthread_mutex_init(&job->lock, NULL);
+
+  long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (numThreads < 1) {
+    numThreads = 1;
+  }
+  if (numThreads > numCells) {
+    numThreads = numCells;
+  }
+
+  pthread_t *threads = malloc(numThreads * sizeof(pthread_t));
+  for (i = 0; i < numThreads; i++) {
+    pthread_create(&threads[i], NULL, regret_worker, job);
+  }
+  for (i = 0; i < numThreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&job->lock);
+  rds_release();
+
+  int numSkipped = job->numSkipped;
+  mem_free(job);
+
+  return numSkipped;
+}
+
+// Prints the regret of every tile in the same layout as print_grid
+void print_regret_map(const int *regret)
+{
+  int i,j;
+  int width = 1, maxRegret = 0;
+
+  for (i = 0; i < numRows * numCols; i++) {
+    if (regret[i] > maxRegret) {
+      maxRegret = regret[i];
+    }
+  }
+  for (i = maxRegret; i >= 10; i /= 10) {
+    width++;
+  }
+
+  printf("\n  ");
+  for (j = 0; j < numCols; j++) {
+    printf("-%.*s", width + 2, "----------------");
+  }
+  printf("-\n");
+  for (i = 0; i < numRows; i++) {
+    printf("  ");
+    for (j = 0; j < numCols; j++) {
+      printf("| %*d ", width, regret[i * numCols + j]);
+    }
+    printf("|\n  ");
+    for (j = 0; j < numCols; j++) {
+      printf("-%.*s", width + 2, "----------------");
+    }
+    printf("-\n");
+  }
+  printf("\n");
+}
+
+
+/*
+  Random layouts
+
+  sampler_setup counts the layouts of a grid, and sample_layout then draws
+  them uniformly at random, for seeding local searches and making benchmark
+  corpora. Tiles are decided in the same order as the Russian Doll Search
+  table with a window of the last row's worth of tiles, as there. Each window
+  tile records whether it is river and, if so, how many river neighbours it
+  has so far and which piece of river it belongs to. No tile may get three
+  river neighbours, a tile may only join two pieces that are different, and
+  a piece that leaves the window has to be the whole river, one of whose
+  ends (a tile with one river neighbour, or none) a river may start on.
+
+  A forward pass finds every window state reached at every position and a
+  backward pass counts the ways to finish the grid from each, as doubles so
+  any size of grid works. Sampling walks forward choosing each tile in
+  proportion to the counts below it, so every layout is as likely as any
+  other and nothing is ever rejected.
+
+  The rivers counted are those that only touch themselves where they run on,
+  which are valid with or without --induced: a layout whose river runs
+  alongside itself is never drawn. Non-river tiles are landscape, or either
+  landscape or empty with allowEmpty. Given a minimum value (full layouts
+  only), the window tiles also record their river neighbours above and to
+  the left, as in the Russian Doll table, and the state carries the value of
+  the tiles that have left the window, capped at the minimum as more makes
+  no difference. Only layouts worth at least the minimum are then counted,
+  so the best layouts can be drawn from without ever finding them, and
+  states that can't reach the minimum are dropped using the Russian Doll
+  suffix optima when the grid has no blocked tiles.
+*/
+
+#define SAMPLE_MAX_WIDTH 11
+#define SAMPLE_SLOT_BITS 5
+#define SAMPLE_RIVER 8 // codes from here are river, 8 * (degree + 1) + piece
+#define SAMPLE_START_END ((uint64_t)1 << (SAMPLE_SLOT_BITS * SAMPLE_MAX_WIDTH))
+#define SAMPLE_CLOSED (SAMPLE_START_END << 1) // the river is finished
+#define SAMPLE_FLAGS (SAMPLE_START_END | SAMPLE_CLOSED)
+#define SAMPLE_NONE UINT64_MAX // free hash slot
+
+struct SampleState {
+  uint64_t profile; // window codes, oldest first, and flags
+  int value; // value of the tiles gone from the window, capped at minValue
+  double count; // layouts that finish from here
+};
+
+// one position's states, open addressed
+struct SampleLayer {
+  struct SampleState *states;
+  size_t size, count;
+};
+
+struct Sampler {
+  int width, len;
+  int minValue; // -1 for any
+  bool allowEmpty;
+  int cell[MAX_ROWS * MAX_COLS]; // position -> linear index
+  int open[MAX_ROWS * MAX_COLS]; // unblocked neighbours by position
+  bool blocked[MAX_ROWS * MAX_COLS], fixed[MAX_ROWS * MAX_COLS];
+  bool start[MAX_ROWS * MAX_COLS];
+  const int *bound; // rds suffix optima, or NULL
+  int boundProfiles;
+  struct SampleLayer layer[MAX_ROWS * MAX_COLS + 1];
+};
+
+static _Thread_local struct Sampler *sampler;
+
+// splitmix64, for anything that wants reproducible random numbers
+uint64_t random_next(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// uniform in [0, 1)
+double random_unit(uint64_t *state)
+{
+  return (random_next(state) >> 11) * 0x1.0p-53;
+}
+
+static inline bool sample_is_river(int code)
+{
+  return code >= SAMPLE_RIVER;
+}
+
+// Finds a state in layer, adding it (with no count) if add is set. Returns
+// NULL if it isn't there, or if there's no room to add it.
+static struct SampleState *sample_find(struct SampleLayer *layer,
+                                       uint64_t profile, int value, bool add)
+{
+  size_t i;
+
+  if (add && 10 * (layer->count + 1) > 7 * layer->size) {
+    struct SampleLayer grown = {NULL, layer->size ? 2 * layer->size : 64, 0};
+    grown.states = mem_try_alloc(LHO_MEM_TABLES,
+                                 grown.size * sizeof(struct SampleState));
+    if (grown.states == NULL) {
+      return NULL;
+    }
+    for (i = 0; i < grown.size; i++) {
+      grown.states[i].profile = SAMPLE_NONE;
+    }
+    for (i = 0; i < layer->size; i++) {
+      struct SampleState *old = &layer->states[i];
+      if (old->profile != SAMPLE_NONE) {
+        *sample_find(&grown, old->profile, old->value, true) = *old;
+      }
+    }
+    mem_free(layer->states);
+    *layer = grown;
+  }
+  if (layer->size == 0) {
+    return NULL;
+  }
+
+  i = ((profile ^ (uint64_t)value * 0x9e3779b97f4a7c15ULL) *
+       0xbf58476d1ce4e5b9ULL >> 20) & (layer->size - 1);
+  while (layer->states[i].profile != SAMPLE_NONE) {
+    if (layer->states[i].profile == profile &&
+        layer->states[i].value == value) {
+      return &layer->states[i];
+    }
+    i = (i + 1) & (layer->size - 1);
+  }
+  if (!add) {
+    return NULL;
+  }
+  layer->states[i].profile = profile;
+  layer->states[i].value = value;
+  layer->states[i].count = 0;
+  layer->count++;
+
+  return &layer->states[i];
+}
+
+// Packs window codes (oldest first) and flags into a profile, numbering the
+// pieces of river in the order they appear so equal states look the same
+static uint64_t sample_pack(const int *codes, uint64_t flags)
+{
+  int piece[8], next = 0, i;
+  uint64_t profile = flags;
+
+  memset(piece, -1, sizeof(piece));
+  for (i = 0; i < sampler->width; i++) {
+    int code = codes[i];
+    if (sample_is_river(code)) {
+      if (piece[code % 8] < 0) {
+        piece[code % 8] = next++;
+      }
+      code += piece[code % 8] - code % 8;
+    }
+    profile |= (uint64_t)code << (SAMPLE_SLOT_BITS * i);
+  }
+
+  return profile;
+}
+
+static void sample_unpack(uint64_t profile, int *codes)
+{
+  int i;
+
+  for (i = 0; i < sampler->width; i++) {
+    codes[i] = profile >> (SAMPLE_SLOT_BITS * i) & 31;
+  }
+}
+
+// The tile at position q, with code, leaves the window: all its neighbours
+// are decided, right and below saying which of the last two are river. rest
+// are the numRest codes still in the window. Scores it if it's landscape.
+// Returns false if the river can no longer be a path.
+static bool sample_leave(int q, int code, const int *rest, int numRest,
+                         bool right, bool below, uint64_t *flags, int *value)
+{
+  int i;
+
+  if (sample_is_river(code)) {
+    if (code / 8 - 1 < 2 && sampler->start[q]) {
+      *flags |= SAMPLE_START_END;
+    }
+    for (i = 0; i < numRest; i++) {
+      if (sample_is_river(rest[i]) && rest[i] % 8 == code % 8) {
+        return true;
+      }
+    }
+    // that was the last of its piece, which has to be the whole river
+    for (i = 0; i < numRest; i++) {
+      if (sample_is_river(rest[i])) {
+        return false;
+      }
+    }
+    if (!(*flags & SAMPLE_START_END)) {
+      return false;
+    }
+    *flags |= SAMPLE_CLOSED;
+  } else if (code > 0) {
+    int r = code - 1 + right + below;
+    *value += tileVals[r][sampler->open[q] - r];
+    if (*value > sampler->minValue) {
+      *value = sampler->minValue;
+    }
+  }
+
+  return true;
+}
+
+// Decides position p of a state: river, or not. Returns false if that can't
+// be part of a layout, otherwise fills in the state it leads to.
+static bool sample_step(int p, uint64_t profile, int value, bool river,
+                        uint64_t *nextProfile, int *nextValue)
+{
+  int w = sampler->width, col = p % w;
+  int codes[SAMPLE_MAX_WIDTH + 1];
+  int nbrs[2], numNbrs = 0;
+  uint64_t flags = profile & SAMPLE_FLAGS;
+  int i, k, code;
+
+  sample_unpack(profile, codes);
+  if (p >= w) {
+    nbrs[numNbrs++] = 0; // above
+  }
+  if (col > 0) {
+    nbrs[numNbrs++] = w - 1; // left
+  }
+
+  if (river) {
+    int deg = 0, piece = -1;
+    if (sampler->blocked[p] || (flags & SAMPLE_CLOSED)) {
+      return false;
+    }
+    for (k = 0; k < numNbrs; k++) {
+      int c = codes[nbrs[k]];
+      if (!sample_is_river(c)) {
+        continue;
+      }
+      if (c / 8 - 1 == 2) {
+        return false; // would be its third river neighbour
+      }
+      codes[nbrs[k]] = c + 8;
+      deg++;
+      if (piece < 0) {
+        piece = c % 8;
+      } else if (c % 8 == piece) {
+        return false; // would close a loop
+      } else {
+        for (i = 0; i < w; i++) {
+          if (sample_is_river(codes[i]) && codes[i] % 8 == c % 8) {
+            codes[i] += piece - c % 8;
+          }
+        }
+      }
+    }
+    if (piece < 0) {
+      bool used[8] = {false};
+      for (i = 0; i < w; i++) {
+        if (sample_is_river(codes[i])) {
+          used[codes[i] % 8] = true;
+        }
+      }
+      for (piece = 0; used[piece]; piece++) {
+      }
+    }
+    code = 8 * (deg + 1) + piece;
+  } else {
+    if (sampler->fixed[p]) {
+      return false;
+    }
+    code = 0;
+    if (sampler->minValue >= 0 && !sampler->blocked[p]) {
+      code = 1;
+      for (k = 0; k < numNbrs; k++) {
+        code += sample_is_river(codes[nbrs[k]]);
+      }
+    }
+  }
+
+  codes[w] = code;
+  if (p >= w &&
+      !sample_leave(p - w, codes[0], codes + 1, w, col < w - 1 &&
+                    sample_is_river(codes[1]), river, &flags, &value)) {
+    return false;
+  }
+  *nextProfile = sample_pack(codes + 1, flags);
+  *nextValue = value;
+
+  return true;
+}
+
+// whether a state after the last position is a whole layout worth enough
+static bool sample_final(uint64_t profile, int value)
+{
+  int w = sampler->width;
+  int codes[SAMPLE_MAX_WIDTH];
+  uint64_t flags = profile & SAMPLE_FLAGS;
+  int i;
+
+  sample_unpack(profile, codes);
+  for (i = 0; i < w; i++) {
+    bool right = i < w - 1 && sample_is_river(codes[i + 1]);
+    if (!sample_leave(sampler->len - w + i, codes[i], codes + i + 1,
+                      w - 1 - i, right, false, &flags, &value)) {
+      return false;
+    }
+  }
+
+  return value >= sampler->minValue;
+}
+
+// most a state at position p could still reach
+static int sample_bound(int p, uint64_t profile, int value)
+{
+  int i;
+
+  if (sampler->bound == NULL) {
+    return value + maxTileVal * (sampler->len - p + sampler->width);
+  }
+
+  int codes[SAMPLE_MAX_WIDTH], rdsProfile = 0;
+  sample_unpack(profile, codes);
+  for (i = 0; i < sampler->width; i++) {
+    if (!sample_is_river(codes[i])) {
+      rdsProfile |= codes[i] << (2 * i);
+    }
+  }
+  return value + sampler->bound[(size_t)p * sampler->boundProfiles +
+                                rdsProfile];
+}
+
+// ways to fill a position that isn't river
+static inline int sample_non_river(int p)
+{
+  return sampler->allowEmpty && sampler->minValue < 0 &&
+         !sampler->blocked[p] ? 2 : 1;
+}
+
+// Frees this thread's sampler, if it has one
+void sampler_free(void)
+{
+  int p;
+
+  if (sampler == NULL) {
+    return;
+  }
+  for (p = 0; p <= sampler->len; p++) {
+    mem_free(sampler->layer[p].states);
+  }
+  mem_free(sampler);
+  sampler = NULL;
+}
+
+// Counts the layouts of grid worth at least minValue (any if minValue < 0)
+// for sample_layout. Blocked tiles stay blocked, riverFixed tiles river, and
+// allowEmpty lets other tiles be empty when there's no minimum. Returns the
+// number of layouts, or -1 if the grid isn't a square layout, has more than
+// SAMPLE_MAX_WIDTH tiles on its shorter side, or has too many states to fit
+// under --mem-limit.
+double sampler_setup(const struct Grid *grid, int minValue, bool allowEmpty)
+{
+  bool colMajor = numCols > numRows;
+  int nbrs[MAX_NEIGHBOURS];
+  int p, k, river;
+  size_t i;
+
+  sampler_free();
+  if (!adjSquare || (colMajor ? numRows : numCols) > SAMPLE_MAX_WIDTH) {
+    return -1;
+  }
+  sampler = mem_try_calloc(LHO_MEM_TABLES, sizeof(struct Sampler));
+  if (sampler == NULL) {
+    return -1;
+  }
+  sampler->width = colMajor ? numRows : numCols;
+  sampler->len = numRows * numCols;
+  sampler->minValue = minValue;
+  sampler->allowEmpty = allowEmpty;
+
+  bool anyBlocked = false;
+  for (p = 0; p < sampler->len; p++) {
+    int c = colMajor ? (p % numRows) * numCols + p / numRows : p;
+    int numNbrs = get_neighbours(c, nbrs);
+    sampler->cell[p] = c;
+    sampler->blocked[p] =
+      grid->grid[get_row_idx(c)][get_col_idx(c)].type == LHO_BLOCKED;
+    sampler->fixed[p] = riverFixed != NULL && riverFixed[c];
+    sampler->start[p] = river_start(c);
+    for (k = 0; k < numNbrs; k++) {
+      sampler->open[p] += grid->grid[get_row_idx(nbrs[k])]
+                                    [get_col_idx(nbrs[k])].type != LHO_BLOCKED;
+    }
+    anyBlocked |= sampler->blocked[p];
+  }
+  if (minValue >= 0 && !anyBlocked && rds_setup()) {
+    sampler->bound = rds->vals;
+    sampler->boundProfiles = rds->profiles;
+  }
+
+  // every state reached at every position
+  // with nothing decided every code and flag is 0
+  bool ok = sample_find(&sampler->layer[0], 0, 0, true) != NULL;
+  for (p = 0; ok && p < sampler->len; p++) {
+    struct SampleLayer *layer = &sampler->layer[p];
+    for (i = 0; ok && i < layer->size; i++) {
+      struct SampleState state = layer->states[i];
+      if (state.profile == SAMPLE_NONE) {
+        continue;
+      }
+      for (river = 0; ok && river < 2; river++) {
+        uint64_t profile;
+        int value;
+        if (!sample_step(p, state.profile, state.value, river, &profile,
+                         &value) ||
+            (minValue >= 0 && sample_bound(p + 1, profile, value) < minValue)) {
+          continue;
+        }
+        ok = sample_find(&sampler->layer[p + 1], profile, value, true) != NULL;
+      }
+    }
+  }
+  // the table is only needed while the states are found
+  sampler->bound = NULL;
+  rds_release();
+  if (!ok) {
+    sampler_free();
+    return -1;
+  }
+
+  // and the layouts that finish from each
+  for (p = sampler->len; p >= 0; p--) {
+    struct SampleLayer *layer = &sampler->layer[p];
+    for (i = 0; i < layer->size; i++) {
+      struct SampleState *state = &layer->states[i];
+      if (state->profile == SAMPLE_NONE) {
+        continue;
+      }
+      if (p == sampler->len) {
+        state->count = sample_final(state->profile, state->value);
+        continue;
+      }
+      for (river = 0; river < 2; river++) {
+        uint64_t profile;
+        int value;
+        if (sample_step(p, state->profile, state->value, river, &profile,
+                        &value)) {
+          struct SampleState *next = sample_find(&sampler->layer[p + 1],
+                                                 profile, value, false);
+          if (next != NULL) {
+            state->count += next->count * (river ? 1 : sample_non_river(p));
+          }
+        }
+      }
+    }
+  }
+
+  return sample_find(&sampler->layer[0], 0, 0, false)->count;
+}
+
+// Fills grid with a layout drawn uniformly from those sampler_setup counted
+// (there has to be at least one), using the random state rng. Returns its
+// value.
+int sample_layout(struct Grid *grid, uint64_t *rng)
+{
+  uint64_t profile = 0;
+  int value = 0;
+  int p, river;
+
+  for (p = 0; p < sampler->len; p++) {
+    uint64_t nextProfile[2];
+    int nextValue[2];
+    double weight[2] = {0, 0};
+    for (river = 0; river < 2; river++) {
+      if (sample_step(p, profile, value, river, &nextProfile[river],
+                      &nextValue[river])) {
+        struct SampleState *next = sample_find(&sampler->layer[p + 1],
+                                               nextProfile[river],
+                                               nextValue[river], false);
+        if (next != NULL) {
+          weight[river] = next->count * (river ? 1 : sample_non_river(p));
+        }
+      }
+    }
+    river = random_unit(rng) * (weight[0] + weight[1]) >= weight[0];
+    if (weight[river] == 0) {
+      river = !river; // rounding at the very edge
+    }
+
+    int c = sampler->cell[p];
+    struct Tile *tile = &grid->grid[get_row_idx(c)][get_col_idx(c)];
+    if (river) {
+      tile->type = LHO_RIVER;
+    } else if (!sampler->blocked[p]) {
+      tile->type = sample_non_river(p) == 2 && (random_next(rng) & 1) ?
+                   LHO_EMPTY : LHO_LANDSCAPE;
+    }
+    profile = nextProfile[river];
+    value = nextValue[river];
+  }
+  recount_grid(grid);
+
+  return val_calc(*grid);
+}
+
+
+/*
+  Line search
+
+  Branches on a whole line of the grid at a time instead of a tile at a time,
+  so the search is only as deep as the grid is long. Lines run the same way as
+  the Russian Doll Search table (rows, or columns when there are more columns
+  than rows), which is what lets that table bound every node: after k lines
+  the window is exactly line k - 1.
+
+  A line is a bitmask of its river tiles. The children of a node are made by
+  stepping the rds window along the new line a tile at a time, which also
+  finishes the tiles of the line before it, so a partial line is dropped as
+  soon as the table says it can't beat the best layout so far. The lines
+  that survive are tried best bound first. A table per width, shared by
+  every grid that wide, gives the number of rivers beside each tile from
+  within its line, which the river filters use:
+  * once a river piece has nothing below it to carry on into, it has to be
+    the whole river, so no other piece and no later line may have any river
+  * as in rds_search, at most two finished river tiles can be dead ends, and
+    with two one has to be a tile the river can start on
+  Layouts are checked in full with river_valid at the end. Grids with
+  blocked tiles are left to rds_solve.
+*/
+
+// Rivers beside each tile of a line from within the line, 2 bits a tile
+struct LineTable {
+  int width;
+  unsigned int *hRivers; // by line
+  struct LineTable *next;
+};
+
+static struct LineTable *lineCache = NULL;
+static pthread_mutex_t lineCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct LineChild {
+  unsigned int line;
+  int profile; // rds window after the line
+  int acc; // value of the tiles that have left the window
+  int bound;
+  int numEnds, numBorderEnds;
+  bool riverDone; // no more river can be placed
+  signed char labels[MAX_ROWS > MAX_COLS ? MAX_ROWS : MAX_COLS];
+};
+
+static _Thread_local struct LineTable *lines;
+static _Thread_local int lineCount;
+static _Thread_local unsigned int lineChoice[MAX_ROWS > MAX_COLS ?
+                                             MAX_ROWS : MAX_COLS];
+static _Thread_local enum Terrain lineBestTypes[MAX_ROWS * MAX_COLS];
+static _Thread_local int lineBest;
+static _Thread_local struct LineChild *lineStack; // room for every level's children
+
+// Finds or builds the table for the current rds width
+static bool line_setup(void)
+{
+  int w = rds->width;
+  unsigned int line;
+  int c;
+
+  pthread_mutex_lock(&lineCacheLock);
+  for (lines = lineCache; lines != NULL; lines = lines->next) {
+    if (lines->width == w) {
+      pthread_mutex_unlock(&lineCacheLock);
+      return true;
+    }
+  }
+
+  lines = mem_try_alloc(LHO_MEM_TABLES, sizeof(struct LineTable));
+  if (lines == NULL) {
+    pthread_mutex_unlock(&lineCacheLock);
+    return false;
+  }
+  lines->width = w;
+  lines->hRivers = mem_try_alloc(LHO_MEM_TABLES,
+                                 (1u << w) * sizeof(unsigned int));
+  if (lines->hRivers == NULL) {
+    mem_free(lines);
+    lines = NULL;
+    pthread_mutex_unlock(&lineCacheLock);
+    return false;
+  }
+  for (line = 0; line < (1u << w); line++) {
+    unsigned int packed = 0;
+    for (c = 0; c < w; c++) {
+      unsigned int r = (c > 0 && (line >> (c - 1) & 1)) +
+                       (c < w - 1 && (line >> (c + 1) & 1));
+      packed |= r << (2 * c);
+    }
+    lines->hRivers[line] = packed;
+  }
+  lines->next = lineCache;
+  lineCache = lines;
+  pthread_mutex_unlock(&lineCacheLock);
+
+  return true;
+}
+
+static int line_find(int *parent, int i)
+{
+  while (parent[i] != i) {
+    i = parent[i] = parent[parent[i]];
+  }
+  return i;
+}
+
+// Fills in the river pieces of child, which puts child->line below line.
+// Returns false if no valid river can come of it.
+static bool line_river(unsigned int line, const signed char *labels,
+                       int numRiver, struct LineChild *child)
+{
+  int w = rds->width;
+  unsigned int next = child->line;
+  int parent[2 * (MAX_ROWS > MAX_COLS ? MAX_ROWS : MAX_COLS)];
+  bool alive[2 * (MAX_ROWS > MAX_COLS ? MAX_ROWS : MAX_COLS)];
+  signed char relabel[2 * (MAX_ROWS > MAX_COLS ? MAX_ROWS : MAX_COLS)];
+  int c, numOld = 0, numLabels = 0;
+
+  if (next != 0 && numRiver > 0 && line == 0) {
+    return false; // the river has already ended
+  }
+
+  // join the pieces of river in line (0..w-1) to the runs in next (w + the
+  // first tile of the run)
+  for (c = 0; c < 2 * w; c++) {
+    parent[c] = c;
+    alive[c] = false;
+    relabel[c] = -1;
+  }
+  for (c = 0; c < w; c++) {
+    if (!(next >> c & 1)) {
+      continue;
+    }
+    if (c > 0 && (next >> (c - 1) & 1)) {
+      parent[w + c] = line_find(parent, w + c - 1);
+    }
+    if (line >> c & 1) {
+      int a = line_find(parent, labels[c]), b = line_find(parent, w + c);
+      if (a != b) {
+        parent[a] = b;
+      }
+    }
+  }
+  for (c = 0; c < w; c++) {
+    if (next >> c & 1) {
+      alive[line_find(parent, w + c)] = true;
+    }
+  }
+
+  // a piece with nothing below it has to be the whole river
+  bool closed = false;
+  for (c = 0; c < w; c++) {
+    if ((line >> c & 1) && relabel[labels[c]] < 0) {
+      relabel[labels[c]] = 0;
+      numOld++;
+      closed |= !alive[line_find(parent, labels[c])];
+    }
+  }
+  if (closed) {
+    if (numOld > 1 || next != 0) {
+      return false;
+    }
+    child->riverDone = true;
+  }
+
+  for (c = 0; c < 2 * w; c++) {
+    relabel[c] = -1;
+  }
+  for (c = 0; c < w; c++) {
+    child->labels[c] = -1;
+    if (next >> c & 1) {
+      int root = line_find(parent, w + c);
+      if (relabel[root] < 0) {
+        relabel[root] = numLabels++;
+      }
+      child->labels[c] = relabel[root];
+    }
+  }
+
+  return true;
+}
+
+// What line_children is filling in: line k, below line and above
+struct LineGen {
+  int k;
+  unsigned int above, line;
+  bool noRiver;
+  struct LineChild *children;
+  int numChildren;
+};
+
+// Adds to gen->children every way of filling the line from tile c on that
+// could still beat lineBest. next holds the tiles before c. Deciding tile c
+// finishes the tile of the line before it above c, so that is checked for
+// dead ends straight away.
+static void line_children(struct LineGen *gen, int c, unsigned int next,
+                          int profile, int acc, int numEnds,
+                          int numBorderEnds)
+{
+  int w = rds->width, p = gen->k * w + c;
+  const int *nextVals = rds->vals + (size_t)(p + 1) * rds->profiles;
+  bool aboveRiver = (gen->line >> c & 1);
+  int river;
+
+  for (river = !gen->noRiver; river >= 0; river--) {
+    int gain, nextProfile = rds_step(p, profile, river, &gain);
+    if (acc + gain + nextVals[nextProfile] <= lineBest) {
+      continue;
+    }
+
+    int ends = numEnds, borderEnds = numBorderEnds;
+    if (aboveRiver && (lines->hRivers[gen->line] >> (2 * c) & 3) +
+                      (gen->above >> c & 1) + river == 1) {
+      ends++;
+      borderEnds += river_start(rds->cell[p - w]);
+      if (ends > 2 || (ends == 2 && borderEnds == 0)) {
+        continue;
+      }
+    }
+
+    unsigned int line = next | (unsigned int)river << c;
+    if (c < w - 1) {
+      line_children(gen, c + 1, line, nextProfile, acc + gain, ends,
+                    borderEnds);
+    } else {
+      struct LineChild *child = &gen->children[gen->numChildren++];
+      child->line = line;
+      child->profile = nextProfile;
+      child->acc = acc + gain;
+      child->bound = child->acc + nextVals[nextProfile];
+      child->numEnds = ends;
+      child->numBorderEnds = borderEnds;
+    }
+  }
+}
+
+// Lines 0..k-1 are placed, line is line k - 1 and above is line k - 2.
+// Children go on the stack from children on.
+static void line_search(int k, unsigned int above, unsigned int line,
+                        const struct LineChild *node, int numRiver,
+                        struct LineChild *children)
+{
+  int w = rds->width;
+  int i;
+
+  prof_node();
+  if (node->bound <= lineBest || solve_cancelled()) {
+    return;
+  }
+
+  if (k == lineCount) {
+    enum Terrain types[MAX_ROWS * MAX_COLS];
+    int val = node->bound; // exact once every line is placed
+    for (i = 0; i < rds->len; i++) {
+      types[rds->cell[i]] = (lineChoice[i / w] >> (i % w) & 1) ?
+                            LHO_RIVER : LHO_LANDSCAPE;
+    }
+    if (val > lineBest && river_valid(types)) {
+      lineBest = val;
+      report_incumbent(val);
+      memcpy(lineBestTypes, types, rds->len * sizeof(enum Terrain));
+    }
+    return;
+  }
+
+  struct LineGen gen = {k, above, line, node->riverDone, children, 0};
+  int numChildren = 0;
+
+  line_children(&gen, 0, 0, node->profile, node->acc, node->numEnds,
+                node->numBorderEnds);
+  for (i = 0; i < gen.numChildren; i++) {
+    struct LineChild *child = &children[numChildren];
+    *child = children[i];
+    child->riverDone = node->riverDone;
+    if (line_river(line, node->labels, numRiver, child)) {
+      numChildren++;
+    }
+  }
+
+  // best bound first, insertion sort as most nodes only have a few
+  for (i = 1; i < numChildren; i++) {
+    struct LineChild child = children[i];
+    int j;
+    for (j = i; j > 0 && children[j - 1].bound < child.bound; j--) {
+      children[j] = children[j - 1];
+    }
+    children[j] = child;
+  }
+
+  for (i = 0; i < numChildren; i++) {
+    lineChoice[k] = children[i].line;
+    line_search(k + 1, line, children[i].line, &children[i],
+                numRiver + __builtin_popcount(children[i].line),
+                children + numChildren);
+  }
+}
+
+// Fills grid with an optimal layout by placing a line at a time. Returns the
+// value of the layout, or -1 if the grid has blocked tiles or is too wide
+// for the rds table.
+int line_solve(struct Grid *grid)
+{
+  struct LineChild root;
+  int i;
+
+  for (i = 0; i < numRows * numCols; i++) {
+    if (grid->grid[get_row_idx(i)][get_col_idx(i)].type == LHO_BLOCKED) {
+      return -1;
+    }
+  }
+  if (!rds_setup() || !line_setup()) {
+    return -1;
+  }
+
+  lineCount = rds->len / rds->width;
+  memset(&root, 0, sizeof(root));
+  root.bound = rds->vals[0];
+  memset(root.labels, -1, sizeof(root.labels));
+
+  // no river at all is always possible, so start from that
+  for (i = 0; i < rds->len; i++) {
+    lineBestTypes[i] = LHO_LANDSCAPE;
+  }
+  lineBest = types_value(lineBestTypes);
+  lineStack = mem_try_alloc(LHO_MEM_SEARCH, (size_t)lineCount *
+                            (1u << rds->width) * sizeof(struct LineChild));
+  if (lineStack == NULL) {
+    return -1;
+  }
+  line_search(0, 0, 0, &root, 0, lineStack);
+  mem_free(lineStack);
+
+  for (i = 0; i < rds->len; i++) {
+    grid->grid[get_row_idx(i)][get_col_idx(i)].type = lineBestTypes[i];
+  }
+  recount_grid(grid);
+
+  return lineBest;
+}
+
+
+/*
+  River search
+
+  Tries every river that add_river could build, with every other free tile a
+  landscape tile (a landscape tile is never worth less than a gap). The value
+  is updated as each river tile is added or removed rather than recomputed, so
+  each layout costs only a handful of neighbour updates. This is a plain
+  exhaustive search, and is also the generic version of the compiled solver
+  below.
+*/
+
+static _Thread_local int rsNbrs[MAX_ROWS * MAX_COLS][MAX_NEIGHBOURS];
+static _Thread_local int rsNumNbrs[MAX_ROWS * MAX_COLS]; // unblocked only
+static _Thread_local int rsRiverNbrs[MAX_ROWS * MAX_COLS];
+static _Thread_local bool rsRiver[MAX_ROWS * MAX_COLS];
+static _Thread_local bool rsBestRiver[MAX_ROWS * MAX_COLS];
+static _Thread_local int rsTotal;
+static _Thread_local int rsBest;
+static _Thread_local int rsLen;
+static _Thread_local long long rsNodes; // rivers looked at by the last solve
+
+// value of a tile if it is landscape, given the rivers currently beside it
+static inline int rs_land_val(int cell)
+{
+  int r = rsRiverNbrs[cell];
+  return tileVals[r][rsNumNbrs[cell] - r];
+}
+
+/*
+  River search bounds
+
+  Before extending the river further, rs_extend asks whether anything below
+  can beat the best layout so far. Two bounds are available:
+
+  * cap: every tile that isn't river yet is counted at the best value it
+    could reach if all of its other neighbours became river. Kept as a
+    running total in rs_add/rs_remove, so it costs nothing to check.
+  * reach: the river can only grow into tiles reachable from its head
+    without crossing it, so only those tiles and their neighbours can still
+    change. Finding them is a flood fill, so this is much tighter but costs
+    time proportional to the free part of the grid.
+
+  Whether the flood fill pays for itself depends on how deep the search is,
+  so the statistics are kept per band of river lengths. Every bound records
+  how often it is called and how often it prunes, and a sample of its calls
+  is timed. To learn what a prune saves, one prune in BOUND_PROBE is audited:
+  the subtree is searched anyway and timed. Expensive bounds start off, but
+  still run on one node in BOUND_PROBE, and every prune they would have made
+  there is audited. Every BOUND_REVIEW nodes a band re-decides: an expensive
+  bound is on only if (prune rate) x (time saved per prune) is more than its
+  cost per call. The bounds are then ordered cheapest first, and the first
+  one that prunes ends the check. --bounds=all and --bounds=cheap turn the
+  expensive bounds always on or off for comparison (--bounds=none turns the
+  cheap one off too), and --bound-stats prints the statistics at exit.
+*/
+
+enum RiverBound {LHO_BOUND_CAP, LHO_BOUND_REACH, LHO_NUM_BOUNDS};
+static const char *riverBoundNames[LHO_NUM_BOUNDS] = {"cap", "reach"};
+static const bool riverBoundExpensive[LHO_NUM_BOUNDS] = {false, true};
+
+enum BoundMode {LHO_BOUNDS_ADAPTIVE, LHO_BOUNDS_ALL, LHO_BOUNDS_CHEAP,
+                LHO_BOUNDS_NONE};
+static enum BoundMode boundMode = LHO_BOUNDS_ADAPTIVE;
+
+#define BOUND_BAND 4 // river lengths per band
+#define BOUND_NUM_BANDS ((MAX_ROWS * MAX_COLS + BOUND_BAND - 1) / BOUND_BAND + 1)
+#define BOUND_SAMPLE 64 // time one call in this many
+#define BOUND_PROBE 64 // audit one prune, or probe a switched-off bound, in this many
+#define BOUND_REVIEW 4096 // nodes between decisions
+
+struct BoundStats {
+  long long calls;
+  long long prunes;
+  long long timedCalls;
+  long long ns; // total over the timed calls
+  long long audits;
+  long long auditNs; // total time of the audited subtrees
+};
+
+struct BoundBand {
+  struct BoundStats bound[LHO_NUM_BOUNDS];
+  bool enabled[LHO_NUM_BOUNDS];
+  int order[LHO_NUM_BOUNDS]; // cheapest first
+  long long skipped[LHO_NUM_BOUNDS]; // nodes a switched-off bound sat out
+  long long switches; // times a bound was turned on or off
+  long long nodes;
+  long long sinceReview;
+};
+
+struct BoundBands {
+  struct BoundBand band[BOUND_NUM_BANDS];
+  struct BoundBands *next;
+};
+
+// every thread's statistics, for the report
+static struct BoundBands *boundBandsList = NULL;
+static pthread_mutex_t boundBandsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local struct BoundBands *rsBands = NULL;
+static _Thread_local int rsDepth; // tiles of river
+static _Thread_local int rsCap; // the cap bound
+// best value of a tile with deg free neighbours, r of them river, if up to
+// n more of its neighbours became river
+static _Thread_local int rsRangeMax[MAX_NEIGHBOURS + 1][MAX_NEIGHBOURS + 1]
+                                   [MAX_NEIGHBOURS + 1];
+// flood fill scratch space for the reach bound
+static _Thread_local int rsStamp;
+static _Thread_local int rsSeen[MAX_ROWS * MAX_COLS];
+static _Thread_local int rsReachNbrs[MAX_ROWS * MAX_COLS];
+static _Thread_local int rsQueue[MAX_ROWS * MAX_COLS];
+static _Thread_local int rsTouched[MAX_ROWS * MAX_COLS]; // stamps too
+
+static inline int rs_cap(int cell)
+{
+  int r = rsRiverNbrs[cell], deg = rsNumNbrs[cell];
+  return rsRangeMax[deg][r][deg - r];
+}
+
+// Sets up the tables for the current instance and this thread's statistics
+static void rs_bounds_setup(void)
+{
+  int deg, r, n, i;
+
+  for (deg = 0; deg <= MAX_NEIGHBOURS; deg++) {
+    for (r = 0; r <= deg; r++) {
+      int best = tileVals[r][deg - r];
+      for (n = 0; r + n <= deg; n++) {
+        if (tileVals[r + n][deg - r - n] > best) {
+          best = tileVals[r + n][deg - r - n];
+        }
+        rsRangeMax[deg][r][n] = best;
+      }
+    }
+  }
+
+  if (rsBands == NULL) {
+    rsBands = calloc(1, sizeof(struct BoundBands));
+    for (i = 0; i < BOUND_NUM_BANDS; i++) {
+      for (n = 0; n < LHO_NUM_BOUNDS; n++) {
+        rsBands->band[i].enabled[n] = !riverBoundExpensive[n] ||
+                                      boundMode == LHO_BOUNDS_ALL;
+        rsBands->band[i].order[n] = n;
+      }
+    }
+    pthread_mutex_lock(&boundBandsLock);
+    rsBands->next = boundBandsList;
+    boundBandsList = rsBands;
+    pthread_mutex_unlock(&boundBandsLock);
+  }
+  rsDepth = 0;
+}
+
+// Best value any extension of the river from head could reach
+static int rs_reach_bound(int head)
+{
+  int numQueued = 0, numTouched = 0, bound = rsTotal;
+  int i, k;
+
+  if (++rsStamp == 0) {
+    memset(rsSeen, 0, sizeof(rsSeen));
+    memset(rsTouched, 0, sizeof(rsTouched));
+    rsStamp = 1;
+  }
+
+  // flood fill the tiles the river could still grow into
+  for (k = 0; k < rsNumNbrs[head]; k++) {
+    int nbr = rsNbrs[head][k];
+    if (!rsRiver[nbr] && rsSeen[nbr] != rsStamp) {
+      rsSeen[nbr] = rsStamp;
+      rsQueue[numQueued++] = nbr;
+    }
+  }
+  for (i = 0; i < numQueued; i++) {
+    int cell = rsQueue[i];
+    for (k = 0; k < rsNumNbrs[cell]; k++) {
+      int nbr = rsNbrs[cell][k];
+      if (!rsRiver[nbr] && rsSeen[nbr] != rsStamp) {
+        rsSeen[nbr] = rsStamp;
+        rsQueue[numQueued++] = nbr;
+      }
+    }
+  }
+
+  // count the reachable neighbours of every tile that has some
+  for (i = 0; i < numQueued; i++) {
+    int cell = rsQueue[i];
+    for (k = 0; k < rsNumNbrs[cell]; k++) {
+      int nbr = rsNbrs[cell][k];
+      if (rsRiver[nbr]) {
+        continue;
+      }
+      if (rsTouched[nbr] != rsStamp) {
+        rsTouched[nbr] = rsStamp;
+        rsReachNbrs[nbr] = 0;
+        rsQueue[numQueued + numTouched++] = nbr;
+      }
+      rsReachNbrs[nbr]++;
+    }
+  }
+
+  // only those tiles can change
+  for (i = 0; i < numTouched; i++) {
+    int cell = rsQueue[numQueued + i];
+    int r = rsRiverNbrs[cell], deg = rsNumNbrs[cell];
+    bound += rsRangeMax[deg][r][rsReachNbrs[cell]] - tileVals[r][deg - r];
+  }
+
+  return bound;
+}
+
+// Re-decides which bounds a band runs and in what order
+static void rs_review_band(struct BoundBand *band)
+{
+  double cost[LHO_NUM_BOUNDS];
+  int b, k;
+
+  band->sinceReview = 0;
+  for (b = 0; b < LHO_NUM_BOUNDS; b++) {
+    struct BoundStats *stats = &band->bound[b];
+    bool enabled;
+    cost[b] = stats->timedCalls ? (double)stats->ns / stats->timedCalls : 0.0;
+    if (!riverBoundExpensive[b] || boundMode == LHO_BOUNDS_ALL) {
+      enabled = true;
+    } else if (boundMode == LHO_BOUNDS_CHEAP || stats->audits == 0) {
+      enabled = false;
+    } else {
+      double pruneRate = (double)stats->prunes / stats->calls;
+      double saved = (double)stats->auditNs / stats->audits;
+      enabled = pruneRate * saved > cost[b];
+    }
+    if (enabled != band->enabled[b]) {
+      band->switches++;
+      band->enabled[b] = enabled;
+    }
+  }
+
+  // insertion sort, there are only a few
+  for (b = 1; b < LHO_NUM_BOUNDS; b++) {
+    int bound = band->order[b];
+    for (k = b; k > 0 && cost[band->order[k - 1]] > cost[bound]; k--) {
+      band->order[k] = band->order[k - 1];
+    }
+    band->order[k] = bound;
+  }
+}
+
+// Whether nothing below the current river can beat rsBest. If a prune is
+// to be audited instead, returns false and sets *audit to the bound.
+static bool rs_pruned(int head, struct BoundBand *band, int *audit)
+{
+  struct timespec start;
+  int k;
+
+  if (boundMode == LHO_BOUNDS_NONE) {
+    return false;
+  }
+  if (++band->sinceReview >= BOUND_REVIEW) {
+    rs_review_band(band);
+  }
+
+  for (k = 0; k < LHO_NUM_BOUNDS; k++) {
+    int b = band->order[k];
+    struct BoundStats *stats = &band->bound[b];
+    if (!band->enabled[b] && (boundMode == LHO_BOUNDS_CHEAP ||
+                              ++band->skipped[b] % BOUND_PROBE != 0)) {
+      continue;
+    }
+
+    bool timed = stats->calls++ % BOUND_SAMPLE == 0;
+    if (timed) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    int bound = (b == LHO_BOUND_CAP) ? rsCap : rs_reach_bound(head);
+    if (timed) {
+      stats->ns += elapsed_ns(&start);
+      stats->timedCalls++;
+    }
+    if (bound <= rsBest) {
+      if (!band->enabled[b] || stats->prunes++ % BOUND_PROBE == 0) {
+        if (!band->enabled[b]) {
+          stats->prunes++;
+        }
+        *audit = b;
+        return false;
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Prints the merged statistics of every thread
+void bound_report(void)
+{
+  struct BoundBand merged[BOUND_NUM_BANDS];
+  struct BoundBands *bands;
+  int i, b;
+
+  memset(merged, 0, sizeof(merged));
+  pthread_mutex_lock(&boundBandsLock);
+  for (bands = boundBandsList; bands != NULL; bands = bands->next) {
+    for (i = 0; i < BOUND_NUM_BANDS; i++) {
+      struct BoundBand *from = &bands->band[i], *to = &merged[i];
+      for (b = 0; b < LHO_NUM_BOUNDS; b++) {
+        to->bound[b].calls += from->bound[b].calls;
+        to->bound[b].prunes += from->bound[b].prunes;
+        to->bound[b].timedCalls += from->bound[b].timedCalls;
+        to->bound[b].ns += from->bound[b].ns;
+        to->bound[b].audits += from->bound[b].audits;
+        to->bound[b].auditNs += from->bound[b].auditNs;
+        to->enabled[b] |= from->enabled[b];
+        to->order[b] = b;
+      }
+      to->switches += from->switches;
+      to->nodes += from->nodes;
+    }
+  }
+  pthread_mutex_unlock(&boundBandsLock);
+
+  printf("\n River search bounds by river length (mode %s):\n\n",
+         boundMode == LHO_BOUNDS_ALL ? "all" :
+         boundMode == LHO_BOUNDS_CHEAP ? "cheap" :
+         boundMode == LHO_BOUNDS_NONE ? "none" : "adaptive");
+  printf("  %7s %12s", "length", "nodes");
+  for (b = 0; b < LHO_NUM_BOUNDS; b++) {
+    printf(" | %-5s %11s %7s %8s %10s %3s", riverBoundNames[b], "calls",
+           "pruned", "ns/call", "ns/prune", "");
+  }
+  printf(" | switches\n");
+
+  for (i = 0; i < BOUND_NUM_BANDS; i++) {
+    struct BoundBand *band = &merged[i];
+    if (band->nodes == 0) {
+      continue;
+    }
+    printf("  %3d-%-3d %12lld", i * BOUND_BAND, (i + 1) * BOUND_BAND - 1,
+           band->nodes);
+    for (b = 0; b < LHO_NUM_BOUNDS; b++) {
+      struct BoundStats *stats = &band->bound[b];
+      printf(" | %-5s %11lld %6.2f%% %8.1f %10.0f %3s", "", stats->calls,
+             stats->calls ? 100.0 * stats->prunes / stats->calls : 0.0,
+             stats->timedCalls ? (double)stats->ns / stats->timedCalls : 0.0,
+             stats->audits ? (double)stats->auditNs / stats->audits : 0.0,
+             band->enabled[b] ? "on" : "off");
+    }
+    printf(" | %lld\n", band->switches);
+  }
+}
+
+static void rs_add(int cell)
+{
+  int k;
+
+  rsTotal -= rs_land_val(cell);
+  rsCap -= rs_cap(cell);
+  rsRiver[cell] = true;
+  rsDepth++;
+  for (k = 0; k < rsNumNbrs[cell]; k++) {
+    int nbr = rsNbrs[cell][k];
+    if (rsRiver[nbr]) {
+      rsRiverNbrs[nbr]++;
+    } else {
+      rsTotal -= rs_land_val(nbr);
+      rsCap -= rs_cap(nbr);
+      rsRiverNbrs[nbr]++;
+      rsTotal += rs_land_val(nbr);
+      rsCap += rs_cap(nbr);
+    }
+  }
+}
+
+static void rs_remove(int cell)
+{
+  int k;
+
+  for (k = 0; k < rsNumNbrs[cell]; k++) {
+    int nbr = rsNbrs[cell][k];
+    if (rsRiver[nbr]) {
+      rsRiverNbrs[nbr]--;
+    } else {
+      rsTotal -= rs_land_val(nbr);
+      rsCap -= rs_cap(nbr);
+      rsRiverNbrs[nbr]--;
+      rsTotal += rs_land_val(nbr);
+      rsCap += rs_cap(nbr);
+    }
+  }
+  rsRiver[cell] = false;
+  rsDepth--;
+  rsTotal += rs_land_val(cell);
+  rsCap += rs_cap(cell);
+}
+
+static void rs_extend(int head)
+{
+  struct BoundBand *band = &rsBands->band[rsDepth / BOUND_BAND];
+  struct timespec start;
+  int audit = -1;
+  int k;
+
+  prof_node();
+  rsNodes++;
+  if (solve_cancelled()) {
+    return;
+  }
+  if (rsTotal > rsBest) {
+    rsBest = rsTotal;
+    report_incumbent(rsBest);
+    memcpy(rsBestRiver, rsRiver, rsLen * sizeof(bool));
+  }
+  band->nodes++;
+  if (rs_pruned(head, band, &audit)) {
+    return;
+  }
+
+  if (audit >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+  }
+  for (k = 0; k < rsNumNbrs[head]; k++) {
+    int nbr = rsNbrs[head][k];
+    // head is the one river tile an induced river may border
+    if (!rsRiver[nbr] && (!inducedRivers || rsRiverNbrs[nbr] == 1)) {
+      rs_add(nbr);
+      prof_push(prof_move(nbr, false));
+      rs_extend(nbr);
+      prof_pop();
+      rs_remove(nbr);
+    }
+  }
+  if (audit >= 0) {
+    band->bound[audit].auditNs += elapsed_ns(&start);
+    band->bound[audit].audits++;
+  }
+}
+
+// Sets up the river search for grid with no river and nothing found yet
+static void rs_setup(struct Grid *grid)
+{
+  int nbrs[MAX_NEIGHBOURS];
+  int i,k;
+
+  rsLen = numRows * numCols;
+  rsTotal = 0;
+  rsNodes = 0;
+  for (i = 0; i < rsLen; i++) {
+    int numNbrs = get_neighbours(i, nbrs);
+    rsNumNbrs[i] = 0;
+    for (k = 0; k < numNbrs; k++) {
+      if (grid->grid[get_row_idx(nbrs[k])][get_col_idx(nbrs[k])].type !=
+          LHO_BLOCKED) {
+        rsNbrs[i][rsNumNbrs[i]++] = nbrs[k];
+      }
+    }
+    rsRiverNbrs[i] = 0;
+    rsRiver[i] = false;
+  }
+  rs_bounds_setup();
+  rsCap = 0;
+  for (i = 0; i < rsLen; i++) {
+    if (grid->grid[get_row_idx(i)][get_col_idx(i)].type != LHO_BLOCKED) {
+      rsTotal += rs_land_val(i);
+      rsCap += rs_cap(i);
+    }
+  }
+}
+
+// Puts the best river found into grid, landscape everywhere else
+static void rs_finish(struct Grid *grid)
+{
+  int i;
+
+  for (i = 0; i < rsLen; i++) {
+    struct Tile *tile = &grid->grid[get_row_idx(i)][get_col_idx(i)];
+    if (tile->type != LHO_BLOCKED) {
+      tile->type = rsBestRiver[i] ? LHO_RIVER : LHO_LANDSCAPE;
+    }
+  }
+  recount_grid(grid);
+}
+
+// Fills grid with an optimal layout by trying every river, leaving any blocked
+// tiles in place. Returns the value of the layout.
+int river_solve(struct Grid *grid)
+{
+  int i;
+
+  rs_setup(grid);
+  rsBest = rsTotal;
+  memcpy(rsBestRiver, rsRiver, rsLen * sizeof(bool));
+  for (i = 0; i < rsLen; i++) {
+    if (river_start(i) &&
+        grid->grid[get_row_idx(i)][get_col_idx(i)].type != LHO_BLOCKED) {
+      rs_add(i);
+      prof_push(prof_move(i, false));
+      rs_extend(i);
+      prof_pop();
+      rs_remove(i);
+    }
+  }
+  rs_finish(grid);
+
+  return rsBest;
+}
+
+// Solves every grid up to maxSize x maxSize for every landscape with and
+// without --induced and prints how many rivers each looked at and whether
+// the induced rivers ever lost the optimum. The bounds are turned off so
+// every river is looked at. Returns the number of losses.
+int verify_induced(int maxSize)
+{
+  bool wasInduced = inducedRivers;
+  enum BoundMode wasMode = boundMode;
+  int rows, cols, land, losses = 0;
+
+  printf("\n  %-5s %-4s %7s %7s %14s %14s %8s\n", "grid", "land", "value",
+         "induced", "rivers", "induced", "fewer");
+  boundMode = LHO_BOUNDS_NONE;
+  for (rows = 1; rows <= maxSize; rows++) {
+    for (cols = rows; cols <= maxSize; cols++) {
+      for (land = 0; land < 4; land++) {
+        struct Grid grid;
+        load_instance(rows, cols, land);
+        allocate_grid(&grid);
+
+        inducedRivers = false;
+        int full = river_solve(&grid);
+        long long fullNodes = rsNodes;
+        inducedRivers = true;
+        int induced = river_solve(&grid);
+        long long inducedNodes = rsNodes;
+
+        printf("  %2dx%-2d %-4d %7d %7d %14lld %14lld %7.1fx%s\n", rows, cols,
+               land, full, induced, fullNodes, inducedNodes,
+               (double)fullNodes / inducedNodes,
+               induced < full ? "  LOST" : "");
+        losses += (induced < full);
+        free_grid(&grid);
+      }
+    }
+  }
+  inducedRivers = wasInduced;
+  boundMode = wasMode;
+
+  printf("\n Induced rivers lost the optimum on %d grids\n", losses);
+  return losses;
+}
+
+
+/*
+  Bidirectional river search
+
+  The river search above grows every river from the tile it starts on, so
+  it can't make use of anything known about the middle of the river.
+  --engine=bidir grows rivers outward from a seed tile at both ends (the
+  head and the tail), which lets it start from a tile the river has to
+  cover (see riverFixed). A river may end anywhere as long as one of its ends
+  is a tile a river may start on.
+
+  To try every river once, each has one seed and one order of growth:
+  * The seed is the lowest fixed tile if there are any. Otherwise every tile
+    is a seed in turn, and only tiles after it may be added.
+  * At every step one open end is picked by a fixed rule from what is there.
+    The search then either adds a tile at that end, or closes the end for
+    good, if the other end is still open.
+  * A river of one tile only grows its head. The tail's first tile has to
+    come after the head's first tile, or every river would be found again
+    backwards.
+  The end picked is the one with fewer extensions whose cap (see the river
+  search bounds) can still beat the best layout so far, so the search grows
+  wherever the bound constrains it most. It is usually the end hemmed in by
+  blocked tiles, the edge, or the river itself.
+*/
+
+static _Thread_local int bdSeed; // the tile the current rivers grow from
+static _Thread_local int bdMin; // tiles up to it can't be added, or -1
+static _Thread_local int bdFirstHead; // the tile after the seed on the head side
+static _Thread_local int bdNumFixed, bdFixedIn; // fixed tiles, and how many are river
+
+static inline void bd_add(int cell)
+{
+  rs_add(cell);
+  bdFixedIn += (riverFixed != NULL && riverFixed[cell]);
+}
+
+static inline void bd_remove(int cell)
+{
+  rs_remove(cell);
+  bdFixedIn -= (riverFixed != NULL && riverFixed[cell]);
+}
+
+// the lowest tile end d may grow onto, less one
+static inline int bd_floor(const int ends[2], int d)
+{
+  if (d == 1 && ends[1] == bdSeed && rsDepth > 1) {
+    return bdFirstHead > bdMin ? bdFirstHead : bdMin;
+  }
+  return bdMin;
+}
+
+// whether the river can grow onto cell, next to one of its ends
+static inline bool bd_can_add(int cell, int floor)
+{
+  return !rsRiver[cell] && cell > floor &&
+         (!inducedRivers || rsRiverNbrs[cell] == 1);
+}
+
+// how many tiles end d could grow onto that leave the cap above rsBest
+static int bd_options(const int ends[2], int d)
+{
+  int floor = bd_floor(ends, d), end = ends[d];
+  int k, n = 0;
+
+  for (k = 0; k < rsNumNbrs[end]; k++) {
+    int nbr = rsNbrs[end][k];
+    if (bd_can_add(nbr, floor)) {
+      bd_add(nbr);
+      n += (rsCap > rsBest);
+      bd_remove(nbr);
+    }
+  }
+
+  return n;
+}
+
+// ends[0] is the head and ends[1] the tail; open[d] is false once end d is
+// closed. fresh is set if the river has just grown, rather than had an end
+// closed, so that each river is scored once.
+static void bd_extend(int ends[2], bool open[2], bool fresh)
+{
+  bool bounded = (boundMode != LHO_BOUNDS_NONE);
+  int k, d;
+
+  prof_node();
+  rsNodes++;
+  if (solve_cancelled()) {
+    return;
+  }
+  if (fresh && rsTotal > rsBest && bdFixedIn == bdNumFixed &&
+      (river_start(ends[0]) || river_start(ends[1]))) {
+    rsBest = rsTotal;
+    report_incumbent(rsBest);
+    memcpy(rsBestRiver, rsRiver, rsLen * sizeof(bool));
+  }
+  if (bounded && rsCap <= rsBest) {
+    return;
+  }
+
+  if (open[0] && open[1]) {
+    d = (rsDepth > 1 && bd_options(ends, 1) < bd_options(ends, 0));
+  } else if (open[0] || open[1]) {
+    d = open[1];
+  } else {
+    return;
+  }
+
+  int end = ends[d], floor = bd_floor(ends, d);
+  for (k = 0; k < rsNumNbrs[end]; k++) {
+    int nbr = rsNbrs[end][k];
+    if (!bd_can_add(nbr, floor)) {
+      continue;
+    }
+    bd_add(nbr);
+    if (!bounded || rsCap > rsBest) {
+      if (rsDepth == 2) {
+        bdFirstHead = nbr;
+      }
+      ends[d] = nbr;
+      prof_push(prof_move(nbr, false));
+      bd_extend(ends, open, true);
+      prof_pop();
+      ends[d] = end;
+    }
+    bd_remove(nbr);
+  }
+
+  // or this end is done, and the other takes over
+  if (open[!d] && rsDepth > 1) {
+    open[d] = false;
+    bd_extend(ends, open, false);
+    open[d] = true;
+  }
+}
+
+// Fills grid with the best layout whose river covers every fixed tile, by
+// growing rivers at both ends. Returns its value, or -1 if no river can
+// cover them all.
+int bidir_solve(struct Grid *grid)
+{
+  int i;
+
+  rs_setup(grid);
+  bdNumFixed = 0;
+  bdFixedIn = 0;
+  bdSeed = -1;
+  for (i = 0; i < rsLen; i++) {
+    if (riverFixed != NULL && riverFixed[i] &&
+        grid->grid[get_row_idx(i)][get_col_idx(i)].type != LHO_BLOCKED) {
+      bdSeed = bdNumFixed++ == 0 ? i : bdSeed;
+    }
+  }
+
+  // with fixed tiles, no river at all doesn't count
+  rsBest = bdNumFixed > 0 ? -1 : rsTotal;
+  memcpy(rsBestRiver, rsRiver, rsLen * sizeof(bool));
+  for (i = 0; i < rsLen; i++) {
+    if (grid->grid[get_row_idx(i)][get_col_idx(i)].type == LHO_BLOCKED ||
+        (bdNumFixed > 0 && i != bdSeed)) {
+      continue;
+    }
+    int ends[2] = {i, i};
+    bool open[2] = {true, true};
+    bdSeed = i;
+    bdMin = bdNumFixed > 0 ? -1 : i;
+    bd_add(i);
+    prof_push(prof_move(i, false));
+    bd_extend(ends, open, true);
+    prof_pop();
+    bd_remove(i);
+  }
+
+  if (rsBest < 0) {
+    return -1;
+  }
+  rs_finish(grid);
+
+  return rsBest;
+}
+
+
+/*
+  Frontier search
+
+  The river search above walks every river separately, so two rivers that
+  cover the same tiles and end on the same tile are searched twice from
+  there on, though everything below them is the same. --engine=frontier
+  instead works breadth first: every river of length L is kept as a packed
+  state (river tiles as a bit mask, shifted up past the head tile's index)
+  in one flat array, and all of them are grown by one tile at once into the
+  next array. That array is then radix sorted, so duplicate states sit
+  together and are dropped, and the states of each river mask are next to
+  each other, so each mask is scored just once however many heads it has. A
+  mask whose cap (the bound the river search uses) can't beat the best
+  layout so far is dropped with all its states.
+
+  Each phase is split evenly over one thread per core working on slices of
+  the arrays, with a barrier between phases and thread 0 doing the little
+  serial work (prefix sums, swapping arrays) in between. The solving thread
+  is thread 0, so cancellation and incumbents work as for any engine.
+
+  Only grids of up to FRONTIER_MAX_CELLS tiles fit in a state, and a level
+  with more than FRONTIER_MAX_STATES states (fewer under --mem-limit) gives
+  up, in which case the river search is used instead (or see --frontier-dir
+  below).
+*/
+
+#define FRONTIER_HEAD_BITS 6
+#define FRONTIER_MAX_CELLS (64 - FRONTIER_HEAD_BITS)
+#define FRONTIER_MAX_STATES ((size_t)1 << 25) // 256MB per array
+#define FRONTIER_RADIX_BITS 8
+#define FRONTIER_RADIX (1 << FRONTIER_RADIX_BITS)
+#define FRONTIER_MAX_THREADS 64
+
+// where --frontier-dir keeps the levels, or NULL to keep them in memory
+static const char *frontierDir = NULL;
+
+struct FrontierOut {
+  uint64_t *states;
+  size_t len, cap;
+  size_t offset; // where len states go in the gathered array
+  size_t hist[FRONTIER_RADIX];
+  int best;
+  uint64_t bestMask;
+};
+
+struct FrontierJob {
+  int numThreads;
+  int numCells;
+  int stateBits;
+  bool induced;
+  uint64_t nbrMask[FRONTIER_MAX_CELLS]; // unblocked neighbours
+  uint64_t open; // unblocked tiles
+  // value and cap of each tile as landscape by its number of river neighbours
+  int cellVal[FRONTIER_MAX_CELLS][MAX_NEIGHBOURS + 1];
+  int cellCap[FRONTIER_MAX_CELLS][MAX_NEIGHBOURS + 1];
+
+  uint64_t *cur, *next, *scratch; // maxStates each
+  size_t maxStates; // FRONTIER_MAX_STATES, or less to fit --mem-limit
+  size_t curLen, nextLen;
+  int pass;
+  int best; // best value found on earlier levels
+  uint64_t bestMask;
+  bool stop; // done, out of room or cancelled
+  atomic_bool overflow; // a level had too many states
+  pthread_barrier_t barrier;
+  struct FrontierOut out[FRONTIER_MAX_THREADS];
+};
+
+struct FrontierWorker {
+  struct FrontierJob *job;
+  int t;
+};
+
+// value and cap of the layout with river mask and landscape everywhere else
+static void frontier_score(const struct FrontierJob *job, uint64_t mask,
+                           int *val, int *cap)
+{
+  uint64_t land = job->open & ~mask;
+  *val = 0;
+  *cap = 0;
+  while (land != 0) {
+    int c = __builtin_ctzll(land);
+    int r = __builtin_popcountll(job->nbrMask[c] & mask);
+    *val += job->cellVal[c][r];
+    *cap += job->cellCap[c][r];
+    land &= land - 1;
+  }
+}
+
+// the part of n items thread t works on
+static void frontier_slice(const struct FrontierJob *job, int t, size_t n,
+                           size_t *start, size_t *end)
+{
+  *start = n * t / job->numThreads;
+  *end = n * (t + 1) / job->numThreads;
+}
+
+static bool frontier_push(struct FrontierOut *out, uint64_t state,
+                          size_t maxStates)
+{
+  if (out->len == out->cap) {
+    size_t cap = out->cap ? 2 * out->cap : 4096;
+    uint64_t *states = NULL;
+    if (cap <= maxStates) {
+      states = mem_try_realloc(LHO_MEM_SEARCH, out->states,
+                               cap * sizeof(uint64_t));
+    }
+    if (states == NULL) {
+      return false;
+    }
+    out->states = states;
+    out->cap = cap;
+  }
+  out->states[out->len++] = state;
+  return true;
+}
+
+// Grows each of thread t's states in cur by one tile into its output
+static void frontier_expand(struct FrontierJob *job, int t)
+{
+  struct FrontierOut *out = &job->out[t];
+  size_t i, start, end;
+
+  out->len = 0;
+  frontier_slice(job, t, job->curLen, &start, &end);
+  for (i = start; i < end && !job->overflow; i++) {
+    uint64_t state = job->cur[i];
+    uint64_t mask = state >> FRONTIER_HEAD_BITS;
+    int head = (int)(state & ((1 << FRONTIER_HEAD_BITS) - 1));
+    uint64_t grow = job->nbrMask[head] & ~mask;
+
+    while (grow != 0) {
+      int c = __builtin_ctzll(grow);
+      grow &= grow - 1;
+      if (job->induced &&
+          __builtin_popcountll(job->nbrMask[c] & mask) > 1) {
+        continue; // would touch the river away from its head
+      }
+      uint64_t child = (mask | (uint64_t)1 << c) << FRONTIER_HEAD_BITS | c;
+      if (!frontier_push(out, child, job->maxStates)) {
+        job->overflow = true;
+        break;
+      }
+    }
+  }
+}
+
+// Works out where each thread's output goes and whether it all fits
+static void frontier_place(struct FrontierJob *job)
+{
+  size_t total = 0;
+  int t;
+
+  for (t = 0; t < job->numThreads; t++) {
+    job->out[t].offset = total;
+    total += job->out[t].len;
+  }
+  job->nextLen = total;
+  if (total > job->maxStates) {
+    job->overflow = true;
+  }
+}
+
+// counts the current radix digit over thread t's slice of next
+static void frontier_count(struct FrontierJob *job, int t)
+{
+  struct FrontierOut *out = &job->out[t];
+  int shift = job->pass * FRONTIER_RADIX_BITS;
+  size_t i, start, end;
+
+  memset(out->hist, 0, sizeof(out->hist));
+  frontier_slice(job, t, job->nextLen, &start, &end);
+  for (i = start; i < end; i++) {
+    out->hist[(job->next[i] >> shift) & (FRONTIER_RADIX - 1)]++;
+  }
+}
+
+// turns the per-thread digit counts into where each thread writes each digit
+static void frontier_prefix(struct FrontierJob *job)
+{
+  size_t total = 0;
+  int d, t;
+
+  for (d = 0; d < FRONTIER_RADIX; d++) {
+    for (t = 0; t < job->numThreads; t++) {
+      size_t n = job->out[t].hist[d];
+      job->out[t].hist[d] = total;
+      total += n;
+    }
+  }
+}
+
+// stable scatter of thread t's slice of next into scratch by the digit
+static void frontier_scatter(struct FrontierJob *job, int t)
+{
+  struct FrontierOut *out = &job->out[t];
+  int shift = job->pass * FRONTIER_RADIX_BITS;
+  size_t i, start, end;
+
+  frontier_slice(job, t, job->nextLen, &start, &end);
+  for (i = start; i < end; i++) {
+    uint64_t state = job->next[i];
+    job->scratch[out->hist[(state >> shift) & (FRONTIER_RADIX - 1)]++] = state;
+  }
+}
+
+// swaps next and scratch after a pass
+static void frontier_swap(struct FrontierJob *job)
+{
+  uint64_t *states = job->next;
+  job->next = job->scratch;
+  job->scratch = states;
+  job->pass++;
+}
+
+// Drops duplicates from thread t's slice of the sorted next, scores each
+// mask that starts in the slice, and keeps the states of those that can
+// still beat the best so far
+static void frontier_prune(struct FrontierJob *job, int t)
+{
+  struct FrontierOut *out = &job->out[t];
+  size_t i, start, end;
+  bool alive = false;
+
+  out->len = 0;
+  out->best = job->best;
+  out->bestMask = 0;
+  frontier_slice(job, t, job->nextLen, &start, &end);
+  if (start < end && start > 0) {
+    // the slice may start part way through a mask
+    uint64_t mask = job->next[start] >> FRONTIER_HEAD_BITS;
+    int val, cap;
+    if (mask == job->next[start - 1] >> FRONTIER_HEAD_BITS) {
+      frontier_score(job, mask, &val, &cap);
+      alive = (cap > job->best);
+    }
+  }
+
+  for (i = start; i < end; i++) {
+    uint64_t state = job->next[i];
+    if (i > 0 && state == job->next[i - 1]) {
+      continue;
+    }
+    uint64_t mask = state >> FRONTIER_HEAD_BITS;
+    if (i == 0 || mask != job->next[i - 1] >> FRONTIER_HEAD_BITS) {
+      int val, cap;
+      frontier_score(job, mask, &val, &cap);
+      if (val > out->best) {
+        out->best = val;
+        out->bestMask = mask;
+      }
+      alive = (cap > job->best);
+    }
+    if (alive) {
+      job->scratch[start + out->len++] = state;
+    }
+  }
+}
+
+// Gathers the kept states into cur and takes the best of the threads'
+static void frontier_settle(struct FrontierJob *job)
+{
+  size_t len = 0;
+  int t;
+
+  for (t = 0; t < job->numThreads; t++) {
+    size_t start, end;
+    frontier_slice(job, t, job->nextLen, &start, &end);
+    memmove(job->cur + len, job->scratch + start,
+            job->out[t].len * sizeof(uint64_t));
+    len += job->out[t].len;
+    if (job->out[t].best > job->best) {
+      job->best = job->out[t].best;
+      job->bestMask = job->out[t].bestMask;
+    }
+  }
+  job->curLen = len;
+  report_incumbent(job->best);
+}
+
+// Runs serial on thread 0 between two barriers
+static void frontier_serial(struct FrontierJob *job, int t,
+                            void (*serial)(struct FrontierJob *job))
+{
+  pthread_barrier_wait(&job->barrier);
+  if (t == 0) {
+    serial(job);
+  }
+  pthread_barrier_wait(&job->barrier);
+}
+
+static void frontier_check(struct FrontierJob *job)
+{
+  job->stop = job->overflow || job->nextLen == 0 || solve_cancelled();
+  job->pass = 0;
+}
+
+static void *frontier_worker(void *arg)
+{
+  struct FrontierWorker *worker = arg;
+  struct FrontierJob *job = worker->job;
+  int t = worker->t;
+  int passes = (job->stateBits + FRONTIER_RADIX_BITS - 1) / FRONTIER_RADIX_BITS;
+
+  for (;;) {
+    // next holds the states one tile longer than cur
+    frontier_serial(job, t, frontier_check);
+    if (job->stop) {
+      break;
+    }
+    while (job->pass < passes) {
+      frontier_count(job, t);
+      frontier_serial(job, t, frontier_prefix);
+      frontier_scatter(job, t);
+      frontier_serial(job, t, frontier_swap);
+    }
+    frontier_prune(job, t);
+    frontier_serial(job, t, frontier_settle);
+
+    frontier_expand(job, t);
+    frontier_serial(job, t, frontier_place);
+    if (!job->overflow) {
+      memcpy(job->next + job->out[t].offset, job->out[t].states,
+             job->out[t].len * sizeof(uint64_t));
+    }
+  }
+
+  return NULL;
+}
+
+// A job for grid with its tables filled in and the all-landscape layout as
+// the best so far, or NULL if the grid has too many tiles
+static struct FrontierJob *frontier_job_new(struct Grid *grid)
+{
+  int numCells = numRows * numCols;
+  int nbrs[MAX_NEIGHBOURS];
+  int c, k, r;
+
+  if (numCells > FRONTIER_MAX_CELLS) {
+    return NULL;
+  }
+
+  struct FrontierJob *job = mem_try_calloc(LHO_MEM_SEARCH,
+                                           sizeof(struct FrontierJob));
+  if (job == NULL) {
+    return NULL;
+  }
+  job->numCells = numCells;
+  job->stateBits = numCells + FRONTIER_HEAD_BITS;
+  job->induced = inducedRivers;
+  for (c = 0; c < numCells; c++) {
+    if (grid->grid[get_row_idx(c)][get_col_idx(c)].type != LHO_BLOCKED) {
+      job->open |= (uint64_t)1 << c;
+    }
+  }
+  for (c = 0; c < numCells; c++) {
+    int numNbrs = get_neighbours(c, nbrs), deg = 0;
+    for (k = 0; k < numNbrs; k++) {
+      if (job->open >> nbrs[k] & 1) {
+        job->nbrMask[c] |= (uint64_t)1 << nbrs[k];
+        deg++;
+      }
+    }
+    for (r = 0; r <= deg; r++) {
+      int n, best = 0;
+      for (n = 0; r + n <= deg; n++) {
+        if (tileVals[r + n][deg - r - n] > best) {
+          best = tileVals[r + n][deg - r - n];
+        }
+      }
+      job->cellVal[c][r] = tileVals[r][deg - r];
+      job->cellCap[c][r] = best;
+    }
+  }
+
+  frontier_score(job, 0, &job->best, &r);
+  report_incumbent(job->best);
+
+  return job;
+}
+
+// the one-tile river on c, if a river may start there
+static bool frontier_start(const struct FrontierJob *job, int c,
+                           uint64_t *state)
+{
+  *state = ((uint64_t)1 << c) << FRONTIER_HEAD_BITS | c;
+  return (job->open >> c & 1) && river_start(c);
+}
+
+// Puts the best layout job found into grid
+static void frontier_finish(const struct FrontierJob *job, struct Grid *grid)
+{
+  int c;
+
+  for (c = 0; c < job->numCells; c++) {
+    struct Tile *tile = &grid->grid[get_row_idx(c)][get_col_idx(c)];
+    if (tile->type != LHO_BLOCKED) {
+      tile->type = (job->bestMask >> c & 1) ? LHO_RIVER : LHO_LANDSCAPE;
+    }
+  }
+  recount_grid(grid);
+}
+
+static int frontier_solve_disk(struct Grid *grid);
+
+// Solves grid with the frontier search. Returns the value found, or -1 if
+// the grid is too big for it.
+int frontier_solve(struct Grid *grid)
+{
+  int c, t;
+
+  if (frontierDir != NULL) {
+    return frontier_solve_disk(grid);
+  }
+
+  struct FrontierJob *job = frontier_job_new(grid);
+  if (job == NULL) {
+    return -1;
+  }
+
+  // Under a limit the three arrays and the threads' output (which holds a
+  // level too) share what's left, and levels bigger than that give up
+  job->maxStates = FRONTIER_MAX_STATES;
+  if (mem_headroom() / (4 * sizeof(uint64_t)) < job->maxStates) {
+    job->maxStates = mem_headroom() / (4 * sizeof(uint64_t));
+  }
+  job->cur = mem_try_alloc(LHO_MEM_SEARCH, job->maxStates * sizeof(uint64_t));
+  job->next = mem_try_alloc(LHO_MEM_SEARCH, job->maxStates * sizeof(uint64_t));
+  job->scratch = mem_try_alloc(LHO_MEM_SEARCH,
+                               job->maxStates * sizeof(uint64_t));
+  if (job->maxStates < (size_t)job->numCells || job->cur == NULL ||
+      job->next == NULL || job->scratch == NULL) {
+    mem_free(job->cur);
+    mem_free(job->next);
+    mem_free(job->scratch);
+    mem_free(job);
+    return -1;
+  }
+
+  for (c = 0; c < job->numCells; c++) {
+    if (frontier_start(job, c, &job->next[job->nextLen])) {
+      job->nextLen++;
+    }
+  }
+
+  long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (numThreads < 1) {
+    numThreads = 1;
+  }
+  if (numThreads > FRONTIER_MAX_THREADS) {
+    numThreads = FRONTIER_MAX_THREADS;
+  }
+  job->numThreads = numThreads;
+  pthread_barrier_init(&job->barrier, NULL, numThreads);
+
+  struct FrontierWorker workers[FRONTIER_MAX_THREADS];
+  pthread_t threads[FRONTIER_MAX_THREADS];
+  for (t = 0; t < numThreads; t++) {
+    workers[t].job = job;
+    workers[t].t = t;
+    if (t > 0) {
+      pthread_create(&threads[t], NULL, frontier_worker, &workers[t]);
+    }
+  }
+  frontier_worker(&workers[0]);
+  for (t = 1; t < numThreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  pthread_barrier_destroy(&job->barrier);
+
+  int best = job->overflow ? -1 : job->best;
+  if (best >= 0) {
+    frontier_finish(job, grid);
+  }
+
+  for (t = 0; t < numThreads; t++) {
+    mem_free(job->out[t].states);
+  }
+  mem_free(job->cur);
+  mem_free(job->next);
+  mem_free(job->scratch);
+  mem_free(job);
+
+  return best;
+}
+
+
+/*
+  Frontier search on disk
+
+  With --frontier-dir=DIR the frontier search keeps its levels in files
+  under DIR instead of in memory, so the grid it can finish is bounded by
+  disk rather than RAM. Every file is a sorted list of states stored as the
+  varint-coded gaps between them, which takes a few bytes a state, and is
+  only ever read or written front to back through large stdio buffers.
+
+  Growing a level reads its file and collects the new states in a buffer of
+  FRONTIER_RUN_STATES. Each time the buffer fills, it is radix sorted, rid
+  of duplicates and written out as a run. The runs are then merged, up to
+  FRONTIER_MERGE_WAYS at a time, with a heap. The last merge drops
+  duplicates across runs, scores each mask once, prunes as in memory, and
+  writes what is left as the next level's file. All of this runs on the
+  solving thread, as the disk is what it waits on.
+*/
+
+#define FRONTIER_RUN_STATES ((size_t)1 << 22) // 32MB buffer
+#define FRONTIER_MERGE_WAYS 64
+#define FRONTIER_IO_BUFFER (1 << 20)
+
+static atomic_int frontierFileSeq; // keeps file names apart across threads
+
+// A file of sorted states being written or read
+struct FrontierFile {
+  FILE *fp;
+  char path[4096];
+  uint64_t last; // previous state, which the next is coded against
+  uint64_t state; // when reading, the state just read
+  long long count;
+};
+
+static bool frontier_file_open(struct FrontierFile *file, bool write)
+{
+  if (write) {
+    snprintf(file->path, sizeof(file->path), "%s/lho-frontier-%d-%d.run",
+             frontierDir, (int)getpid(),
+             atomic_fetch_add(&frontierFileSeq, 1));
+  }
+  file->fp = fopen(file->path, write ? "wb" : "rb");
+  if (file->fp == NULL) {
+    fprintf(stderr, "Can't open %s: %s\n", file->path, strerror(errno));
+    return false;
+  }
+  setvbuf(file->fp, NULL, _IOFBF, FRONTIER_IO_BUFFER);
+  file->last = 0;
+  file->count = 0;
+  return true;
+}
+
+// closes the file, and deletes it too if it has been read
+static void frontier_file_close(struct FrontierFile *file, bool remove)
+{
+  fclose(file->fp);
+  file->fp = NULL;
+  if (remove) {
+    unlink(file->path);
+  }
+}
+
+// appends a state, which has to be above the last one written
+static void frontier_file_put(struct FrontierFile *file, uint64_t state)
+{
+  uint64_t gap = state - file->last;
+
+  while (gap >= 0x80) {
+    putc_unlocked((int)(gap & 0x7f) | 0x80, file->fp);
+    gap >>= 7;
+  }
+  putc_unlocked((int)gap, file->fp);
+  file->last = state;
+  file->count++;
+}
+
+// reads the next state into file->state, or returns false at the end
+static bool frontier_file_get(struct FrontierFile *file)
+{
+  uint64_t gap = 0;
+  int shift = 0, byte;
+
+  do {
+    byte = getc_unlocked(file->fp);
+    if (byte == EOF) {
+      return false;
+    }
+    gap |= (uint64_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  file->last += gap;
+  file->state = file->last;
+  return true;
+}
+
+// Sorts n states with bits significant bits, using scratch as room.
+// Returns whichever of the two ends up holding them.
+static uint64_t *frontier_sort(uint64_t *states, uint64_t *scratch, size_t n,
+                               int bits)
+{
+  size_t count[FRONTIER_RADIX];
+  int shift;
+  size_t i;
+
+  for (shift = 0; shift < bits; shift += FRONTIER_RADIX_BITS) {
+    size_t total = 0;
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++) {
+      count[(states[i] >> shift) & (FRONTIER_RADIX - 1)]++;
+    }
+    for (i = 0; i < FRONTIER_RADIX; i++) {
+      size_t c = count[i];
+      count[i] = total;
+      total += c;
+    }
+    for (i = 0; i < n; i++) {
+      scratch[count[(states[i] >> shift) & (FRONTIER_RADIX - 1)]++] = states[i];
+    }
+    uint64_t *tmp = states;
+    states = scratch;
+    scratch = tmp;
+  }
+
+  return states;
+}
+
+// Sorts the buffered states and writes them out as a new run
+static bool frontier_spill(struct FrontierJob *job, uint64_t *buffer,
+                           uint64_t *scratch, size_t n,
+                           struct FrontierFile **runs, int *numRuns)
+{
+  uint64_t *sorted = frontier_sort(buffer, scratch, n, job->stateBits);
+  struct FrontierFile *run;
+  size_t i;
+
+  run = mem_try_realloc(LHO_MEM_SEARCH, *runs,
+                        (*numRuns + 1) * sizeof(struct FrontierFile));
+  if (run == NULL) {
+    return false;
+  }
+  *runs = run;
+  run = &(*runs)[*numRuns];
+  if (!frontier_file_open(run, true)) {
+    return false;
+  }
+  for (i = 0; i < n; i++) {
+    if (i == 0 || sorted[i] != sorted[i - 1]) {
+      frontier_file_put(run, sorted[i]);
+    }
+  }
+  frontier_file_close(run, false);
+  (*numRuns)++;
+
+  return true;
+}
+
+// restores the heap of runs (by their current state) below slot i
+static void frontier_sift(struct FrontierFile **heap, int n, int i)
+{
+  for (;;) {
+    int least = i, l = 2 * i + 1, r = l + 1;
+    if (l < n && heap[l]->state < heap[least]->state) {
+      least = l;
+    }
+    if (r < n && heap[r]->state < heap[least]->state) {
+      least = r;
+    }
+    if (least == i) {
+      return;
+    }
+    struct FrontierFile *tmp = heap[i];
+    heap[i] = heap[least];
+    heap[least] = tmp;
+    i = least;
+  }
+}
+
+// Merges n runs into out without duplicates, deleting them. If prune is
+// set, every mask is scored once and only masks that can still beat the
+// best so far are written, as in frontier_prune.
+static bool frontier_merge(struct FrontierJob *job, struct FrontierFile *runs,
+                           int n, struct FrontierFile *out, bool prune)
+{
+  struct FrontierFile *heap[FRONTIER_MERGE_WAYS];
+  int i, numHeap = 0;
+  bool alive = false, first = true;
+  uint64_t last = 0, lastMask = 0;
+
+  for (i = 0; i < n; i++) {
+    if (!frontier_file_open(&runs[i], false)) {
+      while (--i >= 0) {
+        frontier_file_close(&runs[i], false);
+      }
+      return false;
+    }
+    if (frontier_file_get(&runs[i])) {
+      heap[numHeap++] = &runs[i];
+    }
+  }
+  if (!frontier_file_open(out, true)) {
+    for (i = 0; i < n; i++) {
+      frontier_file_close(&runs[i], false);
+    }
+    return false;
+  }
+  for (i = numHeap / 2 - 1; i >= 0; i--) {
+    frontier_sift(heap, numHeap, i);
+  }
+
+  while (numHeap > 0) {
+    uint64_t state = heap[0]->state;
+    if (!frontier_file_get(heap[0])) {
+      heap[0] = heap[--numHeap];
+    }
+    frontier_sift(heap, numHeap, 0);
+    if (!first && state == last) {
+      continue;
+    }
+    last = state;
+
+    uint64_t mask = state >> FRONTIER_HEAD_BITS;
+    if (prune && (first || mask != lastMask)) {
+      int val, cap;
+      frontier_score(job, mask, &val, &cap);
+      if (val > job->best) {
+        job->best = val;
+        job->bestMask = mask;
+        report_incumbent(val);
+      }
+      alive = (cap > job->best);
+      lastMask = mask;
+    }
+    first = false;
+    if (!prune || alive) {
+      frontier_file_put(out, state);
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    frontier_file_close(&runs[i], true);
+  }
+  frontier_file_close(out, false);
+
+  return true;
+}
+
+// Merges runs down to one file holding the next level, pruned
+static bool frontier_merge_runs(struct FrontierJob *job,
+                                struct FrontierFile **runs, int *numRuns,
+                                struct FrontierFile *level)
+{
+  while (*numRuns > FRONTIER_MERGE_WAYS) {
+    // merge the first FRONTIER_MERGE_WAYS into one run at the end
+    struct FrontierFile merged;
+    if (!frontier_merge(job, *runs, FRONTIER_MERGE_WAYS, &merged, false)) {
+      return false;
+    }
+    *numRuns -= FRONTIER_MERGE_WAYS;
+    memmove(*runs, *runs + FRONTIER_MERGE_WAYS,
+            *numRuns * sizeof(struct FrontierFile));
+    (*runs)[(*numRuns)++] = merged;
+  }
+
+  bool ok = frontier_merge(job, *runs, *numRuns, level, true);
+  *numRuns = 0;
+  return ok;
+}
+
+// The frontier search with its levels on disk, see above
+static int frontier_solve_disk(struct Grid *grid)
+{
+  struct FrontierJob *job = frontier_job_new(grid);
+  struct FrontierFile level, *runs = NULL;
+  uint64_t *buffer, *scratch;
+  size_t n = 0, runStates = FRONTIER_RUN_STATES;
+  int c, numRuns = 0;
+  bool ok = true;
+
+  if (job == NULL) {
+    return -1;
+  }
+  // shorter runs under a limit, just more of them to merge
+  if (mem_headroom() / (2 * sizeof(uint64_t)) < runStates) {
+    runStates = mem_headroom() / (2 * sizeof(uint64_t));
+  }
+  buffer = mem_try_alloc(LHO_MEM_SEARCH, runStates * sizeof(uint64_t));
+  scratch = mem_try_alloc(LHO_MEM_SEARCH, runStates * sizeof(uint64_t));
+  if (runStates < (size_t)job->numCells || buffer == NULL || scratch == NULL) {
+    ok = false;
+  }
+
+  for (c = 0; ok && c < job->numCells; c++) {
+    if (frontier_start(job, c, &buffer[n])) {
+      n++;
+    }
+  }
+  if (ok && n > 0) {
+    ok = frontier_spill(job, buffer, scratch, n, &runs, &numRuns);
+  }
+
+  while (ok && numRuns > 0 && !solve_cancelled()) {
+    ok = frontier_merge_runs(job, &runs, &numRuns, &level);
+    if (!ok || level.count == 0) {
+      if (ok) {
+        unlink(level.path);
+      }
+      break;
+    }
+
+    // grow the level a buffer at a time
+    ok = frontier_file_open(&level, false);
+    n = 0;
+    while (ok && frontier_file_get(&level)) {
+      uint64_t mask = level.state >> FRONTIER_HEAD_BITS;
+      int head = (int)(level.state & ((1 << FRONTIER_HEAD_BITS) - 1));
+      uint64_t grow = job->nbrMask[head] & ~mask;
+      while (grow != 0) {
+        int next = __builtin_ctzll(grow);
+        grow &= grow - 1;
+        if (job->induced &&
+            __builtin_popcountll(job->nbrMask[next] & mask) > 1) {
+          continue;
+        }
+        if (n == runStates) {
+          ok = ok && frontier_spill(job, buffer, scratch, n, &runs, &numRuns);
+          n = 0;
+        }
+        buffer[n++] = (mask | (uint64_t)1 << next) << FRONTIER_HEAD_BITS | next;
+      }
+    }
+    if (ok) {
+      frontier_file_close(&level, true);
+    }
+    if (ok && n > 0) {
+      ok = frontier_spill(job, buffer, scratch, n, &runs, &numRuns);
+    }
+  }
+
+  for (c = 0; c < numRuns; c++) {
+    unlink(runs[c].path);
+  }
+  mem_free(runs);
+  mem_free(buffer);
+  mem_free(scratch);
+
+  int best = ok ? job->best : -1;
+  if (ok) {
+    frontier_finish(job, grid);
+  }
+  mem_free(job);
+
+  return best;
+}
+
+
+/*
+  Brute force
+
+  For grids of up to BRUTE_MAX_CELLS tiles, --engine=brute simply tries every
+  set of river tiles as an integer with one bit per tile, everything else
+  being landscape. Whether a set is a river is looked up in a table built
+  over all sets at once: bruteEnds[set] has a bit for every tile a river
+  covering exactly that set could end on, so a set is a river if its entry
+  isn't zero. Growing by tile v from set s works if v borders one of s's
+  ends, so each entry comes from entries already done and costs a few bit
+  operations per tile.
+
+  Every set is then scored without branches from each tile's neighbour mask
+  and a popcount, in blocks of consecutive integers the compiler can
+  vectorise, with the range of sets split evenly over one thread per core.
+  It is meant as an obviously correct answer to check the other engines
+  against (see --verify-engines), and it is also the fastest engine on grids
+  this small.
+*/
+
+#define BRUTE_MAX_CELLS 20
+#define BRUTE_BLOCK 256
+
+struct BruteJob {
+  int numCells;
+  uint32_t nbrMask[BRUTE_MAX_CELLS]; // unblocked neighbours
+  uint32_t open; // unblocked tiles
+  uint32_t fixed; // tiles the river has to cover
+  int landVal[BRUTE_MAX_CELLS][MAX_NEIGHBOURS + 1]; // by river neighbours
+  const uint32_t *ends; // see above
+  uint32_t lo, hi; // sets this thread scores
+  int best;
+  uint32_t bestSet;
+};
+
+// Fills ends for every set of tiles in job
+static void brute_ends(const struct BruteJob *job, uint32_t *ends)
+{
+  uint32_t set, numSets = (uint32_t)1 << job->numCells;
+
+  ends[0] = 0;
+  for (set = 1; set < numSets; set++) {
+    uint32_t rest = set, found = 0;
+    if ((set & ~job->open) != 0) {
+      ends[set] = 0;
+      continue;
+    }
+    if ((set & (set - 1)) == 0) {
+      ends[set] = river_start(__builtin_ctz(set)) ? set : 0;
+      continue;
+    }
+    while (rest != 0) {
+      int v = __builtin_ctz(rest);
+      uint32_t prev = set ^ ((uint32_t)1 << v);
+      uint32_t touch = job->nbrMask[v] & prev;
+      rest &= rest - 1;
+      // an induced river's new head only borders the old one
+      if ((ends[prev] & touch) != 0 &&
+          (!inducedRivers || (touch & (touch - 1)) == 0)) {
+        found |= (uint32_t)1 << v;
+      }
+    }
+    ends[set] = found;
+  }
+}
+
+static void *brute_worker(void *arg)
+{
+  struct BruteJob *job = arg;
+  int vals[BRUTE_BLOCK];
+  uint32_t base;
+  int c, k;
+
+  job->best = -1;
+  for (base = job->lo; base < job->hi; base += BRUTE_BLOCK) {
+    int n = job->hi - base < BRUTE_BLOCK ? job->hi - base : BRUTE_BLOCK;
+    memset(vals, 0, sizeof(vals));
+    for (c = 0; c < job->numCells; c++) {
+      if (!(job->open >> c & 1)) {
+        continue;
+      }
+      const int *landVal = job->landVal[c];
+      uint32_t nbrs = job->nbrMask[c];
+      for (k = 0; k < n; k++) {
+        uint32_t set = base + k;
+        int land = !(set >> c & 1);
+        vals[k] += land * landVal[__builtin_popcount(nbrs & set)];
+      }
+    }
+    for (k = 0; k < n; k++) {
+      uint32_t set = base + k;
+      if (vals[k] > job->best && (set == 0 || job->ends[set] != 0) &&
+          (set & job->fixed) == job->fixed) {
+        job->best = vals[k];
+        job->bestSet = set;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// Fills grid with an optimal layout by trying every set of river tiles.
+// Returns its value, or -1 if the grid is too big, its table of ends won't fit
+// under --mem-limit, or no river covers every fixed tile.
+int brute_solve(struct Grid *grid)
+{
+  struct BruteJob base, *jobs;
+  int numCells = numRows * numCols;
+  int nbrs[MAX_NEIGHBOURS];
+  int c, k, r, t;
+
+  if (numCells > BRUTE_MAX_CELLS) {
+    return -1;
+  }
+
+  memset(&base, 0, sizeof(base));
+  base.numCells = numCells;
+  for (c = 0; c < numCells; c++) {
+    if (grid->grid[get_row_idx(c)][get_col_idx(c)].type != LHO_BLOCKED) {
+      base.open |= (uint32_t)1 << c;
+      if (riverFixed != NULL && riverFixed[c]) {
+        base.fixed |= (uint32_t)1 << c;
+      }
+    }
+  }
+  for (c = 0; c < numCells; c++) {
+    int numNbrs = get_neighbours(c, nbrs), deg = 0;
+    for (k = 0; k < numNbrs; k++) {
+      if (base.open >> nbrs[k] & 1) {
+        base.nbrMask[c] |= (uint32_t)1 << nbrs[k];
+        deg++;
+      }
+    }
+    for (r = 0; r <= deg; r++) {
+      base.landVal[c][r] = tileVals[r][deg - r];
+    }
+  }
+
+  uint32_t numSets = (uint32_t)1 << numCells;
+  uint32_t *ends = mem_try_alloc(LHO_MEM_TABLES, numSets * sizeof(uint32_t));
+  if (ends == NULL) {
+    return -1;
+  }
+  brute_ends(&base, ends);
+  base.ends = ends;
+
+  long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (numThreads < 1) {
+    numThreads = 1;
+  }
+  if (numThreads > (long)(numSets / BRUTE_BLOCK) + 1) {
+    numThreads = numSets / BRUTE_BLOCK + 1;
+  }
+  jobs = malloc(numThreads * sizeof(struct BruteJob));
+  pthread_t *threads = malloc(numThreads * sizeof(pthread_t));
+  for (t = 0; t < numThreads; t++) {
+    jobs[t] = base;
+    jobs[t].lo = (uint32_t)((uint64_t)numSets * t / numThreads);
+    jobs[t].hi = (uint32_t)((uint64_t)numSets * (t + 1) / numThreads);
+    pthread_create(&threads[t], NULL, brute_worker, &jobs[t]);
+  }
+
+  int best = -1;
+  uint32_t bestSet = 0;
+  for (t = 0; t < numThreads; t++) {
+    pthread_join(threads[t], NULL);
+    if (jobs[t].best > best) {
+      best = jobs[t].best;
+      bestSet = jobs[t].bestSet;
+    }
+  }
+  free(threads);
+  free(jobs);
+  mem_free(ends);
+
+  if (best >= 0) {
+    for (c = 0; c < numCells; c++) {
+      struct Tile *tile = &grid->grid[get_row_idx(c)][get_col_idx(c)];
+      if (tile->type != LHO_BLOCKED) {
+        tile->type = (bestSet >> c & 1) ? LHO_RIVER : LHO_LANDSCAPE;
+      }
+    }
+    recount_grid(grid);
+    report_incumbent(best);
+  }
+
+  return best;
+}
+
+
+/*
+  Compiled river search
+
+  For long runs, the river search above is written out as C specialised to
+  the exact grid: every tile gets its own add/remove/extend functions with
+  its neighbours unrolled and its landscape values as constants, and blocked
+  tiles are compiled away. The source is built with the system C compiler
+  ($CC, or cc) into a shared object and loaded with dlopen. If any of that
+  fails, river_solve is used instead.
+*/
+
+// Writes the specialised solver for the current grid to out
+static void emit_solver(FILE *out, struct Grid *grid)
+{
+  int numCells = numRows * numCols;
+  int nbrs[MAX_NEIGHBOURS];
+  bool blocked[MAX_ROWS * MAX_COLS];
+  int i,k,r;
+
+  for (i = 0; i < numCells; i++) {
+    blocked[i] = (grid->grid[get_row_idx(i)][get_col_idx(i)].type ==
+                  LHO_BLOCKED);
+  }
+
+  fprintf(out,
+    "// Generated by LoopHeroOptimizer for a %dx%d grid, landscape %d\n"
+    "#include <string.h>\n\n"
+    "#define NUM_CELLS %d\n\n"
+    "static int riverNbrs[NUM_CELLS];\n"
+    "static unsigned char river[NUM_CELLS];\n"
+    "static unsigned char bestRiver[NUM_CELLS];\n"
+    "static int total, best;\n\n",
+    numRows, numCols, (int)landChoice, numCells);
+
+  // landscape value of each tile by number of rivers beside it
+  for (i = 0; i < numCells; i++) {
+    if (blocked[i]) {
+      continue;
+    }
+    int numNbrs = get_neighbours(i, nbrs), deg = 0;
+    for (k = 0; k < numNbrs; k++) {
+      deg += !blocked[nbrs[k]];
+    }
+    fprintf(out, "static const int v%d[%d] = {", i, MAX_NEIGHBOURS + 1);
+    for (r = 0; r <= MAX_NEIGHBOURS; r++) {
+      fprintf(out, "%s%d", r ? ", " : "", r <= deg ? tileVals[r][deg - r] : 0);
+    }
+    fprintf(out, "};\n");
+  }
+  fprintf(out, "\n");
+
+  for (i = 0; i < numCells; i++) {
+    if (!blocked[i]) {
+      fprintf(out, "static void ext%d(void);\n", i);
+    }
+  }
+  fprintf(out, "\n");
+
+  for (i = 0; i < numCells; i++) {
+    if (blocked[i]) {
+      continue;
+    }
+    int numNbrs = get_neighbours(i, nbrs);
+
+    fprintf(out, "static inline void add%d(void)\n{\n"
+                 "  total -= v%d[riverNbrs[%d]];\n  river[%d] = 1;\n",
+            i, i, i, i);
+    for (k = 0; k < numNbrs; k++) {
+      int n = nbrs[k];
+      if (!blocked[n]) {
+        fprintf(out, "  if (!river[%d]) total += v%d[riverNbrs[%d] + 1] - "
+                     "v%d[riverNbrs[%d]];\n  riverNbrs[%d]++;\n",
+                n, n, n, n, n, n);
+      }
+    }
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "static inline void rem%d(void)\n{\n", i);
+    for (k = 0; k < numNbrs; k++) {
+      int n = nbrs[k];
+      if (!blocked[n]) {
+        fprintf(out, "  riverNbrs[%d]--;\n  if (!river[%d]) total += "
+                     "v%d[riverNbrs[%d]] - v%d[riverNbrs[%d] + 1];\n",
+                n, n, n, n, n, n);
+      }
+    }
+    fprintf(out, "  river[%d] = 0;\n  total += v%d[riverNbrs[%d]];\n}\n\n",
+            i, i, i);
+  }
+
+  for (i = 0; i < numCells; i++) {
+    if (blocked[i]) {
+      continue;
+    }
+    int numNbrs = get_neighbours(i, nbrs);
+
+    fprintf(out, "static void ext%d(void)\n{\n"
+                 "  if (total > best) {\n    best = total;\n"
+                 "    memcpy(bestRiver, river, NUM_CELLS);\n  }\n", i);
+    for (k = 0; k < numNbrs; k++) {
+      int n = nbrs[k];
+      if (!blocked[n] && inducedRivers) {
+        fprintf(out, "  if (!river[%d] && riverNbrs[%d] == 1) {\n"
+                     "    add%d();\n    ext%d();\n    rem%d();\n  }\n",
+                n, n, n, n, n);
+      } else if (!blocked[n]) {
+        fprintf(out, "  if (!river[%d]) {\n    add%d();\n    ext%d();\n"
+                     "    rem%d();\n  }\n", n, n, n, n);
+      }
+    }
+    fprintf(out, "}\n\n");
+  }
+
+  fprintf(out, "int lho_solve(int *types)\n{\n"
+               "  memset(riverNbrs, 0, sizeof(riverNbrs));\n"
+               "  memset(river, 0, sizeof(river));\n"
+               "  memset(bestRiver, 0, sizeof(bestRiver));\n"
+               "  total = 0");
+  for (i = 0; i < numCells; i++) {
+    if (!blocked[i]) {
+      fprintf(out, " + v%d[0]", i);
+    }
+  }
+  fprintf(out, ";\n  best = total;\n\n");
+  for (i = 0; i < numCells; i++) {
+    if (!blocked[i] && river_start(i)) {
+      fprintf(out, "  add%d();\n  ext%d();\n  rem%d();\n", i, i, i);
+    }
+  }
+  fprintf(out, "\n  for (int i = 0; i < NUM_CELLS; i++) {\n"
+               "    if (types[i] != %d) {\n"
+               "      types[i] = bestRiver[i] ? %d : %d;\n    }\n  }\n\n"
+               "  return best;\n}\n",
+          LHO_BLOCKED, LHO_RIVER, LHO_LANDSCAPE);
+}
+
+extern char **environ;
+
+// Compiles srcPath into the shared object libPath with cc. The compiler is
+// run directly rather than through the shell, so nothing in $TMPDIR or $CC
+// is taken for shell syntax. Returns whether it succeeded.
+static bool compiled_build(const char *cc, const char *srcPath,
+                           const char *libPath)
+{
+  char *argv[] = {(char *)cc, "-O2", "-shared", "-fPIC", "-o",
+                  (char *)libPath, (char *)srcPath, NULL};
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+  int status = -1;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+  if (posix_spawnp(&pid, cc, &actions, NULL, argv, environ) == 0 &&
+      waitpid(pid, &status, 0) != pid) {
+    status = -1;
+  }
+  posix_spawn_file_actions_destroy(&actions);
+
+  return status == 0;
+}
+
+// Fills grid with an optimal layout using a solver compiled for this exact
+// grid. Returns the value of the layout, or -1 if the solver couldn't be
+// built or loaded (the caller should fall back to river_solve).
+int compiled_solve(struct Grid *grid)
+{
+  const char *tmpDir = getenv("TMPDIR");
+  const char *cc = getenv("CC");
+  char dir[512], srcPath[544], libPath[544];
+  int numCells = numRows * numCols;
+  int i, val = -1;
+  void *lib = NULL;
+
+  if (tmpDir == NULL) {
+    tmpDir = "/tmp";
+  }
+  if (cc == NULL) {
+    cc = "cc";
+  }
+
+  // the source and the library go in a directory only we can write to, so
+  // nobody else can plant or swap either between compiling and loading
+  snprintf(dir, sizeof(dir), "%s/lho_XXXXXX", tmpDir);
+  if (mkdtemp(dir) == NULL) {
+    return -1;
+  }
+  snprintf(srcPath, sizeof(srcPath), "%s/solver.c", dir);
+  snprintf(libPath, sizeof(libPath), "%s/solver.so", dir);
+
+  FILE *src = fopen(srcPath, "wx");
+  if (src != NULL) {
+    emit_solver(src, grid);
+    if (fclose(src) == 0 && compiled_build(cc, srcPath, libPath)) {
+      lib = dlopen(libPath, RTLD_NOW | RTLD_LOCAL);
+    }
+  }
+  unlink(srcPath);
+  unlink(libPath);
+  rmdir(dir);
+  if (lib == NULL) {
+    return -1;
+  }
+
+  int (*solve)(int *) = (int (*)(int *))dlsym(lib, "lho_solve");
+  if (solve != NULL) {
+    int types[MAX_ROWS * MAX_COLS];
+    for (i = 0; i < numCells; i++) {
+      types[i] = grid->grid[get_row_idx(i)][get_col_idx(i)].type;
+    }
+    val = solve(types);
+    for (i = 0; i < numCells; i++) {
+      grid->grid[get_row_idx(i)][get_col_idx(i)].type = types[i];
+    }
+    recount_grid(grid);
+  }
+  dlclose(lib);
+
+  return val;
+}
+
+
+/*
+  Parallel tempering
+
+  --engine=temper is a heuristic for grids too big for the exact engines. It
+  keeps a ladder of chains over river layouts (everything off the river
+  being landscape), from a cold rung that only rarely takes a worse layout
+  to a hot one that wanders freely, with one thread per core sharing out the
+  rungs. A move grows the river by a tile at either end, takes one off
+  either end or slides the river along (off one end, on at the other). What
+  it does to the value is worked out from the per-tile values (tileVals) of
+  the tiles it touches and their neighbours, so a move costs the same on any
+  size of grid. A worse layout is taken with probability exp(change / T).
+
+  After each round of TEMPER_ROUND_MOVES moves per tile on every chain,
+  neighbouring rungs offer to swap layouts and accept with probability
+  exp((1/Tcold - 1/Thot) * (Vhot - Vcold)), so a layout can climb the ladder
+  to get out of a river shape that is only locally good and come back down
+  to be polished. Over the first half of the run the gaps between the
+  temperatures are widened or narrowed towards TEMPER_TARGET_SWAP
+  acceptance for every pair. The best layout any chain has seen is collected
+  after every round and reported as an incumbent, so cancelling (or
+  --time-limit) still gives the best so far.
+
+  Chains start from layouts drawn by the sampler (see Random layouts) when
+  the grid is small enough for it to count them quickly, and from random
+  walks otherwise. The run lasts --temper-rounds rounds, and --temper-stats
+  prints the ladder, the acceptance of moves and swaps on every rung and
+  when and where the best layout turned up.
+*/
+
+#define TEMPER_MIN_RUNGS 8
+#define TEMPER_MAX_RUNGS 64
+#define TEMPER_ROUND_MOVES 10 // per tile and chain
+#define TEMPER_TARGET_SWAP 0.3
+#define TEMPER_ADAPT_EVERY 20 // rounds between changes to the ladder
+#define TEMPER_SAMPLE_CELLS 64 // largest grid to start from sampled layouts
+
+static int temperRounds = 2000; // set by --temper-rounds
+
+struct TemperChain {
+  bool river[MAX_ROWS * MAX_COLS];
+  unsigned char nbrRivers[MAX_ROWS * MAX_COLS];
+  int path[MAX_ROWS * MAX_COLS]; // circular, from path[first] for len tiles
+  int first, len;
+  int value;
+  int best; // best value the chain has had, and its river
+  int bestPath[MAX_ROWS * MAX_COLS];
+  int bestLen;
+  uint64_t rng;
+  long long moves, accepted; // since the last round
+};
+
+struct TemperJob {
+  int rows, cols, land; // for load_instance on the helper threads
+  int numCells, numRungs, numThreads;
+  bool induced;
+  bool open[MAX_ROWS * MAX_COLS], start[MAX_ROWS * MAX_COLS];
+  int numNbrs[MAX_ROWS * MAX_COLS];
+  int nbr[MAX_ROWS * MAX_COLS][MAX_NEIGHBOURS]; // unblocked neighbours
+  int landVal[MAX_ROWS * MAX_COLS][MAX_NEIGHBOURS + 1]; // by river neighbours
+  int starts[MAX_ROWS * MAX_COLS], numStarts;
+
+  double temp[TEMPER_MAX_RUNGS]; // coldest first
+  double tempMin, tempMax;
+  struct TemperChain *chain[TEMPER_MAX_RUNGS]; // by rung
+  long long swapTries[TEMPER_MAX_RUNGS], swapAccepts[TEMPER_MAX_RUNGS];
+  long long windowTries[TEMPER_MAX_RUNGS], windowAccepts[TEMPER_MAX_RUNGS];
+  long long moves[TEMPER_MAX_RUNGS], accepted[TEMPER_MAX_RUNGS];
+  int adaptations;
+  uint64_t rng; // for the swaps
+
+  int round;
+  bool stop;
+  int best, bestRound, bestRung;
+  bool bestRiver[MAX_ROWS * MAX_COLS];
+  pthread_barrier_t barrier;
+};
+
+struct TemperWorker {
+  struct TemperJob *job;
+  int t;
+};
+
+// Totals over every tempering solve, for --temper-stats
+static struct {
+  int solves;
+  int numRungs;
+  double temp[TEMPER_MAX_RUNGS]; // the last ladder
+  long long swapTries[TEMPER_MAX_RUNGS], swapAccepts[TEMPER_MAX_RUNGS];
+  long long moves[TEMPER_MAX_RUNGS], accepted[TEMPER_MAX_RUNGS];
+  int adaptations;
+  int best, bestRound, bestRung, rounds; // of the last solve
+} temperStats;
+static pthread_mutex_t temperStatsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Makes c river (on) or landscape, returning the change in value
+static int temper_toggle(const struct TemperJob *job, struct TemperChain *ch,
+                         int c, bool on)
+{
+  int k, delta = job->landVal[c][ch->nbrRivers[c]];
+
+  if (on) {
+    delta = -delta;
+  }
+  ch->river[c] = on;
+  for (k = 0; k < job->numNbrs[c]; k++) {
+    int n = job->nbr[c][k];
+    int r = ch->nbrRivers[n];
+    ch->nbrRivers[n] = on ? r + 1 : r - 1;
+    if (!ch->river[n]) {
+      delta += job->landVal[n][ch->nbrRivers[n]] - job->landVal[n][r];
+    }
+  }
+  ch->value += delta;
+
+  return delta;
+}
+
+// the tile at one end of the river (side 0 is path[first])
+static inline int temper_end(const struct TemperJob *job,
+                             const struct TemperChain *ch, int side)
+{
+  return side == 0 ? ch->path[ch->first] :
+         ch->path[(ch->first + ch->len - 1) % job->numCells];
+}
+
+static void temper_push(const struct TemperJob *job, struct TemperChain *ch,
+                        int side, int c)
+{
+  if (side == 0) {
+    ch->first = (ch->first + job->numCells - 1) % job->numCells;
+    ch->path[ch->first] = c;
+  } else {
+    ch->path[(ch->first + ch->len) % job->numCells] = c;
+  }
+  ch->len++;
+}
+
+static int temper_pop(const struct TemperJob *job, struct TemperChain *ch,
+                      int side)
+{
+  int c = temper_end(job, ch, side);
+
+  if (side == 0) {
+    ch->first = (ch->first + 1) % job->numCells;
+  }
+  ch->len--;
+
+  return c;
+}
+
+// whether c can join the river beside the end it neighbours
+static inline bool temper_can_grow(const struct TemperJob *job,
+                                   const struct TemperChain *ch, int c)
+{
+  return job->open[c] && !ch->river[c] &&
+         (!job->induced || ch->nbrRivers[c] == 1);
+}
+
+// no river, or one with an end a river may start on
+static inline bool temper_valid(const struct TemperJob *job,
+                                const struct TemperChain *ch)
+{
+  return ch->len == 0 || job->start[temper_end(job, ch, 0)] ||
+         job->start[temper_end(job, ch, 1)];
+}
+
+// Makes the river tiles (in order along it) the chain's layout
+static void temper_set(const struct TemperJob *job, struct TemperChain *ch,
+                       const int *tiles, int len)
+{
+  int i;
+
+  memset(ch->river, 0, sizeof(ch->river));
+  memset(ch->nbrRivers, 0, sizeof(ch->nbrRivers));
+  ch->value = 0;
+  for (i = 0; i < job->numCells; i++) {
+    if (job->open[i]) {
+      ch->value += job->landVal[i][0];
+    }
+  }
+  ch->first = 0;
+  ch->len = 0;
+  for (i = 0; i < len; i++) {
+    temper_toggle(job, ch, tiles[i], true);
+    temper_push(job, ch, 1, tiles[i]);
+  }
+  ch->best = ch->value;
+  memcpy(ch->bestPath, tiles, len * sizeof(int));
+  ch->bestLen = len;
+}
+
+// A neighbour of the river's end on side for it to grow into, chosen by pick:
+// any of them alike, or with priors in proportion to how often optimal
+// rivers took that step (plus one, so none is ruled out)
+static int temper_pick(const struct TemperJob *job,
+                       const struct TemperChain *ch, int side, uint32_t pick)
+{
+  int e = temper_end(job, ch, side), k;
+
+  if (priorCounts == NULL || ch->len < 2) {
+    return job->nbr[e][pick % job->numNbrs[e]];
+  }
+
+  int a = ch->path[(ch->first + (side == 0 ? 1 : ch->len - 2)) %
+                   job->numCells];
+  int z = ch->len < 3 ? -1 :
+          ch->path[(ch->first + (side == 0 ? 2 : ch->len - 3)) %
+                   job->numCells];
+  unsigned weight[MAX_NEIGHBOURS], total = 0;
+  for (k = 0; k < job->numNbrs[e]; k++) {
+    weight[k] = prior_weight(z, a, e, job->nbr[e][k]) + 1;
+    total += weight[k];
+  }
+  unsigned r = pick % total;
+  for (k = 0; r >= weight[k]; k++) {
+    r -= weight[k];
+  }
+  return job->nbr[e][k];
+}
+
+// One Metropolis step at temperature temp
+static void temper_move(const struct TemperJob *job, struct TemperChain *ch,
+                        double temp)
+{
+  uint64_t r = random_next(&ch->rng);
+  int kind = r % 3, side = (r >> 8) & 1;
+  uint32_t pick = r >> 32;
+  int c, e, removed = -1, delta;
+
+  ch->moves++;
+  if (ch->len == 0) {
+    if (job->numStarts == 0) {
+      return;
+    }
+    kind = 0; // all there is to do is start one
+    c = job->starts[pick % job->numStarts];
+    delta = temper_toggle(job, ch, c, true);
+    temper_push(job, ch, side, c);
+  } else if (kind == 0 || (kind == 2 && ch->len < 2)) {
+    kind = 0; // grow
+    e = temper_end(job, ch, side);
+    if (job->numNbrs[e] == 0) {
+      return;
+    }
+    c = temper_pick(job, ch, side, pick);
+    if (!temper_can_grow(job, ch, c)) {
+      return;
+    }
+    delta = temper_toggle(job, ch, c, true);
+    temper_push(job, ch, side, c);
+  } else if (kind == 1) { // shrink
+    c = temper_pop(job, ch, side);
+    delta = temper_toggle(job, ch, c, false);
+  } else { // slide: off the other end, on at this one
+    removed = temper_pop(job, ch, !side);
+    delta = temper_toggle(job, ch, removed, false);
+    c = temper_pick(job, ch, side, pick);
+    if (!temper_can_grow(job, ch, c)) {
+      temper_toggle(job, ch, removed, true);
+      temper_push(job, ch, !side, removed);
+      return;
+    }
+    delta += temper_toggle(job, ch, c, true);
+    temper_push(job, ch, side, c);
+  }
+
+  if (temper_valid(job, ch) &&
+      (delta >= 0 || random_unit(&ch->rng) < exp(delta / temp))) {
+    ch->accepted++;
+    if (ch->value > ch->best) {
+      int i;
+      ch->best = ch->value;
+      ch->bestLen = ch->len;
+      for (i = 0; i < ch->len; i++) {
+        ch->bestPath[i] = ch->path[(ch->first + i) % job->numCells];
+      }
+    }
+    return;
+  }
+
+  // undo
+  if (kind == 1) {
+    temper_toggle(job, ch, c, true);
+    temper_push(job, ch, side, c);
+    return;
+  }
+  temper_pop(job, ch, side);
+  temper_toggle(job, ch, c, false);
+  if (removed >= 0) {
+    temper_toggle(job, ch, removed, true);
+    temper_push(job, ch, !side, removed);
+  }
+}
+
+// Sets the temperatures from the ratios between neighbouring rungs (as
+// logarithms), scaled so the ladder still runs from tempMin to tempMax
+static void temper_ladder(struct TemperJob *job, const double *gap)
+{
+  double total = 0;
+  int k;
+
+  for (k = 0; k < job->numRungs - 1; k++) {
+    total += gap[k];
+  }
+  job->temp[0] = job->tempMin;
+  for (k = 1; k < job->numRungs; k++) {
+    job->temp[k] = job->temp[k - 1] *
+                   exp(gap[k - 1] / total * log(job->tempMax / job->tempMin));
+  }
+}
+
+// Between rounds, on thread 0: tallies the moves, offers swaps, adjusts the
+// ladder, collects the best layout and decides whether to stop
+static void temper_exchange(struct TemperJob *job)
+{
+  int k, i;
+
+  for (k = 0; k < job->numRungs; k++) {
+    struct TemperChain *ch = job->chain[k];
+    job->moves[k] += ch->moves;
+    job->accepted[k] += ch->accepted;
+    ch->moves = 0;
+    ch->accepted = 0;
+    if (ch->best > job->best) {
+      job->best = ch->best;
+      job->bestRound = job->round;
+      job->bestRung = k;
+      memset(job->bestRiver, 0, sizeof(job->bestRiver));
+      for (i = 0; i < ch->bestLen; i++) {
+        job->bestRiver[ch->bestPath[i]] = true;
+      }
+      report_incumbent(job->best);
+    }
+  }
+
+  // even pairs one round, odd pairs the next
+  for (k = job->round % 2; k + 1 < job->numRungs; k += 2) {
+    struct TemperChain *cold = job->chain[k], *hot = job->chain[k + 1];
+    double p = exp((1 / job->temp[k] - 1 / job->temp[k + 1]) *
+                   (hot->value - cold->value));
+    job->swapTries[k]++;
+    job->windowTries[k]++;
+    if (p >= 1 || random_unit(&job->rng) < p) {
+      job->chain[k] = hot;
+      job->chain[k + 1] = cold;
+      job->swapAccepts[k]++;
+      job->windowAccepts[k]++;
+    }
+  }
+
+  job->round++;
+  if (job->round % TEMPER_ADAPT_EVERY == 0 && 2 * job->round <= temperRounds) {
+    double gap[TEMPER_MAX_RUNGS];
+    for (k = 0; k + 1 < job->numRungs; k++) {
+      double rate = job->windowTries[k] ?
+                    (double)job->windowAccepts[k] / job->windowTries[k] :
+                    TEMPER_TARGET_SWAP;
+      double scale = exp(2 * (rate - TEMPER_TARGET_SWAP));
+      gap[k] = log(job->temp[k + 1] / job->temp[k]) *
+               (scale < 0.5 ? 0.5 : scale > 2 ? 2 : scale);
+      job->windowTries[k] = 0;
+      job->windowAccepts[k] = 0;
+    }
+    temper_ladder(job, gap);
+    job->adaptations++;
+  }
+
+  job->stop = job->round >= temperRounds || solve_cancelled();
+}
+
+static void *temper_worker(void *arg)
+{
+  struct TemperWorker *worker = arg;
+  struct TemperJob *job = worker->job;
+  int k, m, movesPerRound = TEMPER_ROUND_MOVES * job->numCells;
+
+  if (worker->t > 0) {
+    load_instance(job->rows, job->cols, job->land);
+  }
+
+  for (;;) {
+    for (k = worker->t; k < job->numRungs; k += job->numThreads) {
+      for (m = 0; m < movesPerRound; m++) {
+        temper_move(job, job->chain[k], job->temp[k]);
+      }
+    }
+    pthread_barrier_wait(&job->barrier);
+    if (worker->t == 0) {
+      temper_exchange(job);
+    }
+    pthread_barrier_wait(&job->barrier);
+    if (job->stop) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+// Puts a starting layout in ch: one drawn by the sampler if it is set up,
+// otherwise a random walk from a random start tile
+static void temper_start(const struct TemperJob *job, struct TemperChain *ch,
+                         struct Grid *scratch)
+{
+  int tiles[MAX_ROWS * MAX_COLS];
+  int len = 0, i, k, c;
+
+  if (sampler != NULL) {
+    sample_layout(scratch, &ch->rng);
+    // sampled rivers never touch themselves, so follow it from a start end
+    for (i = 0; i < job->numCells && len == 0; i++) {
+      bool river = scratch->grid[get_row_idx(i)][get_col_idx(i)].type ==
+                   LHO_RIVER;
+      if (river && job->start[i] &&
+          scratch->grid[get_row_idx(i)][get_col_idx(i)].numAdjRivers <= 1) {
+        tiles[len++] = i;
+      }
+    }
+    while (len > 0) {
+      int c = tiles[len - 1], next = -1;
+      for (k = 0; k < job->numNbrs[c]; k++) {
+        int n = job->nbr[c][k];
+        if (scratch->grid[get_row_idx(n)][get_col_idx(n)].type == LHO_RIVER &&
+            (len < 2 || n != tiles[len - 2])) {
+          next = n;
+        }
+      }
+      if (next < 0) {
+        break;
+      }
+      tiles[len++] = next;
+    }
+    temper_set(job, ch, tiles, len);
+    return;
+  }
+
+  temper_set(job, ch, tiles, 0);
+  if (job->numStarts == 0) {
+    return;
+  }
+  int target = random_next(&ch->rng) % (job->numCells / 2 + 1);
+  c = job->starts[random_next(&ch->rng) % job->numStarts];
+  temper_toggle(job, ch, c, true);
+  temper_push(job, ch, 1, c);
+  while (ch->len < target) {
+    int e = temper_end(job, ch, 1), options[MAX_NEIGHBOURS], numOptions = 0;
+    for (k = 0; k < job->numNbrs[e]; k++) {
+      if (temper_can_grow(job, ch, job->nbr[e][k])) {
+        options[numOptions++] = job->nbr[e][k];
+      }
+    }
+    if (numOptions == 0) {
+      break;
+    }
+    c = options[random_next(&ch->rng) % numOptions];
+    temper_toggle(job, ch, c, true);
+    temper_push(job, ch, 1, c);
+  }
+  ch->best = ch->value;
+  ch->bestLen = ch->len;
+  for (i = 0; i < ch->len; i++) {
+    ch->bestPath[i] = ch->path[i];
+  }
+}
+
+// Fills in the tiles of job (neighbours, starts and values) for grid
+static void temper_job_init(struct TemperJob *job, const struct Grid *grid)
+{
+  int numCells = numRows * numCols;
+  int nbrs[MAX_NEIGHBOURS];
+  int c, k, r;
+
+  job->rows = numRows;
+  job->cols = numCols;
+  job->land = landChoice;
+  job->numCells = numCells;
+  job->induced = inducedRivers;
+  for (c = 0; c < numCells; c++) {
+    job->open[c] =
+      grid->grid[get_row_idx(c)][get_col_idx(c)].type != LHO_BLOCKED;
+    job->start[c] = job->open[c] && river_start(c);
+    if (job->start[c]) {
+      job->starts[job->numStarts++] = c;
+    }
+  }
+  for (c = 0; c < numCells; c++) {
+    int numNbrs = get_neighbours(c, nbrs);
+    for (k = 0; k < numNbrs; k++) {
+      if (job->open[nbrs[k]]) {
+        job->nbr[c][job->numNbrs[c]++] = nbrs[k];
+      }
+    }
+    for (r = 0; r <= job->numNbrs[c]; r++) {
+      job->landVal[c][r] = job->open[c] ?
+                           tileVals[r][job->numNbrs[c] - r] : 0;
+    }
+  }
+}
+
+// Looks for a good layout of grid by parallel tempering. Returns its value,
+// or -1 if there's no memory for the chains.
+int temper_solve(struct Grid *grid)
+{
+  int numCells = numRows * numCols;
+  int c, k, t;
+
+  struct TemperJob *job = mem_try_calloc(LHO_MEM_SEARCH,
+                                         sizeof(struct TemperJob));
+  if (job == NULL) {
+    return -1;
+  }
+  temper_job_init(job, grid);
+
+  long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (numThreads < 1) {
+    numThreads = 1;
+  }
+  job->numRungs = numThreads < TEMPER_MIN_RUNGS ? TEMPER_MIN_RUNGS :
+                  numThreads > TEMPER_MAX_RUNGS ? TEMPER_MAX_RUNGS :
+                  numThreads;
+  job->numThreads = numThreads < job->numRungs ? numThreads : job->numRungs;
+
+  // cold enough that losing a tile's worth is rare, hot enough that it isn't
+  double gap[TEMPER_MAX_RUNGS];
+  job->tempMin = 0.05 * maxTileVal;
+  job->tempMax = 2.0 * maxTileVal;
+  for (k = 0; k + 1 < job->numRungs; k++) {
+    gap[k] = 1;
+  }
+  temper_ladder(job, gap);
+
+  bool ok = true;
+  for (k = 0; k < job->numRungs; k++) {
+    job->chain[k] = mem_try_alloc(LHO_MEM_SEARCH, sizeof(struct TemperChain));
+    ok = ok && job->chain[k] != NULL;
+  }
+  if (!ok) {
+    for (k = 0; k < job->numRungs; k++) {
+      mem_free(job->chain[k]);
+    }
+    mem_free(job);
+    return -1;
+  }
+
+  // seeds fixed by the grid, so runs can be repeated
+  job->rng = 0x5eed + numCells;
+  struct Grid scratch;
+  allocate_grid(&scratch);
+  copy_grid(&scratch, grid);
+  if (numCells <= TEMPER_SAMPLE_CELLS && sampler_setup(grid, -1, false) <= 0) {
+    sampler_free();
+  }
+  for (k = 0; k < job->numRungs; k++) {
+    job->chain[k]->rng = random_next(&job->rng);
+    temper_start(job, job->chain[k], &scratch);
+  }
+  sampler_free();
+  free_grid(&scratch);
+
+  job->best = -1;
+  pthread_barrier_init(&job->barrier, NULL, job->numThreads);
+  struct TemperWorker workers[TEMPER_MAX_RUNGS];
+  pthread_t threads[TEMPER_MAX_RUNGS];
+  for (t = 0; t < job->numThreads; t++) {
+    workers[t].job = job;
+    workers[t].t = t;
+    if (t > 0) {
+      pthread_create(&threads[t], NULL, temper_worker, &workers[t]);
+    }
+  }
+  temper_worker(&workers[0]);
+  for (t = 1; t < job->numThreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  pthread_barrier_destroy(&job->barrier);
+
+  for (c = 0; c < numCells; c++) {
+    struct Tile *tile = &grid->grid[get_row_idx(c)][get_col_idx(c)];
+    if (tile->type != LHO_BLOCKED) {
+      tile->type = job->bestRiver[c] ? LHO_RIVER : LHO_LANDSCAPE;
+    }
+  }
+  recount_grid(grid);
+
+  pthread_mutex_lock(&temperStatsLock);
+  temperStats.solves++;
+  temperStats.numRungs = job->numRungs;
+  for (k = 0; k < job->numRungs; k++) {
+    temperStats.temp[k] = job->temp[k];
+    temperStats.swapTries[k] += job->swapTries[k];
+    temperStats.swapAccepts[k] += job->swapAccepts[k];
+    temperStats.moves[k] += job->moves[k];
+    temperStats.accepted[k] += job->accepted[k];
+  }
+  temperStats.adaptations += job->adaptations;
+  temperStats.best = job->best;
+  temperStats.bestRound = job->bestRound;
+  temperStats.bestRung = job->bestRung;
+  temperStats.rounds = job->round;
+  pthread_mutex_unlock(&temperStatsLock);
+
+  int best = job->best;
+  for (k = 0; k < job->numRungs; k++) {
+    mem_free(job->chain[k]);
+  }
+  mem_free(job);
+
+  return best;
+}
+
+// Prints the ladder and acceptance rates of every tempering solve so far
+void temper_report(void)
+{
+  int k;
+
+  pthread_mutex_lock(&temperStatsLock);
+  if (temperStats.solves == 0) {
+    pthread_mutex_unlock(&temperStatsLock);
+    return;
+  }
+  printf("\n Parallel tempering (%d solves, %d ladder adjustments):\n\n",
+         temperStats.solves, temperStats.adaptations);
+  printf("  %4s %11s %14s %10s %14s\n", "rung", "temperature", "moves",
+         "accepted", "swaps up");
+  for (k = 0; k < temperStats.numRungs; k++) {
+    printf("  %4d %11.3f %14lld %9.2f%%", k, temperStats.temp[k],
+           temperStats.moves[k], temperStats.moves[k] ?
+           100.0 * temperStats.accepted[k] / temperStats.moves[k] : 0.0);
+    if (k + 1 < temperStats.numRungs) {
+      printf(" %13.2f%%", temperStats.swapTries[k] ?
+             100.0 * temperStats.swapAccepts[k] / temperStats.swapTries[k] :
+             0.0);
+    }
+    printf("\n");
+  }
+  printf("\n Last solve: best %d found in round %d of %d on rung %d\n",
+         temperStats.best, temperStats.bestRound, temperStats.rounds,
+         temperStats.bestRung);
+  pthread_mutex_unlock(&temperStatsLock);
+}
+
+
+/*
+  Multilevel search
+
+  --engine=multilevel is for the biggest grids, up to MAX_ROWS x MAX_COLS.
+  It coarsens the grid by merging each 2x2 block of tiles into one tile,
+  again and again until the grid has at most MULTI_EXACT_CELLS tiles. That
+  grid is solved exactly by the river search, with the coarse tiles scored
+  by the usual rules for a grid of their size. Each level then takes the
+  river of the level below it back up to full size. The river passes
+  through the same blocks in the same order, using one or two tiles of each
+  and starting on a tile of the first block that a river may start on.
+
+  The projected river is then refined a window of MULTI_WINDOW x
+  MULTI_WINDOW tiles at a time. The windows overlap by half and sweep the
+  grid up to MULTI_PASSES times. Inside each window, every stretch of river
+  is taken out. Then every other route between the same two tiles outside
+  it is tried, or every route from the one tile if the stretch was an end
+  of the river. The best route is kept if it beats the old one. The change
+  in value comes from the per-tile values, as in the tempering engine, so
+  each pass is exact within its window and costs little however big the
+  grid is.
+
+  Grids with blocked tiles or their own river starts (map mode) aren't
+  coarsened, and are handed to --engine=temper instead.
+*/
+
+#define MULTI_EXACT_CELLS 25 // solved exactly at the bottom level
+#define MULTI_WINDOW 5
+#define MULTI_PASSES 8
+
+// Refinement of the river inside one window
+struct MultiWindow {
+  const struct TemperJob *job;
+  struct TemperChain *ch;
+  int r0, r1, c0, c1; // rows r0 to r1 - 1 and columns c0 to c1 - 1
+  int target; // tile the new route has to end beside, or -1 for a free end
+  int other; // the river's far end, which may be the one it starts on
+  int route[MULTI_WINDOW * MULTI_WINDOW], len;
+  int best[MULTI_WINDOW * MULTI_WINDOW], bestLen, bestValue;
+};
+
+static inline bool multi_inside(const struct MultiWindow *m, int c)
+{
+  int row = get_row_idx(c), col = get_col_idx(c);
+
+  return row >= m->r0 && row < m->r1 && col >= m->c0 && col < m->c1;
+}
+
+// Records the route so far if it makes a river and beats the best one
+static void multi_record(struct MultiWindow *m, bool complete)
+{
+  if (complete && m->ch->value > m->bestValue) {
+    m->bestValue = m->ch->value;
+    m->bestLen = m->len;
+    memcpy(m->best, m->route, m->len * sizeof(int));
+  }
+}
+
+// Tries every way on through the window from cur, the end of the route
+static void multi_route(struct MultiWindow *m, int cur)
+{
+  const struct TemperJob *job = m->job;
+  struct TemperChain *ch = m->ch;
+  int j, k;
+
+  for (k = 0; k < job->numNbrs[cur]; k++) {
+    int n = job->nbr[cur][k];
+    bool arrives = false;
+
+    if (ch->river[n] || !multi_inside(m, n)) {
+      continue;
+    }
+    for (j = 0; m->target >= 0 && j < job->numNbrs[n]; j++) {
+      arrives = arrives || job->nbr[n][j] == m->target;
+    }
+    if (job->induced && ch->nbrRivers[n] != 1 + arrives) {
+      continue;
+    }
+
+    temper_toggle(job, ch, n, true);
+    m->route[m->len++] = n;
+    multi_record(m, m->target >= 0 ? arrives :
+                    job->start[n] || job->start[m->other]);
+    // an induced river can't go on past the tile it arrives on
+    if (!(arrives && job->induced)) {
+      multi_route(m, n);
+    }
+    m->len--;
+    temper_toggle(job, ch, n, false);
+  }
+}
+
+// Reroutes the first stretch of river inside the window that can be bettered.
+// Returns whether there was one.
+static bool multi_window(const struct TemperJob *job, struct TemperChain *ch,
+                         int r0, int r1, int c0, int c1)
+{
+  struct MultiWindow m = {.job = job, .ch = ch, .r0 = r0, .r1 = r1,
+                          .c0 = c0, .c1 = c1, .target = -1, .other = -1};
+  int tiles[MAX_ROWS * MAX_COLS];
+  int *path = ch->path; // refinement keeps first at 0
+  int len = ch->len, s, e, i, n;
+
+  for (s = 0; s < len; s = e + 1) {
+    e = s;
+    if (!multi_inside(&m, path[s])) {
+      continue;
+    }
+    while (e + 1 < len && multi_inside(&m, path[e + 1])) {
+      e++;
+    }
+    if (s == 0 && e == len - 1) {
+      continue;
+    }
+
+    // a stretch at the start is rerouted backwards from the tile after it
+    bool reversed = (s == 0);
+    int anchor = reversed ? path[e + 1] : path[s - 1];
+    m.target = (s > 0 && e < len - 1) ? path[e + 1] : -1;
+    m.other = reversed ? path[len - 1] : path[0];
+    m.bestValue = ch->value;
+    m.bestLen = -1;
+    m.len = 0;
+
+    for (i = s; i <= e; i++) {
+      temper_toggle(job, ch, path[i], false);
+    }
+    bool touches = false;
+    for (i = 0; m.target >= 0 && i < job->numNbrs[anchor]; i++) {
+      touches = touches || job->nbr[anchor][i] == m.target;
+    }
+    multi_record(&m, m.target >= 0 ? touches :
+                     job->start[anchor] || job->start[m.other]);
+    multi_route(&m, anchor);
+
+    if (m.bestLen >= 0) {
+      n = 0;
+      if (reversed) {
+        for (i = m.bestLen - 1; i >= 0; i--) {
+          tiles[n++] = m.best[i];
+        }
+      } else {
+        for (i = 0; i < s; i++) {
+          tiles[n++] = path[i];
+        }
+        for (i = 0; i < m.bestLen; i++) {
+          tiles[n++] = m.best[i];
+        }
+      }
+      for (i = e + 1; i < len; i++) {
+        tiles[n++] = path[i];
+      }
+      temper_set(job, ch, tiles, n);
+      return true;
+    }
+    for (i = s; i <= e; i++) {
+      temper_toggle(job, ch, path[i], true);
+    }
+  }
+
+  return false;
+}
+
+// Sweeps the windows over the grid until a pass gains nothing
+static void multi_refine(const struct TemperJob *job, struct TemperChain *ch,
+                         bool top)
+{
+  int pass, r0, c0;
+
+  for (pass = 0; pass < MULTI_PASSES && !solve_cancelled(); pass++) {
+    bool improved = false;
+    for (r0 = 0; ; r0 += MULTI_WINDOW / 2) {
+      if (r0 + MULTI_WINDOW > numRows) {
+        r0 = numRows > MULTI_WINDOW ? numRows - MULTI_WINDOW : 0;
+      }
+      for (c0 = 0; ; c0 += MULTI_WINDOW / 2) {
+        if (c0 + MULTI_WINDOW > numCols) {
+          c0 = numCols > MULTI_WINDOW ? numCols - MULTI_WINDOW : 0;
+        }
+        while (multi_window(job, ch, r0, r0 + MULTI_WINDOW, c0,
+                            c0 + MULTI_WINDOW)) {
+          improved = true;
+        }
+        if (c0 + MULTI_WINDOW >= numCols) {
+          break;
+        }
+      }
+      if (r0 + MULTI_WINDOW >= numRows) {
+        break;
+      }
+    }
+    if (top) {
+      report_incumbent(ch->value);
+    }
+    if (!improved) {
+      break;
+    }
+  }
+}
+
+// the block of coarseCols-wide coarse tiles that fine tile c is in
+static inline int multi_block(int c, int coarseCols)
+{
+  return get_row_idx(c) / 2 * coarseCols + get_col_idx(c) / 2;
+}
+
+static bool multi_beside(int c, int block, int coarseCols)
+{
+  int nbrs[MAX_NEIGHBOURS];
+  int numNbrs = get_neighbours(c, nbrs), k;
+
+  for (k = 0; k < numNbrs; k++) {
+    if (multi_block(nbrs[k], coarseCols) == block) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Lays the river through the coarse tiles coarse out on the full grid, into
+// fine. Returns its length.
+static int multi_project(const int *coarse, int coarseLen, int coarseCols,
+                         int *fine)
+{
+  int nbrs[MAX_NEIGHBOURS];
+  int len = 0, bestScore = -1, i, k, c;
+
+  if (coarseLen == 0) {
+    return 0;
+  }
+
+  // best a tile a river may start on that is next to the second block
+  for (c = 0; c < numRows * numCols; c++) {
+    if (multi_block(c, coarseCols) == coarse[0]) {
+      int score = river_start(c) * 2 +
+                  (coarseLen > 1 && multi_beside(c, coarse[1], coarseCols));
+      if (score > bestScore) {
+        bestScore = score;
+        fine[0] = c;
+      }
+    }
+  }
+  len = 1;
+
+  for (i = 1; i < coarseLen; i++) {
+    int cur = fine[len - 1], numNbrs = get_neighbours(cur, nbrs);
+    if (!multi_beside(cur, coarse[i], coarseCols)) {
+      for (k = 0; k < numNbrs; k++) {
+        if (multi_block(nbrs[k], coarseCols) == coarse[i - 1] &&
+            multi_beside(nbrs[k], coarse[i], coarseCols)) {
+          fine[len++] = cur = nbrs[k];
+          break;
+        }
+      }
+      numNbrs = get_neighbours(cur, nbrs);
+    }
+    for (k = 0; k < numNbrs; k++) {
+      if (multi_block(nbrs[k], coarseCols) == coarse[i]) {
+        fine[len++] = nbrs[k];
+        break;
+      }
+    }
+  }
+
+  return len;
+}
+
+// Finds a layout for grid a level at a time (see above) and puts its river
+// in path, from the end it starts on, and its length in pathLen. Returns its
+// value, or -1 if there's no memory for it.
+static int multi_level(struct Grid *grid, int *path, int *pathLen, bool top)
+{
+  int rows = numRows, cols = numCols, land = landChoice, c;
+
+  if (rows * cols <= MULTI_EXACT_CELLS) {
+    // only the full size layouts are worth reporting
+    void (*hook)(int value) = incumbentHook;
+    if (!top) {
+      incumbentHook = NULL;
+    }
+    int value = river_solve(grid);
+    incumbentHook = hook;
+    *pathLen = river_order(grid, path);
+    return value;
+  }
+
+  int coarseRows = (rows + 1) / 2, coarseCols = (cols + 1) / 2;
+  int coarsePath[MAX_ROWS * MAX_COLS], coarseLen;
+  struct Grid coarse;
+  load_instance(coarseRows, coarseCols, land);
+  allocate_grid(&coarse);
+  int value = multi_level(&coarse, coarsePath, &coarseLen, false);
+  free_grid(&coarse);
+  load_instance(rows, cols, land);
+  if (value < 0) {
+    return -1;
+  }
+
+  struct TemperJob *job = mem_try_calloc(LHO_MEM_SEARCH,
+                                         sizeof(struct TemperJob));
+  struct TemperChain *ch = mem_try_alloc(LHO_MEM_SEARCH,
+                                         sizeof(struct TemperChain));
+  if (job == NULL || ch == NULL) {
+    mem_free(job);
+    mem_free(ch);
+    return -1;
+  }
+  temper_job_init(job, grid);
+  *pathLen = multi_project(coarsePath, coarseLen, coarseCols, path);
+  temper_set(job, ch, path, *pathLen);
+  if (top) {
+    report_incumbent(ch->value);
+  }
+  multi_refine(job, ch, top);
+
+  *pathLen = ch->len;
+  memcpy(path, ch->path, ch->len * sizeof(int));
+  for (c = 0; c < rows * cols; c++) {
+    grid->grid[get_row_idx(c)][get_col_idx(c)].type =
+      ch->river[c] ? LHO_RIVER : LHO_LANDSCAPE;
+  }
+  recount_grid(grid);
+  value = ch->value;
+  mem_free(ch);
+  mem_free(job);
+
+  return value;
+}
+
+// Fills grid with a layout found by the multilevel search. Returns its
+// value, or -1 if the grid can't be coarsened or there's no memory.
+int multi_solve(struct Grid *grid)
+{
+  int path[MAX_ROWS * MAX_COLS], len, c;
+
+  if (riverStarts != NULL || riverFixed != NULL || !adjSquare) {
+    return -1;
+  }
+  for (c = 0; c < numRows * numCols; c++) {
+    if (grid->grid[get_row_idx(c)][get_col_idx(c)].type == LHO_BLOCKED) {
+      return -1;
+    }
+  }
+
+  return multi_level(grid, path, &len, true);
+}
+
+
+/*
+  Precomputed optimum table
+
+  The best layouts for small grids are solved ahead of time by --gen-table and
+  compiled in from optimum_table.h, so the common queries are answered
+  without any search. Layouts are packed 2 bits per tile by linear index,
+  holding the tile type + 1 (0 = empty, 1 = river, 2 = landscape,
+  3 = blocked).
+*/
+
+#define TABLE_MAX_SIZE 6 // largest rows/cols generated
+#define TABLE_LAYOUT_WORDS ((TABLE_MAX_SIZE * TABLE_MAX_SIZE + 15) / 16)
+
+struct OptimumEntry {
+  unsigned char rows;
+  unsigned char cols;
+  unsigned char land;
+  int value;
+  unsigned int layout[TABLE_LAYOUT_WORDS];
+};
+
+#include "optimum_table.h"
+
+// Fills grid from the compiled-in table if the current size and landscape is
+// in it. Returns the value of the layout, or -1 if it isn't in the table.
+// The table is only for open grids, so any blocked tiles or river_start
+// changes rule it out.
+int table_lookup(struct Grid *grid)
+{
+  size_t k;
+  int i;
+
+  if (riverStarts != NULL || riverFixed != NULL || !adjSquare) {
+    return -1;
+  }
+  for (i = 0; i < numRows * numCols; i++) {
+    if (grid->grid[get_row_idx(i)][get_col_idx(i)].type == LHO_BLOCKED) {
+      return -1;
+    }
+  }
+
+  for (k = 0; k < sizeof(optimumTable) / sizeof(optimumTable[0]); k++) {
+    const struct OptimumEntry *entry = &optimumTable[k];
+    if (entry->rows != numRows || entry->cols != numCols ||
+        entry->land != landChoice) {
+      continue;
+    }
+    for (i = 0; i < numRows * numCols; i++) {
+      int code = (entry->layout[i / 16] >> (2 * (i % 16))) & 3;
+      grid->grid[get_row_idx(i)][get_col_idx(i)].type = code - 1;
+    }
+    recount_grid(grid);
+    return entry->value;
+  }
+
+  return -1;
+}
+
+// Solves a rows x cols grid of the given landscape the way --gen-table does,
+// packing the layout into layout (zeroed first). Returns the value.
+static int table_solve(int rows, int cols, int land,
+                       unsigned int layout[TABLE_LAYOUT_WORDS])
+{
+  struct Grid grid;
+  int i;
+
+  load_instance(rows, cols, land);
+  allocate_grid(&grid);
+  int val = rds_solve(&grid);
+  memset(layout, 0, TABLE_LAYOUT_WORDS * sizeof(layout[0]));
+  for (i = 0; i < rows * cols; i++) {
+    unsigned int code = grid.grid[get_row_idx(i)][get_col_idx(i)].type + 1;
+    layout[i / 16] |= code << (2 * (i % 16));
+  }
+  free_grid(&grid);
+
+  return val;
+}
+
+// Solves every grid up to TABLE_MAX_SIZE x TABLE_MAX_SIZE for every landscape
+// and writes them out as the contents of optimum_table.h
+void gen_table(FILE *out)
+{
+  int rows, cols, land;
+
+  fprintf(out, "// Generated by LoopHeroOptimizer --gen-table, do not edit.\n");
+  fprintf(out, "// { rows, cols, landscape, value, { packed layout } }\n\n");
+  fprintf(out, "static const struct OptimumEntry optimumTable[] = {\n");
+
+  for (rows = 1; rows <= TABLE_MAX_SIZE; rows++) {
+    for (cols = 1; cols <= TABLE_MAX_SIZE; cols++) {
+      for (land = 0; land < 4; land++) {
+        unsigned int layout[TABLE_LAYOUT_WORDS];
+        size_t w;
+
+        fprintf(stderr, " solving %dx%d, landscape %d\n", rows, cols, land);
+        int val = table_solve(rows, cols, land, layout);
+
+        fprintf(out, "  { %d, %d, %d, %d, {", rows, cols, land, val);
+        for (w = 0; w < TABLE_LAYOUT_WORDS; w++) {
+          fprintf(out, "%s0x%08xu", w ? ", " : " ", layout[w]);
+        }
+        fprintf(out, " } },\n");
+      }
+    }
+  }
+
+  fprintf(out, "};\n");
+}
+
+// Regenerates every table entry of up to maxTiles tiles the way --gen-table
+// would and checks its value against the compiled-in table. Returns the
+// number of disagreements.
+int verify_table(int maxTiles)
+{
+  size_t k;
+  int wrong = 0;
+
+  for (k = 0; k < sizeof(optimumTable) / sizeof(optimumTable[0]); k++) {
+    const struct OptimumEntry *entry = &optimumTable[k];
+    unsigned int layout[TABLE_LAYOUT_WORDS];
+
+    if (entry->rows * entry->cols > maxTiles) {
+      continue;
+    }
+    int val = table_solve(entry->rows, entry->cols, entry->land, layout);
+    if (val != entry->value) {
+      printf("  %2dx%-2d landscape %d: table %d, generated %d\n",
+             entry->rows, entry->cols, entry->land, entry->value, val);
+      wrong++;
+    }
+  }
+
+  printf("\n %d disagreements with the table\n", wrong);
+  return wrong;
+}
+
+
+// Engines that can be picked with --engine=<name>
+enum Engine {LHO_ENGINE_DFS, LHO_ENGINE_RDS, LHO_ENGINE_RIVER,
+             LHO_ENGINE_COMPILED, LHO_ENGINE_LINES, LHO_ENGINE_FRONTIER,
+             LHO_ENGINE_BIDIR, LHO_ENGINE_BRUTE, LHO_ENGINE_TEMPER,
+             LHO_ENGINE_MULTILEVEL, LHO_NUM_ENGINES};
+
+static const char *const engineNames[LHO_NUM_ENGINES] = {
+  "dfs", "rds", "river", "compiled", "lines", "frontier", "bidir", "brute",
+  "temper", "multilevel"
+};
+
+// Most the recursion can allocate: three grids and two child arrays a level,
+// one level per tile
+static size_t dfs_memory(void)
+{
+  int numCells = numRows * numCols;
+  size_t grid = (numRows + 1) * sizeof(union MemHeader) +
+                numRows * sizeof(struct Tile *) +
+                numCells * sizeof(struct Tile);
+  size_t level = 3 * grid + 2 * (sizeof(union MemHeader) +
+                                 2 * numCells * sizeof(int));
+
+  return (size_t)(numCells + 1) * level;
+}
+
+// Does the work of solve_grid below
+static int solve_grid_with(struct Grid *grid, enum Engine engine,
+                           bool useTable, bool verbose)
+{
+  if (useTable && table_lookup(grid) >= 0) {
+    if (verbose) {
+      printf("\n found in precomputed table\n");
+    }
+    return val_calc(*grid);
+  }
+
+  if (engine == LHO_ENGINE_BRUTE) {
+    if (verbose) {
+      printf("\n trying every river...\n");
+    }
+    if (brute_solve(grid) >= 0) {
+      return val_calc(*grid);
+    }
+    if (verbose) {
+      printf(" can't try every river on this grid, using river search\n");
+    }
+    engine = LHO_ENGINE_RIVER;
+  }
+
+  if (riverFixed != NULL && engine != LHO_ENGINE_BIDIR) {
+    if (verbose) {
+      printf("\n only the bidirectional search keeps to fixed river tiles\n");
+    }
+    engine = LHO_ENGINE_BIDIR;
+  }
+
+  if (engine == LHO_ENGINE_BIDIR) {
+    if (verbose) {
+      printf("\n starting bidirectional river search...\n");
+    }
+    if (bidir_solve(grid) >= 0) {
+      return val_calc(*grid);
+    }
+    if (verbose) {
+      printf(" no river covers every fixed river tile, ignoring them\n");
+    }
+    riverFixed = NULL;
+    engine = LHO_ENGINE_RIVER;
+  }
+
+  if (engine == LHO_ENGINE_MULTILEVEL) {
+    if (verbose) {
+      printf("\n starting multilevel search...\n");
+    }
+    if (multi_solve(grid) >= 0) {
+      return val_calc(*grid);
+    }
+    if (verbose) {
+      printf(" can't coarsen this grid, using parallel tempering\n");
+    }
+    engine = LHO_ENGINE_TEMPER;
+  }
+
+  if (engine == LHO_ENGINE_TEMPER) {
+    if (verbose) {
+      printf("\n starting parallel tempering...\n");
+    }
+    if (temper_solve(grid) >= 0) {
+      return val_calc(*grid);
+    }
+    if (verbose) {
+      printf(" no memory for tempering, using river search\n");
+    }
+    engine = LHO_ENGINE_RIVER;
+  }
+
+  if (engine == LHO_ENGINE_LINES) {
+    if (verbose) {
+      printf("\n starting line search...\n");
+    }
+    if (line_solve(grid) >= 0) {
+      return val_calc(*grid);
+    }
+    if (verbose) {
+      printf(" can't search this grid a line at a time, using russian doll search\n");
+    }
+    engine = LHO_ENGINE_RDS;
+  }
+
+  if (engine == LHO_ENGINE_FRONTIER) {
+    if (verbose) {
+      printf("\n starting frontier search...\n");
+    }
+    if (frontier_solve(grid) >= 0) {
+      return val_calc(*grid);
+    }
+    if (verbose) {
+      printf(" grid too big for frontier search (or the memory limit), using river search\n");
+    }
+    engine = LHO_ENGINE_RIVER;
+  }
+
+  if (engine == LHO_ENGINE_RDS) {
+    if (verbose) {
+      printf("\n starting russian doll search...\n");
+    }
+    if (rds_solve(grid) >= 0) {
+      return val_calc(*grid);
+    }
+    if (verbose) {
+      printf(" can't use russian doll search on this grid, using recursion\n");
+    }
+    engine = LHO_ENGINE_DFS;
+  }
+
+  if (engine == LHO_ENGINE_COMPILED) {
+    if (verbose) {
+      printf("\n compiling solver for this grid...\n");
+    }
+    if (compiled_solve(grid) >= 0) {
+      return val_calc(*grid);
+    }
+    if (verbose) {
+      printf(" couldn't build a compiled solver, using river search\n");
+    }
+    engine = LHO_ENGINE_RIVER;
+  }
+
+  if (engine == LHO_ENGINE_RIVER) {
+    if (verbose) {
+      printf("\n starting river search...\n");
+    }
+    river_solve(grid);
+    return val_calc(*grid);
+  }
+
+  if (dfs_memory() > mem_headroom()) {
+    if (verbose) {
+      printf("\n recursion would go over the memory limit, using river search\n");
+    }
+    river_solve(grid);
+    return val_calc(*grid);
+  }
+
+  if (verbose) {
+    printf("\n starting recursion...\n");
+  }
+  bestVal = -1;
+  initial_recursion = true;
+  recurse_begin(grid);
+  recurse_grid(grid);
+  recurse_end();
+
+  return val_calc(*grid);
+}
+
+// Fills grid with the best layout the chosen engine finds, trying the
+// precomputed table first if useTable is set. Engines that can't handle the
+// grid fall back to one that can. Returns the value of the layout.
+int solve_grid(struct Grid *grid, enum Engine engine, bool useTable,
+               bool verbose)
+{
+  prof_begin();
+  int val = solve_grid_with(grid, engine, useTable, verbose);
+  prof_end();
+  // only layouts an exact engine finished are worth learning from
+  if (val >= 0 && engine != LHO_ENGINE_TEMPER &&
+      engine != LHO_ENGINE_MULTILEVEL && !solve_cancelled()) {
+    prior_learn(grid);
+  }
+  rds_release();
+
+  return val;
+}
+
+
+/*
+  Asynchronous solves
+
+  solve_submit queues a grid and returns a handle straight away. The grids are
+  solved by a fixed pool of threads (one per core unless told otherwise) so
+  any number of solves can be in flight at once. The caller can poll or wait
+  on the handle with a timeout, be called back with every better layout
+  found and when the solve finishes, and stop any number of solves early
+  through a shared CancelToken. A cancelled solve still finishes with the
+  best layout it had found, or none if it never started. The compiled engine
+  can't be stopped part way.
+*/
+
+struct CancelToken {
+  atomic_bool cancelled;
+};
+
+struct SolveHandle;
+
+// Both run on a pool thread, so must be thread safe
+typedef void (*IncumbentCallback)(struct SolveHandle *handle, int value,
+                                  void *userData);
+typedef void (*DoneCallback)(struct SolveHandle *handle, void *userData);
+
+enum SolveState {LHO_QUEUED, LHO_RUNNING, LHO_DONE};
+
+struct SolveHandle {
+  // what to solve, fixed at submission
+  int rows, cols, land;
+  bool shaped; // blocked and starts are used
+  bool hasFixed; // fixed is used
+  bool blocked[MAX_ROWS * MAX_COLS];
+  bool starts[MAX_ROWS * MAX_COLS]; // see river_start
+  bool fixed[MAX_ROWS * MAX_COLS]; // see riverFixed
+  enum Engine engine;
+  bool useTable;
+  struct CancelToken *token;
+  IncumbentCallback onIncumbent;
+  DoneCallback onDone;
+  void *userData;
+
+  // results, only valid once solve_poll/solve_wait say the solve is done
+  bool cancelled; // stopped early by the token
+  int value; // -1 if it never ran
+  enum Terrain types[MAX_ROWS * MAX_COLS]; // by linear index
+
+  enum SolveState state;
+  int refs; // one for the caller, one for the pool until the solve is done
+  pthread_mutex_t lock;
+  pthread_cond_t doneCond;
+  struct SolveHandle *next; // queue link
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  struct SolveHandle *head, *tail;
+  pthread_t *threads;
+  int numThreads;
+  bool stopping;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+          NULL, NULL, NULL, 0, false};
+
+static _Thread_local struct SolveHandle *curHandle;
+
+void cancel_token_init(struct CancelToken *token)
+{
+  atomic_init(&token->cancelled, false);
+}
+
+void cancel_token_cancel(struct CancelToken *token)
+{
+  atomic_store(&token->cancelled, true);
+}
+
+static void solve_unref(struct SolveHandle *handle)
+{
+  pthread_mutex_lock(&handle->lock);
+  bool last = (--handle->refs == 0);
+  pthread_mutex_unlock(&handle->lock);
+
+  if (last) {
+    pthread_mutex_destroy(&handle->lock);
+    pthread_cond_destroy(&handle->doneCond);
+    free(handle);
+  }
+}
+
+static void pool_incumbent(int value)
+{
+  curHandle->onIncumbent(curHandle, value, curHandle->userData);
+}
+
+static void run_handle(struct SolveHandle *handle)
+{
+  int i;
+
+  handle->value = -1;
+  handle->cancelled = (handle->token != NULL &&
+                       atomic_load(&handle->token->cancelled));
+
+  if (!handle->cancelled) {
+    struct Grid grid;
+
+    load_instance(handle->rows, handle->cols, handle->land);
+    allocate_grid(&grid);
+    if (handle->hasFixed) {
+      riverFixed = handle->fixed;
+    }
+    if (handle->shaped) {
+      riverStarts = handle->starts;
+      for (i = 0; i < numRows * numCols; i++) {
+        if (handle->blocked[i]) {
+          block_cell(i, &grid);
+        }
+      }
+    }
+    curHandle = handle;
+    cancelFlag = handle->token ? &handle->token->cancelled : NULL;
+    incumbentHook = handle->onIncumbent ? pool_incumbent : NULL;
+    lastIncumbent = -1;
+
+    handle->value = solve_grid(&grid, handle->engine, handle->useTable, false);
+    handle->cancelled = solve_cancelled();
+    for (i = 0; i < numRows * numCols; i++) {
+      handle->types[i] = grid.grid[get_row_idx(i)][get_col_idx(i)].type;
+    }
+
+    cancelFlag = NULL;
+    incumbentHook = NULL;
+    curHandle = NULL;
+    riverStarts = NULL;
+    riverFixed = NULL;
+    free_grid(&grid);
+  }
+
+  if (handle->onDone != NULL) {
+    handle->onDone(handle, handle->userData);
+  }
+
+  pthread_mutex_lock(&handle->lock);
+  handle->state = LHO_DONE;
+  pthread_cond_broadcast(&handle->doneCond);
+  pthread_mutex_unlock(&handle->lock);
+  solve_unref(handle);
+}
+
+static void *pool_worker(void *arg)
+{
+  (void)arg;
+
+  for (;;) {
+    pthread_mutex_lock(&pool.lock);
+    while (pool.head == NULL && !pool.stopping) {
+      pthread_cond_wait(&pool.work, &pool.lock);
+    }
+    if (pool.head == NULL) {
+      pthread_mutex_unlock(&pool.lock);
+      break;
+    }
+    struct SolveHandle *handle = pool.head;
+    pool.head = handle->next;
+    if (pool.head == NULL) {
+      pool.tail = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_lock(&handle->lock);
+    handle->state = LHO_RUNNING;
+    pthread_mutex_unlock(&handle->lock);
+    run_handle(handle);
+  }
+
+  return NULL;
+}
+
+// Starts the pool with numThreads threads (0 = one per core). Called by
+// solve_submit if nothing else has started it.
+void solve_pool_start(int numThreads)
+{
+  int i;
+
+  pthread_mutex_lock(&pool.lock);
+  if (pool.threads != NULL) {
+    pthread_mutex_unlock(&pool.lock);
+    return;
+  }
+  if (numThreads <= 0) {
+    numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads < 1) {
+      numThreads = 1;
+    }
+  }
+  pool.stopping = false;
+  pool.numThreads = numThreads;
+  pool.threads = malloc(numThreads * sizeof(pthread_t));
+  for (i = 0; i < numThreads; i++) {
+    pthread_create(&pool.threads[i], NULL, pool_worker, NULL);
+  }
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Lets the pool finish everything queued, then stops its threads
+void solve_pool_stop(void)
+{
+  int i;
+
+  pthread_mutex_lock(&pool.lock);
+  if (pool.threads == NULL) {
+    pthread_mutex_unlock(&pool.lock);
+    return;
+  }
+  pool.stopping = true;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+
+  for (i = 0; i < pool.numThreads; i++) {
+    pthread_join(pool.threads[i], NULL);
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  free(pool.threads);
+  pool.threads = NULL;
+  pool.numThreads = 0;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Like solve_submit, with the tiles in blocked (by linear index) blocked, a
+// river only allowed to start on the tiles in starts, and having to cover the
+// tiles in fixed. Any may be NULL for none blocked / the edge of the grid /
+// none fixed.
+struct SolveHandle *solve_submit_shape(int rows, int cols, int land,
+                                       const bool *blocked, const bool *starts,
+                                       const bool *fixed,
+                                       enum Engine engine, bool useTable,
+                                       struct CancelToken *token,
+                                       IncumbentCallback onIncumbent,
+                                       DoneCallback onDone, void *userData)
+{
+  struct SolveHandle *handle = calloc(1, sizeof(struct SolveHandle));
+  int i;
+
+  if (handle == NULL) {
+    return NULL;
+  }
+  handle->rows = rows;
+  handle->cols = cols;
+  handle->land = land;
+  handle->shaped = (blocked != NULL || starts != NULL);
+  handle->hasFixed = (fixed != NULL);
+  for (i = 0; i < rows * cols; i++) {
+    handle->fixed[i] = fixed ? fixed[i] : false;
+    handle->blocked[i] = blocked ? blocked[i] : false;
+    handle->starts[i] = starts ? starts[i] :
+      (i / cols == 0 || i % cols == 0 || i / cols == rows - 1 ||
+       i % cols == cols - 1);
+  }
+  handle->engine = engine;
+  handle->useTable = useTable;
+  handle->token = token;
+  handle->onIncumbent = onIncumbent;
+  handle->onDone = onDone;
+  handle->userData = userData;
+  handle->value = -1;
+  handle->state = LHO_QUEUED;
+  handle->refs = 2;
+  pthread_mutex_init(&handle->lock, NULL);
+  pthread_cond_init(&handle->doneCond, NULL);
+
+  solve_pool_start(0);
+
+  pthread_mutex_lock(&pool.lock);
+  if (pool.tail != NULL) {
+    pool.tail->next = handle;
+  } else {
+    pool.head = handle;
+  }
+  pool.tail = handle;
+  pthread_cond_signal(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+
+  return handle;
+}
+
+// Queues a rows x cols grid of the given landscape. token and both callbacks
+// may be NULL. The handle must be given back with solve_release.
+struct SolveHandle *solve_submit(int rows, int cols, int land,
+                                 enum Engine engine, bool useTable,
+                                 struct CancelToken *token,
+                                 IncumbentCallback onIncumbent,
+                                 DoneCallback onDone, void *userData)
+{
+  return solve_submit_shape(rows, cols, land, NULL, NULL, NULL, engine,
+                            useTable, token, onIncumbent, onDone, userData);
+}
+
+// true once the solve has finished (or been cancelled)
+bool solve_poll(struct SolveHandle *handle)
+{
+  pthread_mutex_lock(&handle->lock);
+  bool done = (handle->state == LHO_DONE);
+  pthread_mutex_unlock(&handle->lock);
+
+  return done;
+}
+
+// Waits up to timeoutMs milliseconds (forever if negative) for the solve to
+// finish. Returns true if it has.
+bool solve_wait(struct SolveHandle *handle, long timeoutMs)
+{
+  struct timespec deadline;
+
+  if (timeoutMs >= 0) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+
+  pthread_mutex_lock(&handle->lock);
+  while (handle->state != LHO_DONE) {
+    if (timeoutMs < 0) {
+      pthread_cond_wait(&handle->doneCond, &handle->lock);
+    } else if (pthread_cond_timedwait(&handle->doneCond, &handle->lock,
+                                      &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  bool done = (handle->state == LHO_DONE);
+  pthread_mutex_unlock(&handle->lock);
+
+  return done;
+}
+
+// Gives back a handle from solve_submit. The solve carries on if it hasn't
+// finished; cancel its token first to stop it.
+void solve_release(struct SolveHandle *handle)
+{
+  solve_unref(handle);
+}
+
+
+/*
+  Batch mode: reads "rows cols landscape" lines from stdin, solves them all on
+  the pool and prints the results in the order they were given. With a time
+  limit, whatever is still running when it runs out is cancelled and reported
+  with the best layout found so far.
+
+  With --journal=FILE every finished job is also appended to FILE, one line
+  each: its place in the input, the job, the engine, --layout, whether
+  --induced was given, the value and the layout, then a CRC-32 of all that.
+  A run given the same journal again prints the jobs already in it without
+  solving them, so a sweep that dies part way only redoes what hadn't
+  finished. Lines that don't check out, like the one a crash cut short, are
+  ignored, as are lines for another job list, engine, --layout or --induced.
+  Cancelled jobs aren't journaled.
+
+  The pool threads only queue the lines; a writer thread writes them out and
+  calls fsync after JOURNAL_SYNC_RECORDS lines or JOURNAL_SYNC_MS, whichever
+  comes first, so a crash loses at most that much work and the solves never
+  wait on the disk.
+*/
+
+#define JOURNAL_SYNC_RECORDS 32
+#define JOURNAL_SYNC_MS 1000
+#define JOURNAL_LINE_MAX (MAX_ROWS * MAX_COLS + 128)
+
+static const char *journalPath = NULL; // set by --journal
+
+struct JournalRecord {
+  struct JournalRecord *next;
+  size_t len;
+  char line[JOURNAL_LINE_MAX];
+};
+
+static struct {
+  int fd;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  struct JournalRecord *head, *tail;
+  bool stopping;
+  bool failed; // a write failed, which has been reported
+} journal = {-1, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+             NULL, NULL, false, false};
+
+// CRC-32 (as in zip and PNG) of len bytes
+static uint32_t journal_crc(const char *data, size_t len)
+{
+  uint32_t crc = 0xffffffff;
+  size_t i;
+  int b;
+
+  for (i = 0; i < len; i++) {
+    crc ^= (unsigned char)data[i];
+    for (b = 0; b < 8; b++) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+
+  return ~crc;
+}
+
+// terrain types as they're written in the journal
+static inline char journal_type_char(enum Terrain type)
+{
+  return (char)('1' + type);
+}
+
+static void journal_write(const char *data, size_t len)
+{
+  while (len > 0 && !journal.failed) {
+    ssize_t n = write(journal.fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      fprintf(stderr, "Can't write to %s: %s, no longer journaling\n",
+              journalPath, strerror(errno));
+      journal.failed = true;
+      break;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+}
+
+static void *journal_writer(void *arg)
+{
+  int unsynced = 0;
+  struct timespec deadline;
+
+  (void)arg;
+  pthread_mutex_lock(&journal.lock);
+  for (;;) {
+    while (journal.head == NULL && !journal.stopping) {
+      if (unsynced == 0) {
+        pthread_cond_wait(&journal.work, &journal.lock);
+      } else if (pthread_cond_timedwait(&journal.work, &journal.lock,
+                                        &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+    struct JournalRecord *rec = journal.head;
+    journal.head = journal.tail = NULL;
+    bool stopping = journal.stopping;
+    pthread_mutex_unlock(&journal.lock);
+
+    while (rec != NULL) {
+      struct JournalRecord *next = rec->next;
+      journal_write(rec->line, rec->len);
+      if (unsynced++ == 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += JOURNAL_SYNC_MS / 1000;
+        deadline.tv_nsec += (JOURNAL_SYNC_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000L;
+        }
+      }
+      free(rec);
+      rec = next;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (unsynced >= JOURNAL_SYNC_RECORDS || stopping ||
+        (unsynced > 0 && (now.tv_sec > deadline.tv_sec ||
+                          (now.tv_sec == deadline.tv_sec &&
+                           now.tv_nsec >= deadline.tv_nsec)))) {
+      if (unsynced > 0 && !journal.failed) {
+        fsync(journal.fd);
+      }
+      unsynced = 0;
+    }
+
+    pthread_mutex_lock(&journal.lock);
+    if (stopping && journal.head == NULL) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&journal.lock);
+
+  return NULL;
+}
+
+// Opens the journal for appending and starts the writer
+static bool journal_start(void)
+{
+  journal.fd = open(journalPath, O_RDWR | O_APPEND | O_CREAT, 0644);
+  if (journal.fd < 0) {
+    fprintf(stderr, "Can't open %s: %s\n", journalPath, strerror(errno));
+    return false;
+  }
+
+  // keep new lines apart from one a crash cut short
+  off_t size = lseek(journal.fd, 0, SEEK_END);
+  char last = '\n';
+  if (size > 0 && pread(journal.fd, &last, 1, size - 1) == 1 && last != '\n') {
+    journal_write("\n", 1);
+  }
+
+  journal.head = journal.tail = NULL;
+  journal.stopping = false;
+  journal.failed = false;
+  pthread_create(&journal.thread, NULL, journal_writer, NULL);
+  return true;
+}
+
+// Writes out whatever is queued, syncs and closes the journal
+static void journal_stop(void)
+{
+  pthread_mutex_lock(&journal.lock);
+  journal.stopping = true;
+  pthread_cond_signal(&journal.work);
+  pthread_mutex_unlock(&journal.lock);
+  pthread_join(journal.thread, NULL);
+  close(journal.fd);
+  journal.fd = -1;
+}
+
+// Queues a finished job for the writer; called on a pool thread
+static void journal_add(int index, const struct SolveHandle *handle)
+{
+  struct JournalRecord *rec = malloc(sizeof(struct JournalRecord));
+  int numCells = handle->rows * handle->cols, len, i;
+
+  if (rec == NULL) {
+    fprintf(stderr, "Out of memory, job %d isn't journaled and will rerun "
+                    "on resume\n", index);
+    return;
+  }
+
+  len = snprintf(rec->line, JOURNAL_LINE_MAX, "%d %d %d %d %s %s %s %d ",
+                 index, handle->rows, handle->cols, handle->land,
+                 engineNames[handle->engine], layoutNames[gridLayout],
+                 inducedRivers ? "induced" : "plain", handle->value);
+  for (i = 0; i < numCells; i++) {
+    rec->line[len++] = journal_type_char(handle->types[i]);
+  }
+  len += snprintf(rec->line + len, JOURNAL_LINE_MAX - len, " %08x\n",
+                  journal_crc(rec->line, len));
+  rec->len = len;
+  rec->next = NULL;
+
+  pthread_mutex_lock(&journal.lock);
+  if (journal.tail != NULL) {
+    journal.tail->next = rec;
+  } else {
+    journal.head = rec;
+  }
+  journal.tail = rec;
+  pthread_cond_signal(&journal.work);
+  pthread_mutex_unlock(&journal.lock);
+}
+
+// A job of the batch and, once solved or read from the journal, its result
+struct BatchJob {
+  int rows, cols, land;
+  int index;
+  int total;
+  bool journaled;
+  int value;
+  enum Terrain types[MAX_ROWS * MAX_COLS];
+};
+
+// Reads the results already in the journal into jobs. Returns how many of
+// the jobs they finish.
+static int journal_load(struct BatchJob *jobs, int numJobs,
+                        enum Engine engine)
+{
+  FILE *in = fopen(journalPath, "r");
+  char line[JOURNAL_LINE_MAX + 2];
+  int numDone = 0, numBad = 0;
+
+  if (in == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), in) != NULL) {
+    char engineName[16], layoutName[16], induced[16];
+    char types[MAX_ROWS * MAX_COLS + 1];
+    int index, rows, cols, land, value, start, end, i;
+    unsigned crc;
+    size_t len = strlen(line);
+
+    if (len <= 1) {
+      continue;
+    }
+    // everything up to the space before the checksum is covered by it
+    char *sep = strrchr(line, ' ');
+    if (line[len - 1] != '\n' || sep == NULL ||
+        sscanf(sep, " %8x", &crc) != 1 ||
+        journal_crc(line, sep - line) != crc ||
+        sscanf(line, "%d %d %d %d %15s %15s %15s %d %n%*s%n", &index, &rows,
+               &cols, &land, engineName, layoutName, induced, &value, &start,
+               &end) != 8 ||
+        end - start != rows * cols || rows * cols > MAX_ROWS * MAX_COLS) {
+      numBad++;
+      continue;
+    }
+    memcpy(types, line + start, end - start);
+    if (index < 0 || index >= numJobs || jobs[index].rows != rows ||
+        jobs[index].cols != cols || jobs[index].land != land ||
+        strcmp(engineName, engineNames[engine]) != 0 ||
+        strcmp(layoutName, layoutNames[gridLayout]) != 0 ||
+        strcmp(induced, inducedRivers ? "induced" : "plain") != 0) {
+      continue;
+    }
+    if (!jobs[index].journaled) {
+      numDone++;
+    }
+    jobs[index].journaled = true;
+    jobs[index].value = value;
+    for (i = 0; i < rows * cols; i++) {
+      jobs[index].types[i] = (enum Terrain)(types[i] - '1');
+    }
+  }
+  fclose(in);
+
+  if (numBad > 0) {
+    fprintf(stderr, " ignored %d damaged lines in %s\n", numBad, journalPath);
+  }
+  return numDone;
+}
+
+static atomic_int batchDone;
+
+static void batch_done(struct SolveHandle *handle, void *userData)
+{
+  struct BatchJob *job = userData;
+
+  if (journalPath != NULL && handle->value >= 0 && !handle->cancelled) {
+    journal_add(job->index, handle);
+  }
+  fprintf(stderr, " finished %dx%d landscape %d (%d/%d)\n", handle->rows,
+          handle->cols, handle->land, atomic_fetch_add(&batchDone, 1) + 1,
+          job->total);
+}
+
+static void batch_print(int rows, int cols, int land, int value,
+                        const enum Terrain *types, bool cancelled)
+{
+  int k;
+
+  printf(" %dx%d landscape %d: ", rows, cols, land);
+  if (value < 0) {
+    printf("cancelled before starting\n");
+    return;
+  }
+
+  struct Grid grid;
+  load_instance(rows, cols, land);
+  allocate_grid(&grid);
+  for (k = 0; k < numRows * numCols; k++) {
+    grid.grid[get_row_idx(k)][get_col_idx(k)].type = types[k];
+  }
+  recount_grid(&grid);
+  printf("value %d%s\n", value,
+         cancelled ? " (cancelled, best found so far)" : "");
+  print_grid(grid);
+  free_grid(&grid);
+}
+
+int run_batch(enum Engine engine, bool useTable, int numThreads,
+              long timeLimitMs)
+{
+  struct SolveHandle **handles = NULL;
+  struct CancelToken token;
+  int numJobs = 0, capacity = 0, numDone = 0;
+  int rows, cols, land, i;
+
+  cancel_token_init(&token);
+
+  // read everything first so the progress count is right
+  struct BatchJob *jobs = NULL;
+  while (scanf("%d %d %d", &rows, &cols, &land) == 3) {
+    if (rows < 1 || cols < 1 || rows > MAX_ROWS || cols > MAX_COLS ||
+        land < 0 || land > 3) {
+      fprintf(stderr, "Skipping bad job: %d %d %d\n", rows, cols, land);
+      continue;
+    }
+    if (numJobs == capacity) {
+      capacity = capacity ? 2 * capacity : 16;
+      jobs = realloc(jobs, capacity * sizeof(*jobs));
+    }
+    memset(&jobs[numJobs], 0, sizeof(*jobs));
+    jobs[numJobs].rows = rows;
+    jobs[numJobs].cols = cols;
+    jobs[numJobs].land = land;
+    jobs[numJobs].index = numJobs;
+    numJobs++;
+  }
+  for (i = 0; i < numJobs; i++) {
+    jobs[i].total = numJobs;
+  }
+
+  if (journalPath != NULL) {
+    numDone = journal_load(jobs, numJobs, engine);
+    if (numDone > 0) {
+      fprintf(stderr, " %d of %d jobs already done in %s\n", numDone,
+              numJobs, journalPath);
+    }
+    if (!journal_start()) {
+      free(jobs);
+      return 1;
+    }
+  }
+  atomic_init(&batchDone, numDone);
+
+  solve_pool_start(numThreads);
+  handles = calloc(numJobs ? numJobs : 1, sizeof(struct SolveHandle *));
+  for (i = 0; i < numJobs; i++) {
+    if (!jobs[i].journaled) {
+      handles[i] = solve_submit(jobs[i].rows, jobs[i].cols, jobs[i].land,
+                                engine, useTable, &token, NULL, batch_done,
+                                &jobs[i]);
+    }
+  }
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < numJobs; i++) {
+    long waitMs = -1;
+    if (jobs[i].journaled) {
+      batch_print(jobs[i].rows, jobs[i].cols, jobs[i].land, jobs[i].value,
+                  jobs[i].types, false);
+      continue;
+    }
+    if (timeLimitMs >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      waitMs = timeLimitMs - ((now.tv_sec - start.tv_sec) * 1000 +
+                              (now.tv_nsec - start.tv_nsec) / 1000000);
+      if (waitMs < 0) {
+        waitMs = 0;
+      }
+    }
+    if (!solve_wait(handles[i], waitMs)) {
+      fprintf(stderr, " time limit reached, cancelling the rest\n");
+      cancel_token_cancel(&token);
+      solve_wait(handles[i], -1);
+    }
+
+    struct SolveHandle *handle = handles[i];
+    batch_print(handle->rows, handle->cols, handle->land, handle->value,
+                handle->types, handle->cancelled);
+    solve_release(handle);
+  }
+
+  solve_pool_stop();
+  if (journalPath != NULL) {
+    journal_stop();
+  }
+  free(handles);
+  free(jobs);
+
+  return 0;
+}
+
+
+/*
+  Map mode: reads a whole loop map and solves every buildable pocket of it.
+
+  The first line is the landscape (0-3), then one line per row of the map:
+    .  buildable tile
+    S  buildable tile a river may start on
+    R  buildable tile the river has to cover (solved by --engine=bidir)
+    #  loop road
+    x  anything else that can't be built on
+  Short rows are padded with x. If the map has no S at all, a river may
+  start on any buildable tile next to the road or on the edge of the map.
+
+  Each connected group of buildable tiles is a separate problem, cut out to
+  its bounding box with everything else blocked. Pockets with the same shape,
+  start and fixed tiles are solved once, all of them at the same time on the pool,
+  and the layouts are stitched back into the map.
+*/
+
+struct LoopMap {
+  int rows, cols, land;
+  char *cells; // rows * cols of the characters above
+};
+
+struct MapRegion {
+  int top, left, rows, cols; // bounding box on the map
+  bool blocked[MAX_ROWS * MAX_COLS];
+  bool starts[MAX_ROWS * MAX_COLS];
+  bool fixed[MAX_ROWS * MAX_COLS]; // R tiles
+  bool anyFixed;
+  int same; // first region with the same shape, or its own index
+  struct SolveHandle *handle; // only for regions that are their own same
+};
+
+static bool map_buildable(char c)
+{
+  return c == '.' || c == 'S' || c == 'R';
+}
+
+// Reads a map in the format above. Returns false (having said why) if it
+// isn't one.
+static bool read_map(FILE *in, struct LoopMap *map)
+{
+  char line[1024];
+  int capacity = 0, i;
+  bool ok = true;
+
+  map->rows = map->cols = 0;
+  map->cells = NULL;
+  if (fscanf(in, "%d ", &map->land) != 1 || map->land < 0 || map->land > 3) {
+    fprintf(stderr, "Map has to start with the landscape (0-3)\n");
+    return false;
+  }
+
+  char **lines = NULL;
+  while (ok && fgets(line, sizeof(line), in) != NULL) {
+    int len = strcspn(line, "\r\n");
+    if (line[len] == '\0' && len == (int)sizeof(line) - 1 && !feof(in)) {
+      fprintf(stderr, "Row %d of the map is longer than %d tiles\n",
+              map->rows + 1, (int)sizeof(line) - 2);
+      ok = false;
+      break;
+    }
+    line[len] = '\0';
+    for (i = 0; i < len; i++) {
+      if (!map_buildable(line[i]) && line[i] != '#' && line[i] != 'x') {
+        fprintf(stderr, "Unknown map tile '%c' on row %d\n", line[i],
+                map->rows + 1);
+        ok = false;
+        break;
+      }
+    }
+    if (ok && map->rows == capacity) {
+      int newCapacity = capacity ? 2 * capacity : 16;
+      char **grown = realloc(lines, newCapacity * sizeof(char *));
+      if (grown == NULL) {
+        fprintf(stderr, "Out of memory reading the map\n");
+        ok = false;
+      } else {
+        lines = grown;
+        capacity = newCapacity;
+      }
+    }
+    if (ok && (lines[map->rows] = strdup(line)) == NULL) {
+      fprintf(stderr, "Out of memory reading the map\n");
+      ok = false;
+    }
+    if (ok) {
+      map->rows++;
+      if (len > map->cols) {
+        map->cols = len;
+      }
+    }
+  }
+
+  if (ok && (map->rows == 0 || map->cols == 0)) {
+    fprintf(stderr, "Map has no tiles\n");
+    ok = false;
+  }
+  if (ok) {
+    map->cells = malloc(map->rows * map->cols + 1);
+    if (map->cells == NULL) {
+      fprintf(stderr, "Out of memory reading the map\n");
+      ok = false;
+    }
+  }
+  for (i = 0; i < map->rows; i++) {
+    if (ok) {
+      int len = strlen(lines[i]);
+      memset(map->cells + i * map->cols, 'x', map->cols);
+      memcpy(map->cells + i * map->cols, lines[i], len);
+    }
+    free(lines[i]);
+  }
+  free(lines);
+
+  return ok;
+}
+
+// whether the map tile at (i, j) is buildable and next to the road or edge
+static bool map_road_side(const struct LoopMap *map, int i, int j)
+{
+  static const int steps[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+  int k;
+
+  for (k = 0; k < 4; k++) {
+    int ni = i + steps[k][0], nj = j + steps[k][1];
+    if (ni < 0 || nj < 0 || ni >= map->rows || nj >= map->cols ||
+        map->cells[ni * map->cols + nj] == '#') {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Splits the map into its buildable pockets and marks which are the same.
+// Returns the number found, or -1 (having said why) if one is too big.
+static int find_regions(const struct LoopMap *map, struct MapRegion **regions)
+{
+  static const int steps[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+  int numCells = map->rows * map->cols;
+  int *region = malloc(numCells * sizeof(int));
+  int *queue = malloc(numCells * sizeof(int));
+  bool anyStarts = (memchr(map->cells, 'S', numCells) != NULL);
+  int numRegions = 0, capacity = 0;
+  int i, j, k, n;
+
+  for (i = 0; i < numCells; i++) {
+    region[i] = -1;
+  }
+  *regions = NULL;
+
+  for (i = 0; i < numCells; i++) {
+    if (region[i] >= 0 || !map_buildable(map->cells[i])) {
+      continue;
+    }
+
+    // flood fill the pocket, keeping its bounding box
+    int top = i / map->cols, bottom = top, left = i % map->cols, right = left;
+    int numQueued = 0;
+    region[i] = numRegions;
+    queue[numQueued++] = i;
+    for (n = 0; n < numQueued; n++) {
+      int ci = queue[n] / map->cols, cj = queue[n] % map->cols;
+      top = ci < top ? ci : top;
+      bottom = ci > bottom ? ci : bottom;
+      left = cj < left ? cj : left;
+      right = cj > right ? cj : right;
+      for (k = 0; k < 4; k++) {
+        int ni = ci + steps[k][0], nj = cj + steps[k][1];
+        int cell = ni * map->cols + nj;
+        if (ni >= 0 && nj >= 0 && ni < map->rows && nj < map->cols &&
+            region[cell] < 0 && map_buildable(map->cells[cell])) {
+          region[cell] = numRegions;
+          queue[numQueued++] = cell;
+        }
+      }
+    }
+
+    if (bottom - top + 1 > MAX_ROWS || right - left + 1 > MAX_COLS) {
+      fprintf(stderr, "Buildable area at row %d, column %d is bigger than "
+              "%dx%d\n", top + 1, left + 1, MAX_ROWS, MAX_COLS);
+      free(region);
+      free(queue);
+      free(*regions);
+      return -1;
+    }
+
+    if (numRegions == capacity) {
+      capacity = capacity ? 2 * capacity : 16;
+      *regions = realloc(*regions, capacity * sizeof(struct MapRegion));
+    }
+    struct MapRegion *reg = &(*regions)[numRegions];
+    memset(reg, 0, sizeof(*reg));
+    reg->top = top;
+    reg->left = left;
+    reg->rows = bottom - top + 1;
+    reg->cols = right - left + 1;
+    for (j = 0; j < reg->rows * reg->cols; j++) {
+      int mi = top + j / reg->cols, mj = left + j % reg->cols;
+      int cell = mi * map->cols + mj;
+      reg->blocked[j] = (region[cell] != numRegions);
+      reg->starts[j] = !reg->blocked[j] &&
+        (anyStarts ? map->cells[cell] == 'S' : map_road_side(map, mi, mj));
+      reg->fixed[j] = !reg->blocked[j] && map->cells[cell] == 'R';
+      reg->anyFixed |= reg->fixed[j];
+    }
+
+    reg->same = numRegions;
+    for (k = 0; k < numRegions; k++) {
+      struct MapRegion *other = &(*regions)[k];
+      if (other->same == k && other->rows == reg->rows &&
+          other->cols == reg->cols &&
+          memcmp(other->blocked, reg->blocked,
+                 reg->rows * reg->cols * sizeof(bool)) == 0 &&
+          memcmp(other->starts, reg->starts,
+                 reg->rows * reg->cols * sizeof(bool)) == 0 &&
+          memcmp(other->fixed, reg->fixed,
+                 reg->rows * reg->cols * sizeof(bool)) == 0) {
+        reg->same = k;
+        break;
+      }
+    }
+    numRegions++;
+  }
+
+  free(region);
+  free(queue);
+
+  return numRegions;
+}
+
+static void map_done(struct SolveHandle *handle, void *userData)
+{
+  int total = *(int *)userData;
+
+  fprintf(stderr, " finished %dx%d landscape %d (%d/%d)\n", handle->rows,
+          handle->cols, handle->land, atomic_fetch_add(&batchDone, 1) + 1,
+          total);
+}
+
+int run_map(const char *path, enum Engine engine, bool useTable,
+            int numThreads, long timeLimitMs)
+{
+  struct LoopMap map;
+  struct MapRegion *regions;
+  struct CancelToken token;
+  int numUnique = 0, total = 0;
+  bool cancelled = false;
+  int i, k;
+
+  FILE *in = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+  if (in == NULL) {
+    perror(path);
+    return 1;
+  }
+  bool ok = read_map(in, &map);
+  if (in != stdin) {
+    fclose(in);
+  }
+  if (!ok) {
+    return 1;
+  }
+
+  int numRegions = find_regions(&map, &regions);
+  if (numRegions < 0) {
+    free(map.cells);
+    return 1;
+  }
+
+  cancel_token_init(&token);
+  atomic_init(&batchDone, 0);
+  solve_pool_start(numThreads);
+  for (i = 0; i < numRegions; i++) {
+    numUnique += (regions[i].same == i);
+  }
+  for (i = 0; i < numRegions; i++) {
+    struct MapRegion *reg = &regions[i];
+    if (reg->same == i) {
+      reg->handle = solve_submit_shape(reg->rows, reg->cols, map.land,
+                                       reg->blocked, reg->starts,
+                                       reg->anyFixed ? reg->fixed : NULL,
+                                       engine,
+                                       useTable, &token, NULL, map_done,
+                                       &numUnique);
+    }
+  }
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < numRegions; i++) {
+    if (regions[i].same != i) {
+      continue;
+    }
+    long waitMs = -1;
+    if (timeLimitMs >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      waitMs = timeLimitMs - ((now.tv_sec - start.tv_sec) * 1000 +
+                              (now.tv_nsec - start.tv_nsec) / 1000000);
+      if (waitMs < 0) {
+        waitMs = 0;
+      }
+    }
+    if (!solve_wait(regions[i].handle, waitMs)) {
+      fprintf(stderr, " time limit reached, cancelling the rest\n");
+      cancel_token_cancel(&token);
+      solve_wait(regions[i].handle, -1);
+    }
+    cancelled |= regions[i].handle->cancelled;
+  }
+
+  // stitch the layouts back into the map
+  for (i = 0; i < numRegions; i++) {
+    struct MapRegion *reg = &regions[i];
+    struct SolveHandle *handle = regions[reg->same].handle;
+    total += handle->value > 0 ? handle->value : 0;
+    for (k = 0; k < reg->rows * reg->cols; k++) {
+      char *cell = &map.cells[(reg->top + k / reg->cols) * map.cols +
+                              reg->left + k % reg->cols];
+      if (reg->blocked[k]) {
+        continue;
+      }
+      if (handle->value < 0) {
+        *cell = '?';
+      } else if (handle->types[k] == LHO_RIVER) {
+        *cell = 'R';
+      } else {
+        *cell = (map.land == LHO_SUBURB) ? 'S' :
+                (map.land == LHO_THICKET) ? 'T' : 'M';
+      }
+    }
   }
 
-  printf("\n  ");
-  for (i = 0; i < numCols; i++) {
-    printf("----");
+  printf("\n %d buildable areas, %d different\n\n", numRegions, numUnique);
+  for (i = 0; i < map.rows; i++) {
+    printf("  %.*s\n", map.cols, map.cells + i * map.cols);
   }
-  printf("-\n");
-  for (i = 0; i < numRows; i++) {
-    printf("  ");
-    for (j = 0; j < numCols; j++) {
-      printf("|");
-      type = grid.grid[i][j].type;
-      switch (type) {
-        case LHO_EMPTY:
-          printf("   ");
-          break;
-        case LHO_RIVER:
-          printf(" R ");
-          break;
-        case LHO_LANDSCAPE:
-          printf("%s", label);
-          break;
-      } // switch
-    } // iForLoop
-    printf("|");
-    printf("\n  ");
-    for (j = 0; j < numCols; j++) {
-      printf("----");
+  printf("\n Value of map: %d%s\n", total,
+         cancelled ? " (cancelled, best found so far)" : "");
+
+  solve_pool_stop();
+  for (i = 0; i < numRegions; i++) {
+    if (regions[i].same == i) {
+      solve_release(regions[i].handle);
     }
-    printf("-\n");
-  } //jForLoop
-  printf("\n");
+  }
+  free(regions);
+  free(map.cells);
+
+  return 0;
 }
 
+
 /*
-  Sets initial grid used in recursion using some heuristics to start at a
-  higher "current best"
-  Starts river at top left and tries to draw a zig-zag to the bottom then back
-  up, repeating if necessary. The rest is filled with landscape tiles, minus
-  one tile to enter recursion once
+  Benchmark
+
+  --bench solves a fixed suite of grids for every landscape, without the
+  precomputed table, and prints how long each took and the total. The suite
+  stops at the largest grids the chosen engine gets through in seconds
+  (--bench=N changes the limit to N tiles), so runs with different settings
+  can be compared directly, e.g. --layout=generic against the square fast
+  path.
 */
 
-void heuristic_grid(struct Grid *grid)
+static const int benchSizes[][2] = {
+  {2, 3}, {3, 3}, {2, 5}, {3, 4}, {4, 4}, {3, 6}, {4, 5}, {5, 5}, {5, 6},
+  {6, 6}
+};
+
+static const char *const landNames[] = {"meadow", "thicket", "mountain",
+                                        "suburb"};
+
+// Runs the suite with grids of up to maxTiles tiles, or the engine's own
+// limit if maxTiles is 0. Returns the total time in seconds.
+double run_bench(enum Engine engine, int maxTiles)
 {
-  int i,j;
+  static const int engineTiles[LHO_NUM_ENGINES] = {12, 36, 30, 30, 36, 30, 30,
+                                                   20, 36, 36};
+  struct timespec start;
+  double total = 0;
+  size_t k;
+  int land;
 
+  if (maxTiles <= 0) {
+    maxTiles = engineTiles[engine];
+  }
 
-  for (i = 0; i < numRows; i++) {
-    for (j = 0; j < numCols; j++) {
-      grid->grid[i][j].type = LHO_LANDSCAPE; // Set whole grid to landscape
+  // so runs of different builds can be told apart
+  printf("\n Built with %cbounds %csymmetry %ctransposition %cinstrument\n",
+         LHO_BOUNDS ? '+' : '-', LHO_SYMMETRY ? '+' : '-',
+         LHO_TRANSPOSITION ? '+' : '-', LHO_INSTRUMENT ? '+' : '-');
+  printf("\n  %-5s %-8s %7s %10s\n", "grid", "land", "value", "seconds");
+  for (k = 0; k < sizeof(benchSizes) / sizeof(benchSizes[0]); k++) {
+    int rows = benchSizes[k][0], cols = benchSizes[k][1];
+    if (rows * cols > maxTiles) {
+      continue;
+    }
+    for (land = 0; land < 4; land++) {
+      struct Grid grid;
+      load_instance(rows, cols, land);
+      allocate_grid(&grid);
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      int val = solve_grid(&grid, engine, false, false);
+      double seconds = elapsed_ns(&start) / 1e9;
+      total += seconds;
+
+      printf("  %2dx%-2d %-8s %7d %10.3f\n", rows, cols, landNames[land], val,
+             seconds);
+      free_grid(&grid);
     }
   }
+  printf("\n Total: %.3f seconds\n", total);
 
-  i = 0;
-  j = 0;
-  bool done = false;
-  bool firstLoop = true;
-  int zigx = 0, zigy = 0;
-  enum ZigZag zigLocalDir = LHO_RIGHT; // always start top left, so first move is to the right
-  enum ZigZag zigNextDir = LHO_DOWN; // start top left and overall go down to the right
-  enum ZigZag zigOverallDir = LHO_DOWN;
+  return total;
+}
 
-  while (!done) {
 
-    grid->grid[i][j].type = LHO_RIVER;
+/*
+  Anytime benchmark
 
-    if (j == numCols - 1) {
-      done = true;
-    }
+  --anytime gives each engine that improves its layout as it goes a fixed
+  time on a fixed set of grids too large to solve exactly, and records when
+  each better layout turned up. Every engine is then scored at checkpoints
+  from 1/256 of the time up to all of it (doubling each time) by the best
+  value it had by then, as a fraction of the best any of them found on that
+  grid. The mean over the checkpoints is the area under that curve against
+  log time: 1 for an engine that had the best layout from the first
+  checkpoint on.
+*/
 
-    switch (zigLocalDir) {
-      case LHO_RIGHT:
-        j++;
-        zigLocalDir = zigNextDir;
-        if (zigOverallDir == LHO_DOWN) {
-          zigNextDir = LHO_DOWN;
-        } else {
-          zigNextDir = LHO_UP;
-        }
-        break;
-      case LHO_LEFT:
-        j--;
-        zigLocalDir = zigNextDir;
-        if (zigOverallDir == LHO_DOWN) {
-          zigNextDir = LHO_DOWN;
-        } else {
-          zigNextDir = LHO_UP;
-        }
-        break;
-      case LHO_DOWN: // these are "backwards" as top left is (0,0)
-        i++;
-        zigLocalDir = LHO_RIGHT;
-        break;
-      case LHO_UP:
-        i--;
-        zigLocalDir = LHO_RIGHT;
-        break;
-    }
+#define ANYTIME_CHECKPOINTS 9
+#define ANYTIME_MAX_EVENTS 1024
 
-    if (i == (numRows)) {
-      zigOverallDir = LHO_UP;
-      //zigLocalDir = LHO_RIGHT;
-      zigNextDir = LHO_UP;
-      i -= 2;
-      //j++;
-    }
+static const int anytimeSizes[][2] = {{8, 8}, {10, 10}, {14, 14}, {20, 20}};
 
-    if (i == -1 && !firstLoop) {
-      zigOverallDir = LHO_DOWN;
-      //zigLocalDir = LHO_RIGHT;
-      zigNextDir = LHO_DOWN;
-      i += 2;
-      //j++;
-    }
+// mountains are left out as their best layouts have no river to speak of
+static const int anytimeLands[] = {LHO_MEADOW, LHO_THICKET, LHO_SUBURB};
 
-    firstLoop = false;
+static const enum Engine anytimeEngines[] = {
+  LHO_ENGINE_DFS, LHO_ENGINE_RIVER, LHO_ENGINE_TEMPER, LHO_ENGINE_MULTILEVEL
+};
+
+#define ANYTIME_NUM_ENGINES \
+  (int)(sizeof(anytimeEngines) / sizeof(anytimeEngines[0]))
+
+// The better layouts one engine found on one grid, and when
+struct AnytimeRun {
+  struct timespec start;
+  int numEvents;
+  double seconds[ANYTIME_MAX_EVENTS];
+  int value[ANYTIME_MAX_EVENTS];
+};
 
+// Called on the pool thread
+static void anytime_record(struct AnytimeRun *run, int value)
+{
+  double seconds = elapsed_ns(&run->start) / 1e9;
+
+  if (run->numEvents > 0 && value <= run->value[run->numEvents - 1]) {
+    return;
   }
+  // past the limit the latest overwrites the one before, so the curve is
+  // only coarser in the middle
+  if (run->numEvents == ANYTIME_MAX_EVENTS) {
+    run->numEvents--;
+  }
+  run->seconds[run->numEvents] = seconds;
+  run->value[run->numEvents] = value;
+  run->numEvents++;
+}
 
-  return;
+static void anytime_incumbent(struct SolveHandle *handle, int value,
+                              void *userData)
+{
+  (void)handle;
+  anytime_record(userData, value);
 }
 
+static void anytime_done(struct SolveHandle *handle, void *userData)
+{
+  if (handle->value >= 0) {
+    anytime_record(userData, handle->value);
+  }
+}
 
-static int recursion_depth = 0;
-static bool initial_recursion = true;
+// The best value run had by the given time, 0 if it had none yet
+static int anytime_value_at(const struct AnytimeRun *run, double seconds)
+{
+  int i, value = 0;
 
-// Function to fill the remainder of a given grid, designed to be recursed
-struct Grid * recurse_grid(struct Grid *grid)
+  for (i = 0; i < run->numEvents && run->seconds[i] <= seconds; i++) {
+    value = run->value[i];
+  }
+
+  return value;
+}
+
+// Runs every engine for budget seconds on every grid of the suite and prints
+// the quality curves and the area under them. Returns 0, or 1 if out of
+// memory.
+int run_anytime(double budget)
 {
-//printf("inside recursion, bestVal = %d\n", bestVal);
-  //print_grid(*grid);
-  // First check if we need to do anything or if grid is full
-  if (grid->full) {
-    //printf("grid full!\n");
-    return grid;
+  int numSizes = sizeof(anytimeSizes) / sizeof(anytimeSizes[0]);
+  int numLands = sizeof(anytimeLands) / sizeof(anytimeLands[0]);
+  int numGrids = numSizes * numLands;
+  double checkpoint[ANYTIME_CHECKPOINTS];
+  double area[ANYTIME_NUM_ENGINES] = {0};
+  int order[ANYTIME_NUM_ENGINES];
+  int g, e, k;
+
+  struct AnytimeRun *runs = calloc(ANYTIME_NUM_ENGINES,
+                                   sizeof(struct AnytimeRun));
+  if (runs == NULL) {
+    return 1;
+  }
+  for (k = 0; k < ANYTIME_CHECKPOINTS; k++) {
+    checkpoint[k] = budget / (1 << (ANYTIME_CHECKPOINTS - 1 - k));
   }
 
-  // Then check if we can exit early due to this branch being unable to surpass
-  // this highest value already found:
-  int val, maxRemaining;
-  val = val_calc(*grid);
-  maxRemaining = maxTileVal * (grid->maxTiles - grid->numFilledTiles);
-  if ( val + maxRemaining <= bestVal ) {
-    //printf("Branch maximum too low to gon on\n");
-    return grid;
+  // one solve at a time, so each engine has the machine to itself
+  solve_pool_start(1);
+
+  printf("\n Quality (%% of the best found) after the given seconds\n");
+  for (g = 0; g < numGrids; g++) {
+    int rows = anytimeSizes[g / numLands][0];
+    int cols = anytimeSizes[g / numLands][1];
+    int land = anytimeLands[g % numLands];
+    int best = 0;
+
+    for (e = 0; e < ANYTIME_NUM_ENGINES; e++) {
+      struct AnytimeRun *run = &runs[e];
+      struct CancelToken token;
+
+      memset(run, 0, sizeof(*run));
+      cancel_token_init(&token);
+      clock_gettime(CLOCK_MONOTONIC, &run->start);
+      struct SolveHandle *handle = solve_submit(rows, cols, land,
+                                                anytimeEngines[e], false,
+                                                &token, anytime_incumbent,
+                                                anytime_done, run);
+      if (!solve_wait(handle, (long)(budget * 1000))) {
+        cancel_token_cancel(&token);
+        solve_wait(handle, -1);
+      }
+      solve_release(handle);
+
+      // a layout that only turned up while the engine was being stopped
+      // doesn't count
+      if (anytime_value_at(run, budget) > best) {
+        best = anytime_value_at(run, budget);
+      }
+    }
+
+    printf("\n  %2dx%-2d %-8s best %d\n", rows, cols, landNames[land], best);
+    printf("  %-10s", "engine");
+    for (k = 0; k < ANYTIME_CHECKPOINTS; k++) {
+      printf(" %7.3f", checkpoint[k]);
+    }
+    printf(" %7s\n", "area");
+    for (e = 0; e < ANYTIME_NUM_ENGINES; e++) {
+      double sum = 0;
+      printf("  %-10s", engineNames[anytimeEngines[e]]);
+      for (k = 0; k < ANYTIME_CHECKPOINTS; k++) {
+        double quality = best > 0 ?
+          (double)anytime_value_at(&runs[e], checkpoint[k]) / best : 0;
+        sum += quality;
+        printf(" %6.1f%%", 100 * quality);
+      }
+      printf(" %7.3f\n", sum / ANYTIME_CHECKPOINTS);
+      area[e] += sum / ANYTIME_CHECKPOINTS / numGrids;
+    }
+    fflush(stdout);
   }
 
-  int currentBest = bestVal;
-  struct Grid bestGrid;
-  allocate_grid(&bestGrid);
-  copy_grid(&bestGrid, grid);
+  solve_pool_stop();
+  free(runs);
 
-  int maxLen,i,j;
-  maxLen = numRows * numCols;
+  // highest mean area first
+  for (e = 0; e < ANYTIME_NUM_ENGINES; e++) {
+    order[e] = e;
+    for (k = e; k > 0 && area[order[k]] > area[order[k - 1]]; k--) {
+      int swap = order[k];
+      order[k] = order[k - 1];
+      order[k - 1] = swap;
+    }
+  }
+  printf("\n Mean area over %d grids, %.3f seconds each:\n", numGrids,
+         budget);
+  for (e = 0; e < ANYTIME_NUM_ENGINES; e++) {
+    printf("  %-10s %7.3f\n", engineNames[anytimeEngines[order[e]]],
+           area[order[e]]);
+  }
 
-  struct Grid thisGrid;
-  allocate_grid(&thisGrid);
-  copy_grid(&thisGrid, grid);
+  return 0;
+}
 
-  struct Grid tempGrid;
-  allocate_grid(&tempGrid);
+// Solves every grid of up to maxTiles tiles for every landscape with every
+// engine and checks the values against --engine=brute. The default search
+// only gets the grids of up to 9 tiles, as it is slow beyond that. Returns
+// the number of disagreements.
+int verify_engines(int maxTiles)
+{
+  int rows, cols, land, e, wrong = 0;
 
-  if (initial_recursion) {
-    heuristic_grid(&tempGrid);
-    currentBest = val_calc(tempGrid);
-    bestVal =  currentBest;
-    copy_grid(&bestGrid, &tempGrid);
-    initial_recursion = false;
+  printf("\n  %-5s %-8s %6s", "grid", "land", "brute");
+  for (e = 0; e < LHO_ENGINE_BRUTE; e++) {
+    printf(" %8s", engineNames[e]);
   }
+  printf("\n");
 
-  for (i = 0; i < maxLen; i++) {
-      for (j = 0; j < 2; j++) {
-        if (j == 0) {
-          bool river_added = add_river(i, &thisGrid);
-          //printf("added river at i: %d\n", i);
-          if (river_added) {
-            //printf("Actually added river...\n");
-            copy_grid(&tempGrid, &thisGrid);
-            remove_terrain(i, &thisGrid);
-            recursion_depth++;
-            recurse_grid(&tempGrid);
-            val = val_calc(tempGrid);
-            if (val > currentBest) {
-              currentBest = val;
-              bestVal = val;
-              copy_grid(&bestGrid, &tempGrid);
-            }
-            recursion_depth--;
-          }
-        } else {
-          bool land_added = add_land(i, &thisGrid);
-          if (land_added) {
-            copy_grid(&tempGrid, &thisGrid);
-            remove_terrain(i, &thisGrid);
-            recursion_depth++;
-            recurse_grid(&tempGrid);
-            val = val_calc(tempGrid);
-            if (val > currentBest) {
-              currentBest = val;
-              bestVal = val;
-              copy_grid(&bestGrid, &tempGrid);
-            }
-            recursion_depth--;
+  for (rows = 1; rows * rows <= maxTiles; rows++) {
+    for (cols = rows; rows * cols <= maxTiles; cols++) {
+      for (land = 0; land < 4; land++) {
+        struct Grid grid;
+        load_instance(rows, cols, land);
+        allocate_grid(&grid);
+        int expected = solve_grid(&grid, LHO_ENGINE_BRUTE, false, false);
+        free_grid(&grid);
+
+        printf("  %2dx%-2d %-8s %6d", rows, cols, landNames[land], expected);
+        for (e = 0; e < LHO_ENGINE_BRUTE; e++) {
+          if (e == LHO_ENGINE_DFS && rows * cols > 9) {
+            printf(" %8s", "-");
+            continue;
           }
-        } /* ifElse */
-      } /* jForLoop */
-  } /* iForLoop */
+          load_instance(rows, cols, land);
+          allocate_grid(&grid);
+          int val = solve_grid(&grid, e, false, false);
+          free_grid(&grid);
+          printf(" %8d%s", val, val == expected ? "" : "!");
+          wrong += (val != expected);
+        }
+        printf("\n");
+        fflush(stdout);
+      }
+    }
+  }
 
+  printf("\n %d disagreements with brute force\n", wrong);
+  return wrong;
+}
 
-  copy_grid(grid, &bestGrid);
 
-  free_grid(&thisGrid);
-  free_grid(&bestGrid);
-  free_grid(&tempGrid);
+// all the counts of one class of the priors added up
+static uint64_t prior_total(int size)
+{
+  _Atomic uint32_t *counts = &priors->counts[inducedRivers][landChoice]
+                                            [size][0][0][0];
+  uint64_t total = 0;
+  int c;
 
-  return grid;
+  for (c = 0; c < (LHO_NUM_TURNS + 1) * LHO_NUM_TURNS * PRIOR_DISTS; c++) {
+    total += atomic_load_explicit(&counts[c], memory_order_relaxed);
+  }
+  return total;
 }
 
-
-int main()
+// Learns a 4x4 and then a 5x5 meadow into empty priors and checks that each
+// only added to the counts of its own size, the 5x5 although it's searched
+// with the 4x4 counts. Returns the number of failures.
+int verify_priors(void)
 {
+  static const int grids[][3] = {{4, 4, 0}, {5, 5, 1}}; // rows, cols, size
+  struct PriorFile *saved = priors;
+  bool savedLearn = priorLearn;
+  uint64_t before[PRIOR_SIZES];
+  int k, size, wrong = 0;
+
+  priors = calloc(1, sizeof(struct PriorFile));
+  priorLearn = true;
+  for (k = 0; k < 2; k++) {
+    struct Grid grid;
+    load_instance(grids[k][0], grids[k][1], LHO_MEADOW);
+    for (size = 0; size < PRIOR_SIZES; size++) {
+      before[size] = prior_total(size);
+    }
+    allocate_grid(&grid);
+    solve_grid(&grid, LHO_ENGINE_RIVER, false, false);
+    free_grid(&grid);
+
+    printf("  %dx%d meadow:", grids[k][0], grids[k][1]);
+    for (size = 0; size < PRIOR_SIZES; size++) {
+      uint64_t added = prior_total(size) - before[size];
+      bool ok = (size == grids[k][2]) == (added > 0);
+      printf(" %llu%s", (unsigned long long)added, ok ? "" : "!");
+      wrong += !ok;
+    }
+    printf("\n");
+  }
+  free(priors);
+  priors = saved;
+  priorLearn = savedLearn;
+
+  printf("\n %d classes learned into wrongly\n", wrong);
+  return wrong;
+}
 
+// Asks for a grid on stdin and solves it, or with --regret prints its regret
+// map, or with --sample=N prints N random layouts of it. Returns the exit
+// status.
+int run_grid(enum Engine engine, bool useTable, bool regret, int numSamples,
+             int sampleMin, int sampleGap, bool sampleEmpty, uint64_t *seed)
+{
   int rows;
   int cols;
   int land;
+  int i;
 
   // Get input for optimization
   printf(" Enter information about the grid to optimize...\n\n How many rows?\n  ");
-  scanf("%d", &rows);
+  if (scanf("%d", &rows) != 1 || rows < 1 || rows > MAX_ROWS) {
+    fprintf(stderr, "The number of rows has to be 1 to %d\n", MAX_ROWS);
+    return 1;
+  }
   printf(" How many columns?\n  ");
-  scanf("%d", &cols);
+  if (scanf("%d", &cols) != 1 || cols < 1 || cols > MAX_COLS) {
+    fprintf(stderr, "The number of columns has to be 1 to %d\n", MAX_COLS);
+    return 1;
+  }
   printf(" What type of landscape tile?\n (0 = meadow, 1 = thicket, 2 = mountain, 3 = suburb):\n  ");
-  scanf("%d", &land);
-
-  init_landscape(land);
-
+  if (scanf("%d", &land) != 1 || land < 0 || land > 3) {
+    fprintf(stderr, "The landscape has to be 0 to 3\n");
+    return 1;
+  }
 
-  numRows = rows;
-  numCols = cols;
+  load_instance(rows, cols, land);
 
 
   // allocate memory for our grid
   struct Grid grid;
   allocate_grid(&grid);
 
-  printf("\n starting recursion...\n");
-  recurse_grid(&grid);
+  if (regret) {
+    int *regretVals = malloc(numRows * numCols * sizeof(int));
+    printf("\n building regret map...\n");
+    int numSkipped = regret_map(&grid, regretVals);
+    if (numSkipped < 0) {
+      printf(" can't use russian doll search on this grid, no regret map\n");
+      free(regretVals);
+      free_grid(&grid);
+      return 1;
+    }
+    print_grid(grid);
+    printf(" Value of grid: %d\n", val_calc(grid));
+    printf("\n Loss in value if each tile is blocked (%d tiles needed no search):\n",
+           numSkipped);
+    print_regret_map(regretVals);
+    free(regretVals);
+    free_grid(&grid);
+    return 0;
+  }
+
+  if (numSamples > 0) {
+    if (sampleGap >= 0) {
+      struct Grid best;
+      allocate_grid(&best);
+      sampleMin = solve_grid(&best, engine, useTable, false) - sampleGap;
+      free_grid(&best);
+      if (sampleMin < 0) {
+        sampleMin = 0;
+      }
+    }
+    double count = sampler_setup(&grid, sampleMin, sampleEmpty);
+    if (count < 0) {
+      printf(" can't sample layouts of this grid\n");
+      free_grid(&grid);
+      return 1;
+    }
+    if (sampleMin >= 0) {
+      printf("\n %.6g layouts worth at least %d\n", count, sampleMin);
+    } else {
+      printf("\n %.6g layouts\n", count);
+    }
+    for (i = 0; count > 0 && i < numSamples; i++) {
+      int val = sample_layout(&grid, seed);
+      print_grid(grid);
+      printf(" Value of grid: %d\n", val);
+    }
+    sampler_free();
+    free_grid(&grid);
+    return 0;
+  }
+
+  solve_grid(&grid, engine, useTable, true);
   print_grid(grid);
 
   int val;
   val = val_calc(grid);
   printf(" Value of grid: %d\n", val);
-
   free_grid(&grid);
   return 0;
+}
+
+// Prints what the stats flags asked for and saves what --learn-priors
+// learned, once whichever mode ran has finished
+static void finish_run(const char *profileOut, bool boundStats,
+                       bool temperStatsOn, bool memStats)
+{
+  prof_report(profileOut);
+  if (boundStats) {
+    bound_report();
+  }
+  if (temperStatsOn) {
+    temper_report();
+  }
+  if (priorLearn) {
+    prior_save();
+  }
+  if (memStats) {
+    mem_report();
+  }
+}
+
+int main(int argc, char *argv[])
+{
+
+  enum Engine engine = LHO_ENGINE_DFS;
+  bool engineSet = false;
+  const char *mapPath = NULL;
+  bool regret = false;
+  bool useTable = true;
+  bool batch = false;
+  int numThreads = 0;
+  long timeLimitMs = -1;
+  const char *profileOut = "prefix_profile.folded";
+  bool boundStats = false;
+  bool memStats = false;
+  bool temperStatsOn = false;
+  int numSamples = 0;
+  int sampleMin = -1, sampleGap = -1;
+  bool sampleEmpty = false;
+  uint64_t seed = 1;
+  int benchTiles = -1;
+  double anytimeBudget = -1;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--engine=dfs") == 0) {
+      engine = LHO_ENGINE_DFS;
+      engineSet = true;
+    } else if (strcmp(argv[i], "--engine=rds") == 0) {
+      engine = LHO_ENGINE_RDS;
+      engineSet = true;
+    } else if (strcmp(argv[i], "--engine=river") == 0) {
+      engine = LHO_ENGINE_RIVER;
+      engineSet = true;
+    } else if (strcmp(argv[i], "--engine=compiled") == 0) {
+      engine = LHO_ENGINE_COMPILED;
+      engineSet = true;
+    } else if (strcmp(argv[i], "--engine=lines") == 0) {
+      engine = LHO_ENGINE_LINES;
+      engineSet = true;
+    } else if (strcmp(argv[i], "--engine=frontier") == 0) {
+      engine = LHO_ENGINE_FRONTIER;
+      engineSet = true;
+    } else if (strcmp(argv[i], "--engine=bidir") == 0) {
+      engine = LHO_ENGINE_BIDIR;
+      engineSet = true;
+    } else if (strcmp(argv[i], "--engine=brute") == 0) {
+      engine = LHO_ENGINE_BRUTE;
+      engineSet = true;
+    } else if (strcmp(argv[i], "--engine=temper") == 0) {
+      engine = LHO_ENGINE_TEMPER;
+      engineSet = true;
+    } else if (strcmp(argv[i], "--engine=multilevel") == 0) {
+      engine = LHO_ENGINE_MULTILEVEL;
+      engineSet = true;
+    } else if (strncmp(argv[i], "--temper-rounds=", 16) == 0) {
+      temperRounds = atoi(argv[i] + 16);
+      if (temperRounds < 1) {
+        temperRounds = 1;
+      }
+    } else if (strcmp(argv[i], "--temper-stats") == 0) {
+      temperStatsOn = true;
+    } else if (strncmp(argv[i], "--frontier-dir=", 15) == 0) {
+      frontierDir = argv[i] + 15;
+    } else if (strncmp(argv[i], "--priors=", 9) == 0) {
+      priorPath = argv[i] + 9;
+    } else if (strcmp(argv[i], "--learn-priors") == 0) {
+      priorLearn = true;
+    } else if (strncmp(argv[i], "--journal=", 10) == 0) {
+      journalPath = argv[i] + 10;
+    } else if (strcmp(argv[i], "--regret") == 0) {
+      regret = true;
+    } else if (strcmp(argv[i], "--no-table") == 0) {
+      useTable = false;
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batch = true;
+    } else if (strncmp(argv[i], "--map=", 6) == 0) {
+      mapPath = argv[i] + 6;
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      numThreads = atoi(argv[i] + 10);
+    } else if (strncmp(argv[i], "--time-limit=", 13) == 0) {
+      timeLimitMs = (long)(atof(argv[i] + 13) * 1000);
+    } else if (strncmp(argv[i], "--profile-prefix=", 17) == 0) {
+#if LHO_INSTRUMENT
+      profLimit = atoi(argv[i] + 17);
+      if (profLimit > PROF_MAX_DEPTH) {
+        profLimit = PROF_MAX_DEPTH;
+      }
+#else
+      fprintf(stderr, "Built without LHO_INSTRUMENT, can't profile\n");
+      return 1;
+#endif
+    } else if (strncmp(argv[i], "--profile-out=", 14) == 0) {
+      profileOut = argv[i] + 14;
+    } else if (strcmp(argv[i], "--bounds=adaptive") == 0) {
+      boundMode = LHO_BOUNDS_ADAPTIVE;
+    } else if (strcmp(argv[i], "--bounds=all") == 0) {
+      boundMode = LHO_BOUNDS_ALL;
+    } else if (strcmp(argv[i], "--bounds=cheap") == 0) {
+      boundMode = LHO_BOUNDS_CHEAP;
+    } else if (strcmp(argv[i], "--bounds=none") == 0) {
+      boundMode = LHO_BOUNDS_NONE;
+    } else if (strcmp(argv[i], "--bound-stats") == 0) {
+      boundStats = true;
+    } else if (strncmp(argv[i], "--mem-limit=", 12) == 0) {
+      memLimit = (size_t)(atof(argv[i] + 12) * 1024 * 1024);
+    } else if (strcmp(argv[i], "--mem-stats") == 0) {
+      memStats = true;
+    } else if (strncmp(argv[i], "--sample=", 9) == 0) {
+      numSamples = atoi(argv[i] + 9);
+    } else if (strncmp(argv[i], "--sample-min=", 13) == 0) {
+      sampleMin = atoi(argv[i] + 13);
+    } else if (strncmp(argv[i], "--sample-gap=", 13) == 0) {
+      sampleGap = atoi(argv[i] + 13);
+    } else if (strcmp(argv[i], "--sample-empty") == 0) {
+      sampleEmpty = true;
+    } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+      seed = strtoull(argv[i] + 7, NULL, 10);
+    } else if (strcmp(argv[i], "--induced") == 0) {
+      inducedRivers = true;
+    } else if (strcmp(argv[i], "--layout=square") == 0) {
+      gridLayout = LHO_LAYOUT_SQUARE;
+    } else if (strcmp(argv[i], "--layout=hex") == 0) {
+      gridLayout = LHO_LAYOUT_HEX;
+    } else if (strcmp(argv[i], "--layout=generic") == 0) {
+      gridLayout = LHO_LAYOUT_GENERIC;
+    } else if (strncmp(argv[i], "--bench", 7) == 0 &&
+               (argv[i][7] == '\0' || argv[i][7] == '=')) {
+      benchTiles = argv[i][7] == '=' ? atoi(argv[i] + 8) : 0;
+    } else if (strncmp(argv[i], "--anytime", 9) == 0 &&
+               (argv[i][9] == '\0' || argv[i][9] == '=')) {
+      anytimeBudget = argv[i][9] == '=' ? atof(argv[i] + 10) : 2;
+      if (anytimeBudget <= 0) {
+        anytimeBudget = 2;
+      }
+    } else if (strncmp(argv[i], "--verify-induced", 16) == 0) {
+      int maxSize = argv[i][16] == '=' ? atoi(argv[i] + 17) : 5;
+      if (maxSize < 1 || maxSize > MAX_ROWS) {
+        maxSize = 5;
+      }
+      return verify_induced(maxSize) ? 1 : 0;
+    } else if (strncmp(argv[i], "--verify-engines", 16) == 0) {
+      int maxTiles = argv[i][16] == '=' ? atoi(argv[i] + 17) : 16;
+      if (maxTiles < 1 || maxTiles > BRUTE_MAX_CELLS) {
+        maxTiles = 16;
+      }
+      return verify_engines(maxTiles) ? 1 : 0;
+    } else if (strcmp(argv[i], "--verify-priors") == 0) {
+      return verify_priors() ? 1 : 0;
+    } else if (strncmp(argv[i], "--verify-table", 14) == 0) {
+      int maxTiles = argv[i][14] == '=' ? atoi(argv[i] + 15) : 16;
+      if (maxTiles < 1) {
+        maxTiles = 16;
+      }
+      return verify_table(maxTiles) ? 1 : 0;
+    } else if (strcmp(argv[i], "--gen-table") == 0) {
+      gen_table(stdout);
+      return 0;
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      fprintf(stderr, "Usage: %s [--engine=dfs|rds|river|compiled|lines|frontier|bidir|brute|temper|multilevel]\n"
+                      "           [--regret] [--no-table]\n"
+                      "       %s --sample=N [--sample-min=VALUE|--sample-gap=K] [--sample-empty] [--seed=S]\n"
+                      "       %s --batch [--threads=N] [--time-limit=SECONDS] [--journal=FILE] < jobs\n"
+                      "       %s --map=FILE|- [--threads=N] [--time-limit=SECONDS]\n"
+                      "       %s --bench[=MAX_TILES] [--engine=...]\n"
+                      "       %s --anytime[=SECONDS]\n"
+                      "       (any of these with [--induced] [--profile-prefix=K] [--profile-out=FILE]\n"
+                      "        [--bounds=adaptive|all|cheap|none] [--bound-stats]\n"
+                      "        [--layout=square|hex|generic] [--frontier-dir=DIR]\n"
+                      "        [--mem-limit=MB] [--mem-stats]\n"
+                      "        [--temper-rounds=N] [--temper-stats]\n"
+                      "        [--priors=FILE [--learn-priors]])\n"
+                      "       %s --gen-table > optimum_table.h\n"
+                      "       %s --verify-induced[=MAX_SIZE]\n"
+                      "       %s --verify-engines[=MAX_TILES]\n"
+                      "       %s --verify-table[=MAX_TILES]\n"
+                      "       %s --verify-priors\n",
+              argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+              argv[0], argv[0], argv[0], argv[0]);
+      return 1;
+    }
+  }
+
+  if (priorLearn && priorPath == NULL) {
+    fprintf(stderr, "--learn-priors needs --priors=FILE to keep them in\n");
+    return 1;
+  }
+  if (priorPath != NULL && !prior_load()) {
+    return 1;
+  }
+
+  if (mapPath != NULL && journalPath != NULL) {
+    fprintf(stderr, "--journal only works with --batch\n");
+    return 1;
+  }
+  if (mapPath != NULL && gridLayout == LHO_LAYOUT_HEX) {
+    fprintf(stderr, "Map mode only reads square maps\n");
+    return 1;
+  }
+
+  int status = 0;
+  if (anytimeBudget > 0) {
+    status = run_anytime(anytimeBudget);
+  } else if (benchTiles >= 0) {
+    run_bench(engine, benchTiles);
+  } else if (mapPath != NULL) {
+    // pockets are small and usually have blocked tiles, which suits rds
+    status = run_map(mapPath, engineSet ? engine : LHO_ENGINE_RDS, useTable,
+                     numThreads, timeLimitMs);
+  } else if (batch) {
+    status = run_batch(engine, useTable, numThreads, timeLimitMs);
+  } else {
+    status = run_grid(engine, useTable, regret, numSamples, sampleMin,
+                      sampleGap, sampleEmpty, &seed);
+  }
+  finish_run(profileOut, boundStats, temperStatsOn, memStats);
 
+  return status;
 }
@@ -0,0 +1,149 @@
+// Generated by LoopHeroOptimizer --gen-table, do not edit.
+// { rows, cols, landscape, value, { packed layout } }
+
+static const struct OptimumEntry optimumTable[] = {
+  { 1, 1, 0, 3, { 0x00000002u, 0x00000000u, 0x00000000u } },
+  { 1, 1, 1, 2, { 0x00000002u, 0x00000000u, 0x00000000u } },
+  { 1, 1, 2, 0, { 0x00000002u, 0x00000000u, 0x00000000u } },
+  { 1, 1, 3, 1, { 0x00000002u, 0x00000000u, 0x00000000u } },
+  { 1, 2, 0, 6, { 0x0000000au, 0x00000000u, 0x00000000u } },
+  { 1, 2, 1, 4, { 0x0000000au, 0x00000000u, 0x00000000u } },
+  { 1, 2, 2, 12, { 0x0000000au, 0x00000000u, 0x00000000u } },
+  { 1, 2, 3, 2, { 0x0000000au, 0x00000000u, 0x00000000u } },
+  { 1, 3, 0, 12, { 0x00000026u, 0x00000000u, 0x00000000u } },
+  { 1, 3, 1, 8, { 0x00000026u, 0x00000000u, 0x00000000u } },
+  { 1, 3, 2, 24, { 0x0000002au, 0x00000000u, 0x00000000u } },
+  { 1, 3, 3, 4, { 0x00000026u, 0x00000000u, 0x00000000u } },
+  { 1, 4, 0, 15, { 0x000000a6u, 0x00000000u, 0x00000000u } },
+  { 1, 4, 1, 10, { 0x000000a6u, 0x00000000u, 0x00000000u } },
+  { 1, 4, 2, 36, { 0x000000aau, 0x00000000u, 0x00000000u } },
+  { 1, 4, 3, 5, { 0x000000a6u, 0x00000000u, 0x00000000u } },
+  { 1, 5, 0, 18, { 0x000002a6u, 0x00000000u, 0x00000000u } },
+  { 1, 5, 1, 12, { 0x000002a6u, 0x00000000u, 0x00000000u } },
+  { 1, 5, 2, 48, { 0x000002aau, 0x00000000u, 0x00000000u } },
+  { 1, 5, 3, 6, { 0x000002a6u, 0x00000000u, 0x00000000u } },
+  { 1, 6, 0, 21, { 0x00000aa6u, 0x00000000u, 0x00000000u } },
+  { 1, 6, 1, 14, { 0x00000aa6u, 0x00000000u, 0x00000000u } },
+  { 1, 6, 2, 60, { 0x00000aaau, 0x00000000u, 0x00000000u } },
+  { 1, 6, 3, 7, { 0x00000aa6u, 0x00000000u, 0x00000000u } },
+  { 2, 1, 0, 6, { 0x0000000au, 0x00000000u, 0x00000000u } },
+  { 2, 1, 1, 4, { 0x0000000au, 0x00000000u, 0x00000000u } },
+  { 2, 1, 2, 12, { 0x0000000au, 0x00000000u, 0x00000000u } },
+  { 2, 1, 3, 2, { 0x0000000au, 0x00000000u, 0x00000000u } },
+  { 2, 2, 0, 15, { 0x000000a6u, 0x00000000u, 0x00000000u } },
+  { 2, 2, 1, 10, { 0x000000a6u, 0x00000000u, 0x00000000u } },
+  { 2, 2, 2, 48, { 0x000000aau, 0x00000000u, 0x00000000u } },
+  { 2, 2, 3, 5, { 0x000000a6u, 0x00000000u, 0x00000000u } },
+  { 2, 3, 0, 24, { 0x00000966u, 0x00000000u, 0x00000000u } },
+  { 2, 3, 1, 16, { 0x00000966u, 0x00000000u, 0x00000000u } },
+  { 2, 3, 2, 84, { 0x00000aaau, 0x00000000u, 0x00000000u } },
+  { 2, 3, 3, 8, { 0x00000966u, 0x00000000u, 0x00000000u } },
+  { 2, 4, 0, 33, { 0x0000a596u, 0x00000000u, 0x00000000u } },
+  { 2, 4, 1, 22, { 0x0000a596u, 0x00000000u, 0x00000000u } },
+  { 2, 4, 2, 120, { 0x0000aaaau, 0x00000000u, 0x00000000u } },
+  { 2, 4, 3, 11, { 0x0000a596u, 0x00000000u, 0x00000000u } },
+  { 2, 5, 0, 42, { 0x00099656u, 0x00000000u, 0x00000000u } },
+  { 2, 5, 1, 28, { 0x00099656u, 0x00000000u, 0x00000000u } },
+  { 2, 5, 2, 156, { 0x000aaaaau, 0x00000000u, 0x00000000u } },
+  { 2, 5, 3, 14, { 0x00099656u, 0x00000000u, 0x00000000u } },
+  { 2, 6, 0, 51, { 0x00965a56u, 0x00000000u, 0x00000000u } },
+  { 2, 6, 1, 34, { 0x00965a56u, 0x00000000u, 0x00000000u } },
+  { 2, 6, 2, 192, { 0x00aaaaaau, 0x00000000u, 0x00000000u } },
+  { 2, 6, 3, 17, { 0x00965a56u, 0x00000000u, 0x00000000u } },
+  { 3, 1, 0, 12, { 0x00000026u, 0x00000000u, 0x00000000u } },
+  { 3, 1, 1, 8, { 0x00000026u, 0x00000000u, 0x00000000u } },
+  { 3, 1, 2, 24, { 0x0000002au, 0x00000000u, 0x00000000u } },
+  { 3, 1, 3, 4, { 0x00000026u, 0x00000000u, 0x00000000u } },
+  { 3, 2, 0, 24, { 0x00000a56u, 0x00000000u, 0x00000000u } },
+  { 3, 2, 1, 16, { 0x00000a56u, 0x00000000u, 0x00000000u } },
+  { 3, 2, 2, 84, { 0x00000aaau, 0x00000000u, 0x00000000u } },
+  { 3, 2, 3, 8, { 0x00000a56u, 0x00000000u, 0x00000000u } },
+  { 3, 3, 0, 39, { 0x0002a966u, 0x00000000u, 0x00000000u } },
+  { 3, 3, 1, 26, { 0x0002a966u, 0x00000000u, 0x00000000u } },
+  { 3, 3, 2, 144, { 0x0002aaaau, 0x00000000u, 0x00000000u } },
+  { 3, 3, 3, 13, { 0x0002a966u, 0x00000000u, 0x00000000u } },
+  { 3, 4, 0, 54, { 0x005a6556u, 0x00000000u, 0x00000000u } },
+  { 3, 4, 1, 36, { 0x005a6556u, 0x00000000u, 0x00000000u } },
+  { 3, 4, 2, 204, { 0x00aaaaaau, 0x00000000u, 0x00000000u } },
+  { 3, 4, 3, 18, { 0x005a6556u, 0x00000000u, 0x00000000u } },
+  { 3, 5, 0, 72, { 0x25a99656u, 0x00000000u, 0x00000000u } },
+  { 3, 5, 1, 48, { 0x25a99656u, 0x00000000u, 0x00000000u } },
+  { 3, 5, 2, 270, { 0x29aaaaaau, 0x00000000u, 0x00000000u } },
+  { 3, 5, 3, 24, { 0x25a99656u, 0x00000000u, 0x00000000u } },
+  { 3, 6, 0, 87, { 0x6599695au, 0x00000009u, 0x00000000u } },
+  { 3, 6, 1, 58, { 0x6599695au, 0x00000009u, 0x00000000u } },
+  { 3, 6, 2, 330, { 0x6aaaaaaau, 0x0000000au, 0x00000000u } },
+  { 3, 6, 3, 29, { 0x6599695au, 0x00000009u, 0x00000000u } },
+  { 4, 1, 0, 15, { 0x000000a6u, 0x00000000u, 0x00000000u } },
+  { 4, 1, 1, 10, { 0x000000a6u, 0x00000000u, 0x00000000u } },
+  { 4, 1, 2, 36, { 0x000000aau, 0x00000000u, 0x00000000u } },
+  { 4, 1, 3, 5, { 0x000000a6u, 0x00000000u, 0x00000000u } },
+  { 4, 2, 0, 33, { 0x0000a956u, 0x00000000u, 0x00000000u } },
+  { 4, 2, 1, 22, { 0x0000a956u, 0x00000000u, 0x00000000u } },
+  { 4, 2, 2, 120, { 0x0000aaaau, 0x00000000u, 0x00000000u } },
+  { 4, 2, 3, 11, { 0x0000a956u, 0x00000000u, 0x00000000u } },
+  { 4, 3, 0, 54, { 0x00559966u, 0x00000000u, 0x00000000u } },
+  { 4, 3, 1, 36, { 0x00559966u, 0x00000000u, 0x00000000u } },
+  { 4, 3, 2, 204, { 0x00aaaaaau, 0x00000000u, 0x00000000u } },
+  { 4, 3, 3, 18, { 0x00559966u, 0x00000000u, 0x00000000u } },
+  { 4, 4, 0, 84, { 0x56655996u, 0x00000000u, 0x00000000u } },
+  { 4, 4, 1, 56, { 0x56655996u, 0x00000000u, 0x00000000u } },
+  { 4, 4, 2, 288, { 0xaaaaaaaau, 0x00000000u, 0x00000000u } },
+  { 4, 4, 3, 28, { 0x56655996u, 0x00000000u, 0x00000000u } },
+  { 4, 5, 0, 105, { 0x9965965au, 0x00000056u, 0x00000000u } },
+  { 4, 5, 1, 70, { 0x9965965au, 0x00000056u, 0x00000000u } },
+  { 4, 5, 2, 378, { 0xaaaaaaaau, 0x000000a6u, 0x00000000u } },
+  { 4, 5, 3, 35, { 0x9965965au, 0x00000056u, 0x00000000u } },
+  { 4, 6, 0, 126, { 0x96965a5au, 0x000095a9u, 0x00000000u } },
+  { 4, 6, 1, 84, { 0x96965a5au, 0x000095a9u, 0x00000000u } },
+  { 4, 6, 2, 462, { 0x9aaaaaaau, 0x0000a9aau, 0x00000000u } },
+  { 4, 6, 3, 42, { 0x96965a5au, 0x000095a9u, 0x00000000u } },
+  { 5, 1, 0, 18, { 0x000002a6u, 0x00000000u, 0x00000000u } },
+  { 5, 1, 1, 12, { 0x000002a6u, 0x00000000u, 0x00000000u } },
+  { 5, 1, 2, 48, { 0x000002aau, 0x00000000u, 0x00000000u } },
+  { 5, 1, 3, 6, { 0x000002a6u, 0x00000000u, 0x00000000u } },
+  { 5, 2, 0, 42, { 0x000a5956u, 0x00000000u, 0x00000000u } },
+  { 5, 2, 1, 28, { 0x000a5956u, 0x00000000u, 0x00000000u } },
+  { 5, 2, 2, 156, { 0x000aaaaau, 0x00000000u, 0x00000000u } },
+  { 5, 2, 3, 14, { 0x000a5956u, 0x00000000u, 0x00000000u } },
+  { 5, 3, 0, 72, { 0x2a559966u, 0x00000000u, 0x00000000u } },
+  { 5, 3, 1, 48, { 0x2a559966u, 0x00000000u, 0x00000000u } },
+  { 5, 3, 2, 270, { 0x2aa9aaaau, 0x00000000u, 0x00000000u } },
+  { 5, 3, 3, 24, { 0x2a559966u, 0x00000000u, 0x00000000u } },
+  { 5, 4, 0, 105, { 0x655996a6u, 0x00000056u, 0x00000000u } },
+  { 5, 4, 1, 70, { 0x655996a6u, 0x00000056u, 0x00000000u } },
+  { 5, 4, 2, 378, { 0xaa6aaaaau, 0x000000aau, 0x00000000u } },
+  { 5, 4, 3, 35, { 0x655996a6u, 0x00000056u, 0x00000000u } },
+  { 5, 5, 0, 138, { 0x96596696u, 0x00015a65u, 0x00000000u } },
+  { 5, 5, 1, 92, { 0x96596696u, 0x00015a65u, 0x00000000u } },
+  { 5, 5, 2, 486, { 0x96aaaaaau, 0x0002aaaau, 0x00000000u } },
+  { 5, 5, 3, 46, { 0x96596696u, 0x00015a65u, 0x00000000u } },
+  { 5, 6, 0, 168, { 0x59565a96u, 0x096a5956u, 0x00000000u } },
+  { 5, 6, 1, 112, { 0x59565a96u, 0x096a5956u, 0x00000000u } },
+  { 5, 6, 2, 594, { 0xaaaaaaaau, 0x0a9aa9aau, 0x00000000u } },
+  { 5, 6, 3, 56, { 0x59565a96u, 0x096a5956u, 0x00000000u } },
+  { 6, 1, 0, 21, { 0x00000aa6u, 0x00000000u, 0x00000000u } },
+  { 6, 1, 1, 14, { 0x00000aa6u, 0x00000000u, 0x00000000u } },
+  { 6, 1, 2, 60, { 0x00000aaau, 0x00000000u, 0x00000000u } },
+  { 6, 1, 3, 7, { 0x00000aa6u, 0x00000000u, 0x00000000u } },
+  { 6, 2, 0, 51, { 0x00a65956u, 0x00000000u, 0x00000000u } },
+  { 6, 2, 1, 34, { 0x00a65956u, 0x00000000u, 0x00000000u } },
+  { 6, 2, 2, 192, { 0x00aaaaaau, 0x00000000u, 0x00000000u } },
+  { 6, 2, 3, 17, { 0x00a65956u, 0x00000000u, 0x00000000u } },
+  { 6, 3, 0, 87, { 0x9566559au, 0x0000000au, 0x00000000u } },
+  { 6, 3, 1, 58, { 0x9566559au, 0x0000000au, 0x00000000u } },
+  { 6, 3, 2, 330, { 0xaa6aaaaau, 0x0000000au, 0x00000000u } },
+  { 6, 3, 3, 29, { 0x9566559au, 0x0000000au, 0x00000000u } },
+  { 6, 4, 0, 126, { 0x655996a6u, 0x0000aa56u, 0x00000000u } },
+  { 6, 4, 1, 84, { 0x655996a6u, 0x0000aa56u, 0x00000000u } },
+  { 6, 4, 2, 462, { 0xaa5aaaaau, 0x0000aaaau, 0x00000000u } },
+  { 6, 4, 3, 42, { 0x655996a6u, 0x0000aa56u, 0x00000000u } },
+  { 6, 5, 0, 168, { 0xa5999656u, 0x09596665u, 0x00000000u } },
+  { 6, 5, 1, 112, { 0xa5999656u, 0x09596665u, 0x00000000u } },
+  { 6, 5, 2, 594, { 0x96aaaaaau, 0x0aaaaaaau, 0x00000000u } },
+  { 6, 5, 3, 56, { 0xa5999656u, 0x09596665u, 0x00000000u } },
+  { 6, 6, 0, 207, { 0x59565a96u, 0x69655996u, 0x000000a5u } },
+  { 6, 6, 1, 138, { 0x59565a96u, 0x69655996u, 0x000000a5u } },
+  { 6, 6, 2, 726, { 0x6aaaaaaau, 0xaa6aa6aau, 0x000000a6u } },
+  { 6, 6, 3, 69, { 0x59565a96u, 0x69655996u, 0x000000a5u } },
+};